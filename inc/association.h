@@ -0,0 +1,80 @@
+/* 
+ * Hands out short addresses to nodes that ask for one
+ * Copyright (C) 2013  Richard Meadows
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef ASSOCIATION_H
+#define ASSOCIATION_H
+
+#include "radio.h"
+
+/**
+ * ======== Association ========
+ *
+ * A node without a short address sends a join request from its
+ * extended address (EUI-64)
+ * -------
+ * | 'J' |
+ * -------
+ * and the gateway replies to that extended address with a lease
+ * ------------------------------------------------------------------------
+ * | 'L' | Short Address (2) | PAN ID (2) | Gateway Address (2) | Lease (4) |
+ * ------------------------------------------------------------------------
+ * The node should use the short address, PAN ID and gateway address from
+ * then on. A node that asks again gets the same address. If the table is
+ * full the short address is RADIF_NO_SHORT_ADDRESS and the lease is how
+ * many seconds to wait before asking again.
+ *
+ * Every frame the gateway hears from a short address renews its lease,
+ * so a node only needs to join again if it's heard nothing from the
+ * gateway for Lease seconds. A lease that runs out may be given to
+ * another node, but only once the gateway knows the time. Leases
+ * renewed before then are timed from when it does. A frame from a short
+ * address in the lease range that doesn't have a lease gets an 'L' with
+ * RADIF_NO_SHORT_ADDRESS and a lease of 0, and that node should join
+ * again.
+ *
+ * Addresses are handed out from ASSOCIATION_FIRST_ADDRESS to
+ * ASSOCIATION_LAST_ADDRESS in turn, so one isn't reused until the rest
+ * have been. Nodes with addresses set by hand must keep outside this
+ * range. All fields are little endian.
+ *
+ * The leases are kept in block MEMORY_LEASE_BLOCK of the SD card, so
+ * they survive a restart. A new lease is written straight away; renewals
+ * are written every ASSOCIATION_WRITE_TICKS.
+ */
+enum {
+  ASSOCIATION_LEASES		= 31,	/* As many as fit in a block */
+  ASSOCIATION_FIRST_ADDRESS	= 0x1000,
+  ASSOCIATION_LAST_ADDRESS	= 0x7FFF,
+  ASSOCIATION_LEASE_SECS	= 60*60*24*7,	/* 1 week */
+  ASSOCIATION_RETRY_SECS	= 60*10,	/* When the table is full */
+  ASSOCIATION_WRITE_TICKS	= 2000*60*60,	/* 1 hour */
+  ASSOCIATION_MAGIC		= 0x4C454153	/* "LEAS" */
+};
+
+void association_frame_received(struct rx_frame* rx);
+void association_request(struct rx_frame* rx);
+void association_service(void);
+void association_init(void);
+
+#endif /* ASSOCIATION_H */
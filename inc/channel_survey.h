@@ -0,0 +1,73 @@
+/* 
+ * Surveys the radio channels and moves away from busy ones
+ * Copyright (C) 2013  Richard Meadows
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef CHANNEL_SURVEY_H
+#define CHANNEL_SURVEY_H
+
+#include "radio.h"
+
+/**
+ * ======== Channel Agility ========
+ * 
+ * Each radio measures the energy on one of the channels below every
+ * CHANNEL_SURVEY_SCAN_TICKS, and keeps a rolling occupancy for each: the
+ * fraction of measurements above CHANNEL_SURVEY_BUSY_ED, out of 255.
+ * 
+ * If the radio has failed channel access CHANNEL_SURVEY_FAIL_LIMIT times
+ * in a minute and another channel is quieter than
+ * CHANNEL_SURVEY_BUSY_LIMIT by CHANNEL_SURVEY_HYSTERESIS, the gateway
+ * moves. Our own channel's occupancy isn't used, as it includes our own
+ * nodes' frames. The gateway first broadcasts a 'C' frame once a second,
+ * CHANNEL_SURVEY_ANNOUNCEMENTS times
+ * -----------------------------------------------------------------
+ * | 'C' | New Frequency (2 octets) | Announcements Remaining (1)   |
+ * -----------------------------------------------------------------
+ * and changes channel after the last one. The frequency is in 100s of
+ * kHz, little endian. A node that stops hearing from the gateway should
+ * try each of the channels below in turn.
+ * 
+ * The occupancy map is stored every CHANNEL_SURVEY_RECORD_TICKS as a
+ * record of type 59. The record flags hold the radio in bits 8-11, the
+ * channel we're on in bits 4-7 and the number of channels in bits 0-3.
+ * The data words hold the occupancy of channels 0-3 and 4-7, one octet
+ * each starting from the least significant.
+ */
+enum {
+  CHANNEL_SURVEY_RECORD_TYPE	= 59,
+  CHANNEL_SURVEY_MAX_CHANNELS	= 8,	/* The most that fit in a record */
+  CHANNEL_SURVEY_SCAN_TICKS	= 2000/10,	/* 100ms */
+  CHANNEL_SURVEY_DECIDE_TICKS	= 2000*60,	/* 1 minute */
+  CHANNEL_SURVEY_RECORD_TICKS	= 2000*60*15,	/* 15 minutes */
+  CHANNEL_SURVEY_ANNOUNCE_TICKS	= 2000,	/* 1 second */
+  CHANNEL_SURVEY_ANNOUNCEMENTS	= 5,
+  CHANNEL_SURVEY_BUSY_ED	= 30,	/* PHY_ED_LEVEL, about -70dBm */
+  CHANNEL_SURVEY_BUSY_LIMIT	= 64,	/* Occupancy, out of 255 */
+  CHANNEL_SURVEY_HYSTERESIS	= 32,	/* A channel we move to is this far below BUSY_LIMIT */
+  CHANNEL_SURVEY_FAIL_LIMIT	= 20	/* tx_channel_fail per decision */
+};
+
+void channel_survey_service(void);
+void channel_survey_init(void);
+
+#endif /* CHANNEL_SURVEY_H */
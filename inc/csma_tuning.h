@@ -0,0 +1,77 @@
+/* 
+ * Tunes the CSMA and retry settings to the channel we see
+ * Copyright (C) 2013  Richard Meadows
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef CSMA_TUNING_H
+#define CSMA_TUNING_H
+
+#include "radio.h"
+
+/**
+ * ======== CSMA Tuning ========
+ *
+ * Every CSMA_TUNING_WINDOW_TICKS each radio looks at how its frames have
+ * fared since the last window. If there were at least
+ * CSMA_TUNING_MIN_ATTEMPTS it adjusts one setting:
+ *
+ * More than CSMA_TUNING_FAIL_HIGH of frames failing channel access: The
+ * channel is busy, so back off for longer. Raise csma_retries, then
+ * max_be, then as a last resort the cca_threshold so that weak
+ * interference no longer counts as busy.
+ *
+ * More than CSMA_TUNING_NOACK_HIGH of the frames that went out not being
+ * acknowledged: We're colliding with nodes we can't hear. Raise min_be to
+ * spread our attempts out, then frame_retries.
+ *
+ * Both under CSMA_TUNING_LOW for CSMA_TUNING_RELAX_WINDOWS in a row: Step
+ * one setting back towards its default, the cca_threshold first and
+ * min_be last.
+ *
+ * Each setting stays between its default and the CSMA_TUNING_MAX_xxx
+ * limit below. Every change is printed and stored as a record of type
+ * 56. The record flags hold the radio in bits 24-25, the last TRAC status
+ * in bits 20-22 and the new settings in bits 0-19, packed as for
+ * RADIF_SET_CSMA. The left data holds the frames that were acknowledged
+ * in the window in bits 0-15 and those that failed channel access in bits
+ * 16-31. The right data holds those that weren't acknowledged in bits
+ * 0-11 and the old settings in bits 12-31.
+ */
+enum {
+  CSMA_TUNING_RECORD_TYPE	= 56,
+  CSMA_TUNING_WINDOW_TICKS	= 2000*60,	/* 1 minute */
+  CSMA_TUNING_MIN_ATTEMPTS	= 10,	/* Frames per window */
+  CSMA_TUNING_FAIL_HIGH		= 26,	/* Out of 255, about 10% */
+  CSMA_TUNING_NOACK_HIGH	= 64,	/* Out of 255, about 25% */
+  CSMA_TUNING_LOW		= 8,	/* Out of 255, about 3% */
+  CSMA_TUNING_RELAX_WINDOWS	= 5,
+  CSMA_TUNING_MAX_FRAME_RETRIES	= 5,
+  CSMA_TUNING_MAX_CSMA_RETRIES	= 5,	/* The radio doesn't do more than 5 */
+  CSMA_TUNING_MAX_BE		= 8,	/* The largest backoff exponent the radio allows */
+  CSMA_TUNING_MAX_CCA_THRESHOLD	= 0xB	/* About 8dB less sensitive than the default */
+};
+
+uint32_t csma_tuning_defaults(void);
+void csma_tuning_service(void);
+void csma_tuning_init(void);
+
+#endif /* CSMA_TUNING_H */
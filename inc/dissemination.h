@@ -0,0 +1,96 @@
+/* 
+ * Broadcasts firmware and configuration images to the nodes
+ * Copyright (C) 2013  Richard Meadows
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef DISSEMINATION_H
+#define DISSEMINATION_H
+
+#include "radio.h"
+#include "memory/memory.h"
+
+/**
+ * ======== Image Dissemination ========
+ *
+ * An image for the nodes, like new firmware or configuration, is written
+ * to the SD card from block MEMORY_IMAGE_BLOCK. That block is a header
+ * ------------------------------------------------------------------------
+ * | "IMG1" | Image (2) | Kind (1) | Reserved (1) | Length (4) | CRC-32 (4) |
+ * ------------------------------------------------------------------------
+ * and the image follows from the next block on, up to 128KB of it. The
+ * image number should change for every new image, and the kind tells the
+ * nodes what it's for. The CRC-32 is of the whole image. Once it's
+ * started the gateway checks the image against it,
+ * DISSEMINATION_CHECK_BLOCKS SD blocks a tick, and only sends it if it
+ * matches.
+ *
+ * The image is sent in DISSEMINATION_BLOCK_SIZE blocks, the last one
+ * possibly shorter, in rounds. Each round starts with a poll
+ * -------------------------------------------------------------------------
+ * | 'Q' | Image (2) | Kind (1) | Length (4) | CRC-32 (4) | Block Size (1)  |
+ * -------------------------------------------------------------------------
+ * ---------------
+ * | Round (1)   |
+ * ---------------
+ * Within DISSEMINATION_NAK_TICKS a node that wants the image and is
+ * missing blocks of it replies with one or more NAKs, at a random point
+ * in that time so that they don't all collide
+ * ----------------------------------------------------------------------
+ * | 'N' | Image (2) | First Block (2) | Bitmap (1 to DISSEMINATION_MAX_NAK) |
+ * ----------------------------------------------------------------------
+ * Bit n of the bitmap, least significant first in each octet, is set if
+ * block First Block + n is missing. A node that has no part of the image
+ * sets every bit. A node that has it all, or doesn't want it, stays
+ * quiet.
+ *
+ * The gateway then broadcasts the blocks anyone is missing, just once
+ * however many nodes asked for them
+ * --------------------------------------------------
+ * | 'I' | Image (2) | Block (2) | Data              |
+ * --------------------------------------------------
+ * and polls again. Once DISSEMINATION_QUIET_POLLS polls in a row go
+ * unanswered, after DISSEMINATION_MAX_ROUNDS rounds, or if it can't read
+ * a block from the SD card DISSEMINATION_READ_FAILURES times in a row,
+ * it stops. It polls again every DISSEMINATION_REPOLL_TICKS for nodes
+ * that have joined since, and a NAK at any time starts a new round. All
+ * fields are little endian.
+ */
+enum {
+  DISSEMINATION_BLOCK_SIZE	= 64,
+  DISSEMINATION_MAX_BLOCKS	= ((MEMORY_IMAGE_BLOCKS - 1) * 512) / DISSEMINATION_BLOCK_SIZE,
+  DISSEMINATION_HEADER		= 5,
+  DISSEMINATION_POLL_LENGTH	= 14,
+  DISSEMINATION_MAX_NAK		= 64,	/* Octets of bitmap */
+  DISSEMINATION_NAK_TICKS	= 2000*3,	/* 3 seconds */
+  DISSEMINATION_QUIET_POLLS	= 3,
+  DISSEMINATION_MAX_ROUNDS	= 16,
+  DISSEMINATION_REPOLL_TICKS	= 2000*60*60,	/* 1 hour */
+  DISSEMINATION_READ_FAILURES	= 8,
+  DISSEMINATION_CHECK_BLOCKS	= 2,	/* SD blocks checked each tick */
+  DISSEMINATION_MAGIC		= 0x31474D49	/* "IMG1" */
+};
+
+void dissemination_nak(struct rx_frame* rx);
+void dissemination_service(void);
+void dissemination_init(void);
+
+#endif /* DISSEMINATION_H */
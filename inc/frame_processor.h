@@ -27,7 +27,121 @@
 
 #include "radio.h"
 
+/**
+ * ======== Upload Protocol ========
+ *
+ * Single upload ('U'): Acknowledged one record at a time
+ * -------------------------------------------------------------------
+ * | 'U' | Memory Address (4 octets) | Record (MEMORY_RECORD_SIZE)   |
+ * -------------------------------------------------------------------
+ * The gateway replies with an 'A' frame for each record it stores
+ * ---------------------------------------------------------------
+ * | 'A' | Memory Address (4 octets) | Record Checksum (4 octets) |
+ * ---------------------------------------------------------------
+ * A record the gateway has stored recently (it keeps the last
+ * UPLOAD_FILTER_SIZE or so) is acknowledged again but not stored twice.
+ *
+ * Windowed upload ('W'): The same layout as 'U', but acknowledged
+ * selectively. A node that uses 'W' frames must follow these rules:
+ *
+ *  - The memory address is a record index on the node, increasing by
+ *    one for each record (modulo 2^32).
+ *  - At most UPLOAD_WINDOW_SIZE records may be in flight past the
+ *    oldest record that has not yet been acknowledged.
+ *  - A record that has been in flight for longer than a few ack
+ *    periods (UPLOAD_WINDOW_ACK_TICKS) should be re-sent.
+ *
+ * Rather than replying to every frame, the gateway sends one 'S'
+ * frame per node after UPLOAD_WINDOW_ACK_RECORDS new records or
+ * UPLOAD_WINDOW_ACK_TICKS, whichever comes first.
+ * ------------------------------------------------------------------
+ * | 'S' | Cumulative Address (4 octets) | SACK Bitmap (4 octets)   |
+ * ------------------------------------------------------------------
+ * Every record before the cumulative address has been stored. The
+ * cumulative address itself has not. Bit n of the bitmap is set if
+ * record (cumulative address + 1 + n) has also been stored, so the
+ * node only needs to re-send the records whose bits are clear.
+ *
+ * A record more than UPLOAD_WINDOW_SIZE behind the cumulative address,
+ * or further than UPLOAD_WINDOW_SIZE ahead of it, restarts the window
+ * at that record. All fields are little endian.
+ *
+ * Compressed upload ('Z'): Up to UPLOAD_DELTA_MAX_RECORDS records with
+ * consecutive memory addresses, each coded against the one before
+ * ----------------------------------------------------------------------
+ * | 'Z' | Memory Address (4 octets) | Key & Count (1) | Checksum (4)    |
+ * ----------------------------------------------------------------------
+ * ------------------------------------------
+ * | Record | Record | ...                   |
+ * ------------------------------------------
+ * The memory address is the first record's, and the checksum is the
+ * last record's. Bit 7 of the next octet is set for a key frame and bits
+ * 0-6 are the number of records. Each record is
+ * --------------------------------------------------------------------
+ * | Control (1) | Flags (0 or 4) | Time | Left | Right                |
+ * --------------------------------------------------------------------
+ * Flags are only sent when bit 0 of the control octet is set, otherwise
+ * they're the same as the last record's. Time, left and right are each
+ * the difference from the last record, zigzag coded (0, -1, 1, -2...) as
+ * a varint: 7 bits an octet, least significant first, with bit 7 set on
+ * every octet but the last.
+ *
+ * In a key frame the first record is coded against zeros, so it can be
+ * decoded on its own. Otherwise the gateway needs the last record of the
+ * node's previous 'Z' frame, and the memory address has to follow on
+ * from it. When the checksum of the decoded last record matches, every
+ * record is stored and acknowledged with an 'A' frame for the last one.
+ * A repeat of the last frame we decoded is acknowledged again.
+ *
+ * A frame we can't decode, because we've missed one or lost our state,
+ * gets a key frame request
+ * ----------------------------------
+ * | 'K' | Memory Address (4 octets) |
+ * ----------------------------------
+ * and the node should send the records from that address again, starting
+ * with a key frame. A node that doesn't get its 'A' should do the same.
+ *
+ * ======== Back-pressure ========
+ *
+ * A record the gateway couldn't store, because its memory is full or the
+ * write failed, is never acknowledged. For 'U' and 'Z' frames it gets a
+ * hold frame instead
+ * ----------------------------------------------------
+ * | 'H' | Memory Address (4 octets) | Back-off (1)   |
+ * ----------------------------------------------------
+ * The record at the memory address and everything after it in the same
+ * frame wasn't stored. The node should keep them and send them again
+ * after Back-off seconds; a 'Z' node starts again with a key frame.
+ *
+ * When memory is nearly full (fewer than UPLOAD_BACKOFF_LOW_BLOCKS free)
+ * or nothing has been uploaded from it for UPLOAD_BACKOFF_STALL_SECS,
+ * 'A' and 'S' frames carry the same Back-off octet after their usual
+ * fields. The records they acknowledge have been stored, but the node
+ * should wait that long before sending any more. A frame without the
+ * octet means there's no need to wait.
+ */
+enum {
+  UPLOAD_FILTER_SIZE		= 64,	/* Must be a power of two */
+  UPLOAD_WINDOW_SIZE		= 32,
+  UPLOAD_WINDOW_NODES		= 8,
+  UPLOAD_WINDOW_ACK_RECORDS	= 8,
+  UPLOAD_WINDOW_ACK_TICKS	= 2000/20,	/* 50ms of frame_processor_service() calls */
+  UPLOAD_DELTA_NODES		= 8,
+  UPLOAD_DELTA_MAX_RECORDS	= 32,
+  UPLOAD_DELTA_HEADER		= 10,
+  UPLOAD_DELTA_KEY		= 0x80,
+  UPLOAD_BACKOFF_LOW_BLOCKS	= 2048,	/* 1MB of memory left */
+  UPLOAD_BACKOFF_STALL_SECS	= 60*15,	/* Three missed uploads */
+  UPLOAD_BACKOFF_FULL_SECS	= 240,
+  UPLOAD_BACKOFF_STALLED_SECS	= 30,
+  UPLOAD_BACKOFF_HOLD_SECS	= 10	/* The least we ask for after refusing a record */
+};
+
+uint8_t upload_backoff(uint8_t refused);
 void block_uploaded(struct rx_frame* rx);
-void frame_processor_init();
+void window_block_uploaded(struct rx_frame* rx);
+void delta_block_uploaded(struct rx_frame* rx);
+void frame_processor_service(void);
+void frame_processor_init(void);
 
 #endif /* FRAME_PROCESSOR_H */
@@ -0,0 +1,100 @@
+/* 
+ * Authenticates frames from the nodes
+ * Copyright (C) 2013  Richard Meadows
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef FRAME_SECURITY_H
+#define FRAME_SECURITY_H
+
+#include "radio.h"
+
+/**
+ * Frames that aren't secured are dropped once there are keys on the SD
+ * card. Set FRAME_SECURITY_REQUIRED to 1 to drop them even without keys.
+ * Set FRAME_SECURITY_HW_AES to 0 to do all the AES in software.
+ */
+#define FRAME_SECURITY_REQUIRED	0
+#define FRAME_SECURITY_HW_AES	1
+
+/**
+ * ======== Frame Security ========
+ *
+ * Nodes secure their frames as in IEEE 802.15.4-2006 §7.5.8, with CCM*
+ * and one of up to FRAME_SECURITY_MAX_KEYS keys. The key is picked by the
+ * key index in the auxiliary security header. Frames with key identifier
+ * mode 0 have no key index, and are dropped.
+ *
+ * There are no keys in the firmware. They're read from block
+ * MEMORY_KEY_BLOCK of the SD card as it starts up
+ * -----------------------------------------------------------------------
+ * | "KEYS" | CRC-32 (4) | Count (1) | Reserved (3) | Keys (20 octets each) |
+ * -----------------------------------------------------------------------
+ * where each key is its key index (1), 3 reserved octets and the 16
+ * octet key. The CRC-32 is of everything after it, up to the end of
+ * FRAME_SECURITY_MAX_KEYS keys. See README.md for writing them to the
+ * card. Without valid keys every secured frame is dropped. With them
+ * every frame that isn't secured is.
+ *
+ * Security levels 1-3 authenticate the header and payload with a 4, 8 or
+ * 16 octet MIC. Levels 5-7 do the same but also encrypt the payload,
+ * which is decrypted in place. Levels 0 and 4 carry no MIC and are
+ * treated like frames that aren't secured at all.
+ *
+ * The nonce is the source's extended address, the frame counter and the
+ * security level. Nodes using a short address don't send their extended
+ * one, so for them (PAN ID << 16) | short address stands in for it. This
+ * isn't in the standard and the nodes have to do the same.
+ *
+ * The last frame counter from each source is kept, and frames that don't
+ * move it forward are dropped as replays. That includes MAC
+ * retransmissions of a frame we've already accepted. There's room for
+ * FRAME_SECURITY_REPLAY_SIZE sources, more than the node table holds. A
+ * source's counter is only forgotten once it's been quiet for
+ * FRAME_SECURITY_REPLAY_IDLE_TICKS; until then frames from new sources
+ * are dropped if there's no room for them.
+ *
+ * The counters are written to the SD card from block MEMORY_REPLAY_BLOCK
+ * every FRAME_SECURITY_WRITE_TICKS if they've moved, and read back as the
+ * gateway starts. Only frames accepted in the last
+ * FRAME_SECURITY_WRITE_TICKS before a restart could be replayed after it.
+ *
+ * The AES can run on the transceiver's engine or in software. Around
+ * FRAME_SECURITY_BENCH_TICKS after startup both are timed on a
+ * FRAME_SECURITY_BENCH_LEN octet frame and the results are printed.
+ */
+enum {
+  FRAME_SECURITY_MAX_KEYS	= 8,
+  FRAME_SECURITY_KEY_MAGIC	= 0x5359454B,	/* "KEYS" */
+  FRAME_SECURITY_REPLAY_PER_BLOCK	= 31,	/* As many as fit in a block */
+  FRAME_SECURITY_REPLAY_SIZE	= 31,	/* One block */
+  FRAME_SECURITY_REPLAY_IDLE_TICKS	= 2000*60*60*24,	/* 1 day */
+  FRAME_SECURITY_REPLAY_MAGIC	= 0x53525443,	/* "CTRS" */
+  FRAME_SECURITY_WRITE_TICKS	= 2000*60,	/* 1 minute */
+  FRAME_SECURITY_BENCH_TICKS	= 2000*10,	/* 10 seconds */
+  FRAME_SECURITY_BENCH_LEN	= 100
+};
+
+uint8_t frame_security_frame(struct rx_frame* rx);
+void frame_security_service(void);
+void frame_security_init(void);
+
+#endif /* FRAME_SECURITY_H */
@@ -24,9 +24,20 @@
 #ifndef HTTP_H
 #define HTTP_H
 
-int http_header(char* buffer, char* auth, uint16_t records_count);
+/**
+ * The most slots a record can take, and the most characters
+ * json_element or json_filler will write.
+ */
+enum {
+  JSON_MAX_SLOTS		= 4,
+  JSON_MAX_ELEMENT_CHARS	= JSON_MAX_SLOTS * (180 + 1)	/* JSON_RECORD_CHARS and a comma */
+};
+
+int http_header(char* buffer, char* auth, uint16_t slots_count);
 int json_header(char* buffer);
+uint16_t json_element_slots(uint32_t* binary_data);
 int json_element(char* buffer, uint32_t* binary_data, uint8_t comma);
+int json_filler(char* buffer, uint16_t slots, uint8_t comma);
 int json_footer(char* buffer);
 
 #endif /* HTTP_H */
@@ -26,6 +26,8 @@
 #ifndef INIT_SERVICE_H
 #define INIT_SERVICE_H
 
+#include "radio.h"
+
 /* net_init_service.c */
 void net_init(void);
 void net_service(void);
@@ -33,6 +35,8 @@ void net_service(void);
 /* radio_init_service.c */
 void radio_init(void);
 void radio_service(void);
+void radio_clock_time(uint32_t at, struct radif* radif, uint32_t* secs, uint32_t* us);
+void radio_rx_time(struct rx_frame* rx, uint32_t* secs, uint32_t* us);
 
 /* memory/memory.c */
 uint8_t memory_init(void);
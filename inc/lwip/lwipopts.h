@@ -43,8 +43,9 @@
 #define IP_SOF_BROADCAST				1
 #define IP_SOF_BROADCAST_RECV				1
 
-/* Stops a memory leak in ip_frag, still doesn't make it work though */
-#define IP_FRAG_USES_STATIC_BUF				1
+/* Nothing we send is bigger than the MTU, so don't fragment. ip_frag
+   didn't work anyway, and its static buffer takes 1.5K of RAM */
+#define IP_FRAG						0
 
 /* The ethernet FCS is performed in hardware. The IP, TCP, and UDP
    CRCs still need to be done in software. */
@@ -94,9 +95,9 @@
 
 #define LWIP_SOCKET					0
 #define LWIP_NETCONN					0
-#define MEMP_NUM_SYS_TIMEOUT				300
+#define MEMP_NUM_SYS_TIMEOUT				16
 
-#define LWIP_STATS					1
+#define LWIP_STATS					0
 #define LINK_STATS					0
 #define LWIP_STATS_DISPLAY				0
 
@@ -32,6 +32,8 @@ enum {
   CHECKSUM_FAIL	= 0
 };
 
+uint32_t update_crc32(uint32_t crc, uint8_t* data, uint16_t length);
+uint32_t calculate_crc32(uint8_t* data, uint16_t length);
 uint32_t calculate_checksum(uint8_t* block);
 uint32_t get_checksum(uint8_t* block);
 uint8_t evaluate_checksum(uint8_t* block);
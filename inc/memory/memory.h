@@ -39,6 +39,40 @@
 enum {
   MEMORY_RECORD_SIZE	= 24
 };
+/**
+ * A long record (type 57) carries up to MEMORY_LONG_RECORD_MAX octets of
+ * data in the rest of its block, straight after the record. Word 3 of
+ * the record is the length of the data and word 4 is its CRC-32.
+ */
+enum {
+  MEMORY_LONG_RECORD_TYPE	= 57,
+  MEMORY_LONG_RECORD_MAX	= 384	/* Must be a multiple of 4 too */
+};
+/**
+ * The blocks below MEMORY_FIRST_RECORD_BLOCK are reserved:
+ *
+ *   0		The memory indexes
+ *   1		The association leases, see association.h
+ *   2		Keys for frame security, see frame_security.h
+ *   3		Frame counters for frame security
+ *   4-7	Spare, for small tables
+ *   8-264	An image for the nodes, a header then 128KB, see dissemination.h
+ *   265-511	Spare
+ *
+ * Records are stored from MEMORY_FIRST_RECORD_BLOCK onwards. Block 0 also
+ * notes the first record block the card was written with, and
+ * memory_init() moves any records left in blocks that have since been
+ * reserved. See README.md for the layout as a whole.
+ */
+enum {
+  MEMORY_LEASE_BLOCK		= 1,
+  MEMORY_KEY_BLOCK		= 2,
+  MEMORY_REPLAY_BLOCK		= 3,
+  MEMORY_REPLAY_BLOCKS		= 1,
+  MEMORY_IMAGE_BLOCK		= 8,
+  MEMORY_IMAGE_BLOCKS		= 257,	/* A header, then 128KB */
+  MEMORY_FIRST_RECORD_BLOCK	= 512
+};
 /**
  * The size of the SD card in bytes (-1 encoded)
  */
@@ -46,7 +80,14 @@ enum {
   SD_SIZE = 0x3FFFFFFF /* 1 gigabyte */
 };
 
-uint32_t mem_buf[MEMORY_RECORD_SIZE/4];
+/**
+ * A whole block, shared by everything that reads or writes blocks from
+ * the RIT: records on their way to the server, and the reserved blocks.
+ * memory_sector_block is the block it holds a copy of, or 0 if it
+ * doesn't hold one.
+ */
+uint8_t memory_sector[512] __attribute__ ((aligned (8)));
+uint32_t memory_sector_block;
 
 struct memory_indexes {
   uint32_t write_index;
@@ -55,6 +96,12 @@ struct memory_indexes {
 
 uint8_t get_memory_indexes(struct memory_indexes* indexes);
 uint8_t put_memory_indexes(struct memory_indexes* indexes);
+uint8_t get_lease_block(uint8_t* buffer, uint16_t length);
+uint8_t put_lease_block(uint8_t* buffer, uint16_t length);
+uint8_t get_key_block(uint8_t* buffer, uint16_t length);
+uint8_t get_replay_block(uint8_t* buffer, uint16_t length, uint8_t index);
+uint8_t put_replay_block(uint8_t* buffer, uint16_t length, uint8_t index);
+uint8_t get_image_block(uint8_t* buffer, uint16_t length, uint16_t index);
 
 uint8_t invalidate_block(uint32_t address);
 uint32_t next_block(uint32_t current_address);
@@ -62,7 +109,9 @@ uint32_t next_block(uint32_t current_address);
 uint32_t* get_sample(uint32_t index);
 uint32_t get_current_read_block(void);
 uint16_t get_blocks_to_read(void);
+uint32_t get_blocks_free(void);
 uint8_t put_sample(uint8_t* block);
+uint8_t put_long_sample(uint8_t* block, uint16_t length);
 
 void good_upload_done(void);
 void bad_upload_done(void);
@@ -25,7 +25,9 @@
 #ifndef WRITE_H
 #define WRITE_H
 
-void write_sample_to_mem(uint32_t record_flags,
-			 uint32_t left_data, uint32_t right_data,
-			 uint32_t time_ago);
+uint8_t write_sample_to_mem(uint32_t record_flags,
+			    uint32_t left_data, uint32_t right_data,
+			    uint32_t time_ago);
+uint8_t write_long_record_to_mem(uint32_t record_flags, uint32_t* block,
+				 uint16_t length, uint32_t time_ago);
 #endif /* WRITE_H */
@@ -0,0 +1,83 @@
+/* 
+ * Keeps link and traffic statistics for each node
+ * Copyright (C) 2013  Richard Meadows
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef NODE_TABLE_H
+#define NODE_TABLE_H
+
+#include "radio.h"
+
+/**
+ * Statistics are kept in an open-addressed hash table keyed by source
+ * address. When the table reaches NODE_TABLE_MAX_NODES the node we heard
+ * from least recently is dropped to make room.
+ *
+ * Every NODE_TABLE_SNAPSHOT_TICKS the table is stored as two records of
+ * type 58 for each node, one per tick. In both the record flags hold the
+ * address in bits 0-15, the ED average in bits 16-23 and the part in
+ * bits 24-25.
+ *
+ *  Part 0: Frames received, then bytes received
+ *  Part 1: Records stored (bits 0-15) and duplicates (bits 16-31), then
+ *          checksum failures (bits 0-15) and seconds since we last heard
+ *          from the node (bits 16-31)
+ *
+ * The counts are totals since the node was added, so they wrap.
+ *
+ * If a node doesn't hear our MAC acknowledgement it sends the same frame
+ * again with the same sequence number. We keep a window of the last
+ * NODE_TABLE_SEQ_WINDOW sequence numbers from each node so these can be
+ * dropped. They count as duplicates.
+ */
+enum {
+  NODE_TABLE_SIZE		= 32,	/* Must be a power of two */
+  NODE_TABLE_BITS		= 5,
+  NODE_TABLE_MAX_NODES		= 24,	/* Keeps the probe sequences short */
+  NODE_TABLE_RECORD_TYPE	= 58,
+  NODE_TABLE_SNAPSHOT_TICKS	= 2000*60*15,	/* 15 minutes */
+  NODE_TABLE_SEQ_WINDOW		= 8,
+  NODE_TABLE_SEQ_SECONDS	= 2	/* After this the node may have restarted */
+};
+
+struct node_stats {
+  uint16_t address; /* 0 if this entry is empty */
+  uint8_t ed_average; /* Of the frames we've received */
+  uint32_t frames;
+  uint32_t bytes;
+  uint16_t records; /* Stored to memory */
+  uint16_t duplicates; /* Records we already had */
+  uint16_t checksum_failures;
+  uint32_t last_seen; /* Gateway time, seconds */
+  uint8_t seq_last; /* The latest MAC sequence number */
+  uint8_t seq_window; /* Bit n is set if we've had seq_last - n */
+};
+
+struct node_stats* node_table_find(uint16_t address);
+uint8_t node_table_frame(struct rx_frame* rx);
+void node_table_record_stored(uint16_t address);
+void node_table_duplicate(uint16_t address);
+void node_table_checksum_failure(uint16_t address);
+void node_table_service(void);
+void node_table_init(void);
+
+#endif /* NODE_TABLE_H */
@@ -0,0 +1,44 @@
+/* 
+ * AES-128 block cipher in software
+ * Copyright (C) 2013  Richard Meadows
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef AES_H
+#define AES_H
+
+#include <stdint.h>
+
+/**
+ * AES-128 encryption, which is all CCM* needs. This doesn't touch the
+ * hardware, so it also builds on a host for testing.
+ */
+struct aes_key {
+  uint32_t rk[44]; /* The round keys */
+};
+
+/* ---- Function type definition for a block cipher, see ccm.h ---- */
+typedef void (*aes_block_func) (const uint8_t* in, uint8_t* out, void* context);
+
+void aes_set_key(const uint8_t* key, struct aes_key* aes);
+void aes_encrypt(const uint8_t* in, uint8_t* out, void* aes);
+
+#endif /* AES_H */
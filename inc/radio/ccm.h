@@ -0,0 +1,61 @@
+/* 
+ * CCM* authenticated encryption
+ * Copyright (C) 2013  Richard Meadows
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef CCM_H
+#define CCM_H
+
+#include <stdint.h>
+#include "aes.h"
+
+/**
+ * CCM* as used by IEEE 802.15.4-2006 security (Annex B): CCM with a 13
+ * octet nonce and a two octet length, and a MIC of 0, 4, 8 or 16
+ * octets. The block cipher is passed in, so the same code runs on the
+ * transceiver's AES engine or aes_encrypt.
+ *
+ * a is authenticated only, m is authenticated and, if encrypt is set,
+ * encrypted in place. With a mic_len of 0 there's no authentication at
+ * all. ccm_star_open returns 0 if the MIC matches, and decrypts m either
+ * way.
+ */
+struct ccm_cipher {
+  aes_block_func encrypt;
+  void* context;
+};
+
+enum {
+  CCM_NONCE_LEN		= 13,
+  CCM_MAX_MIC		= 16
+};
+
+void ccm_star_seal(struct ccm_cipher* cipher, const uint8_t* nonce,
+		   const uint8_t* a1, uint8_t a1_len, const uint8_t* a2, uint8_t a2_len,
+		   uint8_t* m, uint8_t m_len, uint8_t encrypt,
+		   uint8_t* mic, uint8_t mic_len);
+uint8_t ccm_star_open(struct ccm_cipher* cipher, const uint8_t* nonce,
+		      const uint8_t* a1, uint8_t a1_len, const uint8_t* a2, uint8_t a2_len,
+		      uint8_t* m, uint8_t m_len, uint8_t encrypt,
+		      const uint8_t* mic, uint8_t mic_len);
+
+#endif /* CCM_H */
@@ -44,6 +44,12 @@ enum {
   FRAME_VERSION_IEEE_2006	= 1,
   FRAME_VERSION_IEEE_2003	= 0
 };
+/* Auxiliary Security Header */
+enum {
+  SECURITY_LEVEL_MASK		= 0x07,
+  SECURITY_KEY_ID_MODE_SHIFT	= 3,
+  SECURITY_KEY_ID_MODE_MASK	= 0x03
+};
 /* Frame Addressing */
 enum {
   FRAME_NO_ADDRESS		= 0,
@@ -51,7 +57,8 @@ enum {
   FRAME_PAN_ID_64BIT_ADDR	= 3
 };
 
-uint8_t ieee_header_len(struct tx_frame* tx);
+uint8_t ieee_address_len(uint8_t mode);
+uint8_t ieee_header_len(struct tx_frame* tx, struct radif* radif);
 void write_out_ieee_header(struct tx_frame* tx, struct radif* radif);
 uint8_t read_in_ieee_header(struct rx_frame* rx, struct radif* radif);
 #endif /* IEEE_FRAME_H */
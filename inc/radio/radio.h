@@ -27,14 +27,28 @@
 
 #include <stdint.h>
 
-#define NUM_TXFRAMES		8
+#define NUM_TXFRAMES		8	/* Shared by all the priorities, at most 8 */
+#define NUM_TXFRAMES_BULK	6	/* Leaving the rest for time sync replies and acks */
+#define TX_QUEUE_LENGTH		(NUM_TXFRAMES+1) /* So one queue can hold all of them */
 #define NUM_RXFRAMES		8
+#define NUM_COMMANDS		8
+#define NUM_LINKS		8	/* Destinations we adapt the rate and power for */
+#define NUM_AIRTIME_BUCKETS	60	/* Minutes in the duty cycle window */
+#define RADIO_SHADOW_SIZE	0x30	/* Covers every register up to CSMA_BE */
+#define RADIO_MAX_MHR		37	/* Both addresses extended, plus the longest security header */
 
 /* ---- Function type definitions for the hardware functions we need ---- */
 typedef void (*pin_set_func) (void);
 typedef uint8_t (*spi_xfer_func) (uint8_t);
-typedef void (*delay_us_func) (uint32_t);
+typedef void (*timer_start_func) (uint32_t);
+typedef uint32_t (*clock_func) (void);
 typedef void (*interrupt_trigger_func) (void);
+typedef void (*critical_func) (void);
+
+struct radif;
+
+/* ---- Function type definition for the transmit completion callback ---- */
+typedef void (*tx_callback_func) (uint16_t destination_address, uint8_t status, struct radif* radif);
 
 /* ---- Data transfer structures ---- */
 struct rx_frame {
@@ -42,47 +56,172 @@ struct rx_frame {
   uint8_t length;
   uint8_t crc_status;
   uint8_t energy_detect;
-  uint16_t source_address;
+  uint16_t source_address; /* RADIF_NO_SHORT_ADDRESS if it came from an extended address */
+  uint64_t source_ext_address; /* If it came from an extended address */
+  uint8_t source_addr_mode; /* See FRAME_PAN_ID_xxx in ieee_frame.h */
+  uint16_t source_pan_id;
+  uint8_t seq; /* MAC sequence number */
+  uint8_t to_us; /* Addressed to this interface or broadcast. Only ever 0 in promiscuous mode */
+  uint32_t rx_time; /* When the frame started arriving, on radif->clock_us */
+  uint8_t security_level; /* From the auxiliary security header, 0 if it wasn't secured */
+  uint8_t key_index;
+  uint32_t frame_counter;
+  uint8_t mhr[RADIO_MAX_MHR]; /* The header as received, for checking the MIC */
+  uint8_t mhr_len; /* Only set if security_level isn't 0 */
+  struct radif* radif; /* The interface this frame arrived on */
 };
 struct tx_frame {
   uint8_t data[0x7F];
   uint8_t length;
   uint8_t ack;
+  uint8_t flags;
+  uint8_t dest_addr_mode; /* See FRAME_PAN_ID_xxx in ieee_frame.h */
   uint16_t destination_address;
+  uint64_t dest_ext_address;
+  tx_callback_func callback;
+  uint32_t queued_at; /* When radif_send queued this frame, in µs */
+  uint8_t deferred; /* Set once it's been held back for the duty cycle */
+};
+/* -------- Transmit priorities, highest first -------- */
+enum {
+  RADIF_PRIORITY_TIME = 0,	/* Time sync replies. The node sets its clock from these */
+  RADIF_PRIORITY_ACK,		/* Upload acknowledgements */
+  RADIF_PRIORITY_BULK,		/* Everything else */
+  NUM_TX_PRIORITIES
+};
+/* ---- A queue of frames to transmit at one priority ---- */
+struct tx_queue {
+  volatile uint8_t ConsumeIndex, ProduceIndex;
+  uint8_t Frames[TX_QUEUE_LENGTH]; /* Indexes into radif->TxFrames */
+
+  /* ---- Statistics: Time between radif_send and the start of transmission ---- */
+  uint32_t delay_last; /* µs */
+  uint32_t delay_average; /* µs, moving average over about 8 frames */
+  uint32_t delay_max; /* µs */
+};
+
+/* ---- The rate and power we use to reach a destination. See radio_link.h ---- */
+struct radif_link {
+  uint8_t in_use;
+  uint16_t address;
+  uint8_t rate; /* OQPSK_DATA_RATE, 0 is the slowest */
+  uint8_t power_step; /* 0 is the configured power, higher is lower */
+  uint8_t ed_average; /* Of the frames we've received from this destination */
+  uint8_t successes; /* Acknowledged in a row since the last change */
+  uint8_t failures; /* Not acknowledged in a row */
+  uint16_t last_used;
+};
+
+struct radif_airtime {
+  uint8_t running; /* Set once the bucket has been filled for the first time */
+  uint32_t last_update; /* clock_us when we last brought this up to date */
+  uint32_t tokens; /* µs of airtime we can use right now */
+  uint32_t tokens_remainder; /* Fractions of a token carried over */
+  uint32_t used[NUM_AIRTIME_BUCKETS]; /* µs of airtime used in each minute of the window */
+  uint32_t window; /* µs of airtime used in the whole window */
+  uint32_t bucket_time; /* µs into the current bucket */
+  uint8_t bucket; /* The bucket we're filling */
+  uint32_t tx_estimate; /* µs for one attempt at the frame being sent */
+  uint32_t tx_header_us; /* µs of that for the SHR and PHR */
 };
 
 /* ---- Function type definition for the received callback ---- */
 typedef void (*rx_callback_func) (struct rx_frame*);
 
+/* ---- Function type definition for the sniffer, see radif->sniff ---- */
+typedef void (*sniff_func) (struct rx_frame* rx, uint8_t* psdu, uint8_t len, struct radif* radif);
+
+/* ---- Function type definition for the command completion callback ---- */
+typedef void (*command_callback_func) (uint8_t command, uint8_t output, struct radif* radif);
+
+struct radif_command {
+  uint8_t command;
+  uint8_t flags; /* See RADIF_COMMAND_xxx below */
+  uint32_t argument; /* The new setting, if RADIF_COMMAND_ARGUMENT is set */
+  command_callback_func callback;
+};
+
 /* ---- Represents an interface to a radio ---- */
 struct radif {
   /* ---- Data ---- */
   volatile uint8_t RxProduceIndex, RxConsumeIndex;
-  volatile uint8_t TxConsumeIndex, TxProduceIndex;
 
   struct rx_frame RxFrames[NUM_RXFRAMES];
-  struct tx_frame TxFrames[NUM_TXFRAMES];
+  struct tx_frame TxFrames[NUM_TXFRAMES]; /* Shared by the queues */
+  volatile uint8_t TxFramesUsed; /* Bit n is set while TxFrames[n] is queued */
+  struct tx_queue TxQueues[NUM_TX_PRIORITIES]; /* Sent in strict priority order */
+
+  struct radif_link Links[NUM_LINKS];
+  uint16_t link_clock; /* Ages the links */
+
+  struct radif_airtime airtime; /* Our share of the channel */
+
+  struct radif_command Commands[NUM_COMMANDS];
+  volatile uint8_t CommandConsumeIndex, CommandProduceIndex;
+
+  /* ---- State Machine ---- */
+  uint8_t command_step; /* How far through the current command we are */
+  uint8_t command_retries;
+  uint8_t command_output; /* Passed to the completion callback */
+  uint8_t command_batch; /* The last command asked for the next to follow straight on */
+  volatile uint8_t waiting; /* See RADIF_WAIT_xxx below */
+  uint8_t irq_status; /* Interrupts seen but not yet consumed by a step */
+  uint8_t irq_late; /* Interrupts read while we were reading a frame */
+  uint32_t irq_time; /* clock_us as we started handling the last interrupt */
+  uint8_t irq_time_late; /* Its TRX_END was read earlier, so irq_time is too late */
 
-  volatile uint8_t Command, CommandOutput;
+  /* ---- Shadow copy of the radio's configuration registers ---- */
+  uint8_t shadow[RADIO_SHADOW_SIZE];
+  uint64_t shadow_valid; /* Bit n is set if shadow[n] matches register n */
+  uint8_t state; /* The last TRX_STATUS we know of */
+  uint8_t state_known; /* Non-zero if state can't have changed since */
 
   /* ---- Configuration ---- */
   uint8_t clkm_config; /* See §7.7.6 (p120) of the AT86RF212 datasheet */
   uint8_t auto_crc_gen; /* 0: Don't automatically CRC  Otherwise: Replace the last two bytes of outgoing frames with a CRC */
   uint8_t promiscuous; /* 0: Only frames matching our address are received.  Otherwise: All frames are received regardless of destination */
   uint16_t freq; /* The frequency of the radio */
+  uint16_t scan_freq; /* The frequency RADIF_ENERGY_SCAN measures */
   uint8_t power; /* The power of the radio */
   uint8_t modulation; /* The modulation of the radio */
   uint16_t pan_id; /* Addressing */
   uint16_t short_address; /* 16 bit address */
+  uint64_t ext_address; /* EUI-64, or 0 if we don't have one */
+  uint8_t tx_full_policy; /* What radif_send does when the tx buffer is full. See RADIF_TX_DROP_xxx */
+  uint32_t tx_block_timeout; /* For RADIF_TX_BLOCK, how long to wait in µs */
+  uint8_t link_adaptation; /* Non-zero to adapt the rate and power to each destination */
+  uint8_t frame_retries; /* MAX_FRAME_RETRIES, attempts after the first that isn't acknowledged */
+  uint8_t csma_retries; /* MAX_CSMA_RETRIES, backoffs after finding the channel busy */
+  uint8_t min_be, max_be; /* The CSMA backoff exponents */
+  uint8_t cca_threshold; /* CCA_ED_THRES, the channel is busy above RSSI_BASE_VAL + 2 * this dB */
 
   /* A flag to signify if the radio is operational */
   uint8_t up;
 
+  /* The result of the last RADIF_ENERGY_SCAN */
+  uint8_t energy_level;
+
+  /* Which of the board's radios this is, for debug output */
+  uint8_t index;
+
   /* The current sequence ID we're transmitting at */
   uint8_t seq;
 
+  /* The completion callback for the frame currently being transmitted */
+  tx_callback_func tx_callback;
+  uint16_t tx_destination_address;
+  struct radif_link* tx_link; /* The link that frame is using */
+  /* When the last frame we sent finished its PHR, on clock_us. That's when
+   * a receiver takes its rx_time. Only right for frames without an ack,
+   * and only if tx_time_known */
+  uint32_t tx_time;
+  uint8_t tx_time_known;
+
   /* The callback function for when data is received */
   rx_callback_func rx_callback;
+  /* Optional. Called from the radio interrupt with the raw PSDU of every
+   * frame we read, including those rx_callback won't see */
+  sniff_func sniff;
 
   /* ---- Pointers to the hardware functions we need for the radio interface ---- */
   pin_set_func spi_start;
@@ -92,18 +231,41 @@ struct radif {
   pin_set_func slptr_clear;
   pin_set_func reset_set;
   pin_set_func reset_clear;
-  delay_us_func delay_us;
+  timer_start_func timer_start; /* Calls radio_timer_irq() after the given number of µs */
+  clock_func clock_us; /* A free-running count of µs */
+  clock_func rx_capture_us; /* clock_us when the last frame started, latched by hardware. Optional */
   interrupt_trigger_func interrupt_trigger;
+  critical_func enter_critical; /* Holds off the radio interrupts */
+  critical_func exit_critical;
 
   /* ---- Statistics ---- */
   uint16_t rx_success_count;
   uint16_t rx_overflow;
+  uint16_t rx_invalid; /* Frames with a header we can't decode */
+  uint16_t rx_duplicate; /* MAC retransmissions dropped by the receive callback */
+  uint16_t rx_protected; /* Frames dropped because the frame buffer was protected */
+  uint16_t rx_other; /* Addressed to someone else, seen in promiscuous mode */
+  uint32_t rx_latency_last; /* µs from a frame arriving to its callback */
+  uint32_t rx_latency_average; /* µs, moving average over about 8 frames */
+  uint32_t rx_latency_max; /* µs */
 
   uint16_t tx_success_count;
   uint16_t tx_channel_fail;
   uint16_t tx_noack;
   uint16_t tx_invalid;
 
+  uint16_t tx_drop_full; /* Dropped by radif_send, the tx buffer was full */
+  uint16_t tx_drop_ack; /* Queued acknowledgements dropped to make space */
+  uint16_t tx_drop_timeout; /* Timed out waiting for space in the tx buffer */
+  uint16_t tx_drop_down; /* The interface was down and the tx buffer was full */
+  uint16_t tx_drop_invalid; /* Too long to fit in a frame */
+
+  uint16_t link_changes; /* Times a destination's rate or power was changed */
+
+  uint64_t tx_airtime; /* µs of airtime used since startup */
+  uint16_t tx_deferred; /* Frames held back for the duty cycle */
+  uint16_t tx_coalesced; /* Frames dropped because a later one superseded them */
+
   uint16_t last_trac_status;
 };
 
@@ -111,6 +273,29 @@ struct radif {
 enum {
   BLANK_SPI_CHARACTER		= 0
 };
+/* A node that only has an extended address has this short address */
+enum {
+  RADIF_NO_SHORT_ADDRESS	= 0xFFFE
+};
+/* -------- Transmit flags -------- */
+enum {
+  RADIF_TX_ACK_REQUEST		= 0x01,	/* Ask the destination for a MAC acknowledgement */
+  RADIF_TX_UPLOAD_ACK		= 0x02,	/* Acknowledges a node's frame. The node retries if this is lost */
+  RADIF_TX_TIME_CRITICAL	= 0x04,	/* Latency sensitive, goes ahead of everything else */
+  RADIF_TX_SUPERSEDES		= 0x08	/* Replaces any earlier queued frame of the same type to the same destination */
+};
+/* -------- What radif_send does when the tx buffer is full -------- */
+enum {
+  RADIF_TX_DROP_NEWEST = 0,	/* Drop the frame being sent */
+  RADIF_TX_DROP_OLDEST_ACK,	/* For RADIF_TX_UPLOAD_ACK frames drop the oldest queued one, otherwise the newest */
+  RADIF_TX_BLOCK		/* Wait up to tx_block_timeout µs. Never use this from the radio interrupt */
+};
+/* -------- State machine waits -------- */
+enum {
+  RADIF_WAIT_NONE = 0,
+  RADIF_WAIT_TIMER,		/* Until the timer expires */
+  RADIF_WAIT_EVENT		/* Until the timer expires or the radio raises an interrupt */
+};
 /* -------- Radio Commands -------- */
 enum {
   RADIF_NO_COMMAND = 0,
@@ -123,7 +308,28 @@ enum {
   RADIF_SET_ADDRESS,
   RADIF_ENERGY,
   RADIF_WAKE,
-  RADIF_SLEEP
+  RADIF_SLEEP,
+  RADIF_ENERGY_SCAN,
+  RADIF_SET_PROMISCUOUS,
+  RADIF_SET_CSMA
+};
+/**
+ * -------- Radio Command Flags --------
+ *
+ * A command with an argument sets what it applies as it starts, in the
+ * radio interrupt. The argument is the new modulation, freq, power or
+ * promiscuous for those commands, (pan_id << 16) | short_address for
+ * RADIF_SET_ADDRESS and scan_freq for RADIF_ENERGY_SCAN. RADIF_SET_CSMA
+ * takes frame_retries in bits 0-3, csma_retries in bits 4-6, min_be in
+ * bits 8-11, max_be in bits 12-15 and cca_threshold in bits 16-19.
+ *
+ * The commands in a batch run one straight after the other. Nothing is
+ * sent between them, and only the first waits for the radio to finish
+ * with a frame.
+ */
+enum {
+  RADIF_COMMAND_ARGUMENT	= 0x01,
+  RADIF_COMMAND_CONTINUE	= 0x02	/* Set by radif_command_batch */
 };
 /* -------- Radio Modulation Modes -------- */
 enum {
@@ -169,9 +375,21 @@ enum {
   TRAC_INVALID               = 7
 };
 
-uint8_t radif_command(uint8_t command, struct radif* radif); /* Do a command */
+uint8_t radif_command(uint8_t command, command_callback_func callback, struct radif* radif); /* Queue a command */
+uint8_t radif_command_arg(uint8_t command, uint32_t argument,
+			  command_callback_func callback, struct radif* radif); /* With a new setting */
+uint8_t radif_command_batch(const struct radif_command* commands, uint8_t count,
+			    struct radif* radif); /* Queue commands to run together */
 void radif_service(struct radif* radif); /* Calls the receive callback on all pending frames */
-void radif_send(uint8_t* frame, uint8_t len, uint16_t dest_addr, uint8_t ack, struct radif* radif); /* Transmits a frame over the radio interface */
+uint8_t radif_send_to(uint8_t* frame, uint8_t len, uint8_t dest_mode,
+		      uint16_t dest_addr, uint64_t dest_ext, uint8_t flags,
+		      tx_callback_func callback, struct radif* radif); /* Transmits a frame over the radio interface */
+uint8_t radif_send(uint8_t* frame, uint8_t len, uint16_t dest_addr, uint8_t flags,
+		   tx_callback_func callback, struct radif* radif); /* To a short address */
+uint8_t radif_send_ext(uint8_t* frame, uint8_t len, uint64_t dest_ext, uint8_t flags,
+		       tx_callback_func callback, struct radif* radif); /* To an extended address */
+uint8_t radif_reply(struct rx_frame* rx, uint8_t* frame, uint8_t len, uint8_t flags,
+		    tx_callback_func callback); /* To wherever rx came from */
 void radif_init_struct(struct radif* radif); /* Initialises the radio interface */
 
 #endif /* RADIO_H */
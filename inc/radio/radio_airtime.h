@@ -0,0 +1,64 @@
+/* 
+ * Airtime and duty cycle accounting
+ * Copyright (C) 2013  Richard Meadows
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef RADIO_AIRTIME_H
+#define RADIO_AIRTIME_H
+
+#include "radio.h"
+
+/**
+ * In the 868MHz band each sub-band limits the fraction of any hour we can
+ * spend transmitting (ERC Recommendation 70-03, Annex 1). We estimate the
+ * airtime of every frame from its length and the modulation it's sent
+ * at, and charge each attempt the radio makes at it.
+ *
+ * Two budgets are kept. The hour is a sliding window of one minute
+ * buckets, and no frame is started that could take it over the limit.
+ * Within that a token bucket fills at the duty cycle rate and holds up to
+ * RADIO_AIRTIME_BURST_S worth, which spreads our transmissions out over
+ * the hour. Bulk frames are only sent while more than a quarter of the
+ * bucket is left, and only take the hour up to three quarters of the
+ * limit. That keeps the rest for acknowledgements and time replies, even
+ * when something like an image for the nodes is being broadcast.
+ * A frame that can't be sent yet stays at the head of its queue until
+ * there's enough for it.
+ *
+ * AT86RF212 doesn't tell us how many retries a frame took, so an
+ * acknowledged frame is charged for one attempt and an unacknowledged one
+ * for all of them.
+ */
+enum {
+  RADIO_AIRTIME_BUCKET_US	= 60*1000*1000,	/* 1 minute */
+  RADIO_AIRTIME_BURST_S		= 60,	/* Seconds of the duty cycle the token bucket holds */
+  RADIO_AIRTIME_NO_LIMIT	= 1000	/* In 1/1000ths */
+};
+
+uint16_t radio_airtime_limit(uint16_t freq);
+uint32_t radio_airtime_estimate(struct tx_frame* tx, uint8_t modulation, struct radif* radif);
+void radio_airtime_update(struct radif* radif);
+uint8_t radio_airtime_allow(uint8_t priority, struct tx_frame* tx, struct radif* radif);
+void radio_airtime_tx_start(struct tx_frame* tx, struct radif* radif);
+void radio_airtime_tx_done(uint8_t status, struct radif* radif);
+
+#endif /* RADIO_AIRTIME_H */
@@ -107,6 +107,8 @@ enum {
 };
 /* Useful bits */
 enum {
+  RADIO_RX_SAFE_MODE		= 0x80,
+  RADIO_IRQ_2_EXT_EN		= 0x40,
   RADIO_AUTO_CRC_GEN		= 0x20,
   RADIO_PROMISCUOUS		= 0x2
 };
@@ -149,8 +151,28 @@ enum {
   /* Misc */
   TIME_PLL_LOCK_TIME          = 200,
   TIME_TRX_IRQ_DELAY          = 9,
-  TIME_IRQ_PROCESSING_DLY     = 32
+  TIME_IRQ_PROCESSING_DLY     = 32,
+
+  /* Polling intervals for the state machine */
+  TIME_REG_ACCESS             = 2,	/* A register access at 6.25MHz takes longer than this */
+  TIME_TRANS_POLL             = 9,	/* Check again on a state transition in progress */
+  TIME_BUSY_POLL              = 250,	/* Check again on a busy state if TRX_END doesn't come first */
+  TIME_ED_MEASUREMENT         = 400,	/* 8 symbols at 20kbit/s, CCA_ED_DONE normally comes first */
+  TIME_AES_ECB                = 24	/* One block through the AES engine */
 };
+/**
+ * The state machine is made up of step functions that never wait on the
+ * radio themselves. They return RADIO_STEP_DONE when finished, or the time
+ * in µs to wait before they should be called again. Waits of
+ * TIME_REG_ACCESS or less are covered by the next register access, so the
+ * step is called again straight away. Longer waits use the hardware timer.
+ *
+ * If RADIO_WAIT_EVENT is set then the wait is only a timeout, and the step
+ * is called again as soon as the radio raises an interrupt.
+ */
+#define RADIO_STEP_DONE		0
+#define RADIO_STEP_NEXT		1
+#define RADIO_WAIT_EVENT	0x80000000
 /* Transceiver commands */
 enum {
   CMD_NOP                 = 0,
@@ -195,6 +217,18 @@ enum {
   RADIO_SPI_CMD_SR				= 0x00,		/* SRAM Read. */
   RADIO_SPI_CMD_RADDRM			= 0x7F		/* Register Address Mask. */
 };
+/* The AES engine, reached with the SRAM commands. See §9.1 in the AT86RF212 datasheet */
+enum {
+  RADIO_AES_STATUS			= 0x82,
+  RADIO_AES_CTRL			= 0x83,
+  RADIO_AES_STATE			= 0x84,		/* 16 octets, the key or the data */
+  RADIO_AES_CTRL_MIRROR			= 0x94,
+  RADIO_AES_REQUEST			= 0x80,		/* AES_CTRL: Start the operation */
+  RADIO_AES_MODE_ECB			= 0x00,
+  RADIO_AES_MODE_KEY			= 0x10,
+  RADIO_AES_DONE			= 0x01,		/* AES_STATUS */
+  RADIO_AES_ER				= 0x80
+};
 /* Interrupt Masks */
 enum {
   RADIO_IRQ_BAT_LOW			= 0x80,		/* Mask for the BAT_LOW interrupt. */
@@ -206,6 +240,9 @@ enum {
   RADIO_IRQ_PLL_LOCK			= 0x01  	/* Mask for the PLL_LOCK interrupt. */
 };
 
+/* -------- Shadow Registers -------- */
+uint8_t radio_reg_is_shadowed(uint8_t addr);
+void radio_shadow_invalidate(struct radif* radif);
 /* -------- Register Read, Write & Read-Modify-Write -------- */
 uint8_t radio_reg_read(uint8_t addr, struct radif* radif);
 uint16_t radio_reg_read16(uint8_t addr, struct radif* radif);
@@ -221,24 +258,39 @@ void radio_frame_write(struct tx_frame* tx, struct radif* radif);
 void radio_sram_read(uint8_t addr, uint8_t len, uint8_t* data, struct radif* radif);
 void radio_sram_write(uint8_t addr, uint8_t len, uint8_t* data, struct radif* radif);
 /* -------- Radio State -------- */
+uint8_t radio_state_is_stable(uint8_t state);
 uint8_t radio_get_state(struct radif* radif);
+void radio_state_command(uint8_t command, struct radif* radif);
+void radio_state_irq(uint8_t intp_src, struct radif* radif);
 uint8_t radio_is_state_busy(struct radif* radif);
 uint8_t radio_get_trac(struct radif* radif);
 /* -------- Set Radio Properties -------- */
-void radio_set_modulation(struct radif* radif);
-uint8_t radio_set_freq(struct radif* radif);
+uint32_t radio_set_modulation(struct radif* radif);
+uint32_t radio_write_freq(uint16_t freq, struct radif* radif);
+uint32_t radio_set_freq(struct radif* radif);
 void radio_set_pwr(struct radif* radif);
 void radio_set_address(struct radif* radif);
+void radio_set_promiscuous(struct radif* radif);
+void radio_set_csma(struct radif* radif);
 /* -------- Set State  -------- */
-uint8_t radio_set_state(uint8_t state, struct radif* radif);
+uint32_t radio_set_state(uint8_t state, struct radif* radif);
+uint32_t radio_step_to_state(uint8_t state, struct radif* radif);
 /* -------- Wake & Sleep -------- */
-void radio_sleep(struct radif* radif);
-void radio_wake(struct radif* radif);
+uint32_t radio_sleep(struct radif* radif);
+uint32_t radio_wake(struct radif* radif);
 /* -------- Misc -------- */
 uint8_t radio_get_random(struct radif* radif);
-uint8_t radio_measure_energy(struct radif* radif);
+uint32_t radio_random_number(struct radif* radif);
+uint32_t radio_energy_start(struct radif* radif);
+uint32_t radio_energy_result(struct radif* radif);
+uint32_t radio_measure_energy(struct radif* radif);
+uint32_t radio_energy_scan(struct radif* radif);
+/* -------- AES -------- */
+void radio_aes_set_key(const uint8_t* key, struct radif* radif);
+uint8_t radio_aes_encrypt(const uint8_t* in, uint8_t* out, struct radif* radif);
 /* -------- Reset -------- */
-uint8_t radio_reset(struct radif* radif);
+uint32_t radio_reset(struct radif* radif);
 void radio_config(struct radif* radif);
+uint32_t radio_startup(struct radif* radif);
 
 #endif /* RADIO_FUNCTIONS_H */
@@ -26,5 +26,6 @@
 #define RADIO_IRQ_H
 
 void radio_irq(struct radif* radif);
+void radio_timer_irq(struct radif* radif);
 
 #endif /* RADIO_IRQ_H */
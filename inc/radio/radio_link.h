@@ -0,0 +1,56 @@
+/* 
+ * Adapts the data rate and power to each destination
+ * Copyright (C) 2013  Richard Meadows
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef RADIO_LINK_H
+#define RADIO_LINK_H
+
+#include "radio.h"
+
+/**
+ * The AT86RF212 receiver detects the data rate of each O-QPSK frame from
+ * its header, so within one chip rate we can choose the data rate (the
+ * OQPSK_DATA_RATE bits of TRX_CTRL_2) frame by frame without the node
+ * having to do anything. The same goes for our transmit power.
+ *
+ * Every destination starts at the configured modulation and power. After
+ * RADIO_LINK_UP_SUCCESSES acknowledged frames in a row we turn the power
+ * down if the node is very strong, or else step the data rate up if the
+ * node is strong enough for it. RADIO_LINK_DOWN_FAILURES unacknowledged
+ * frames in a row undo the last of these.
+ */
+enum {
+  RADIO_LINK_MAX_RATE		= 2,	/* 4x the slowest rate */
+  RADIO_LINK_UP_SUCCESSES	= 16,
+  RADIO_LINK_DOWN_FAILURES	= 2,
+  RADIO_LINK_RATE_ED		= 12,	/* ED needed for rate 1 */
+  RADIO_LINK_RATE_ED_STEP	= 6,	/* And 6dB more for each rate above that */
+  RADIO_LINK_POWER_ED		= 40	/* Strong enough that we can turn the power down */
+};
+
+void radio_link_rx(struct rx_frame* rx, struct radif* radif);
+void radio_link_apply(uint16_t address, struct radif* radif);
+void radio_link_tx_done(uint8_t status, struct radif* radif);
+void radio_link_restore(struct radif* radif);
+
+#endif /* RADIO_LINK_H */
@@ -27,8 +27,28 @@
 
 #include "radio.h"
 
-/* This is the object that represents the interface to the AT86RF212 */
-struct radif rf212_radif;
+/**
+ * The number of AT86RF212s fitted. They share SSP0 and each one has its
+ * own pins, interrupt, channel and modulation. Up to two are supported,
+ * see rf212_functions.h for the pins.
+ */
+#define RF212_NUM_RADIOS	1
+
+/* Radio 0 */
+#define RF212_0_FREQ		8683
+#define RF212_0_MODULATION	RADIF_OQPSK_400KCHIPS_200KBITS_S
+#define RF212_0_POWER		0xe8
+
+/* Radio 1. Nodes split between the two by the frequency they're set up for */
+#define RF212_1_FREQ		8695
+#define RF212_1_MODULATION	RADIF_OQPSK_400KCHIPS_200KBITS_S
+#define RF212_1_POWER		0xe8
+
+/* How long rf212_init waits for the radios to start up, in µs */
+#define RF212_STARTUP_TIMEOUT	100000
+
+/* These are the objects that represent the interfaces to the AT86RF212s */
+struct radif rf212_radif[RF212_NUM_RADIOS];
 
 void rf212_init(rx_callback_func callback);
 void rf212_service();
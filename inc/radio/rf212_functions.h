@@ -36,19 +36,41 @@
 #define	 RF212_SPI_BLOCK	LPC_SSP1
 #endif
 
-/* The slave select pin - P0[16] */
-#define RF212_SSEL_PORT		LPC_GPIO0
-#define RF212_SSEL_PIN		16
+/* Radio 0: The slave select pin - P0[16] */
+#define RF212_0_SSEL_PORT	LPC_GPIO0
+#define RF212_0_SSEL_PIN	16
 
-/* The reset pin - P2[5] */
-#define RF212_RESET_PORT	LPC_GPIO2
-#define RF212_RESET_PIN		1
+/* Radio 0: The reset pin - P2[1] */
+#define RF212_0_RESET_PORT	LPC_GPIO2
+#define RF212_0_RESET_PIN	1
 
-/* The sleep trigger pin - P2[6] */
-#define RF212_SLPTR_PORT	LPC_GPIO2
-#define RF212_SLPTR_PIN		2
+/* Radio 0: The sleep trigger pin - P2[2] */
+#define RF212_0_SLPTR_PORT	LPC_GPIO2
+#define RF212_0_SLPTR_PIN	2
 
-/* NOTE: The interrupt can be configured at the bottom of rf212_functions.c */
+/* Radio 0: The interrupt pin - P2[11] / EINT1 */
+#define RF212_0_EINT		1
+
+/* Radio 0: The frame start timestamp, DIG2 - P1[26] / CAP0.0 */
+#define RF212_0_CAP		0
+
+/* Radio 1: The slave select pin - P0[23] */
+#define RF212_1_SSEL_PORT	LPC_GPIO0
+#define RF212_1_SSEL_PIN	23
+
+/* Radio 1: The reset pin - P2[4] */
+#define RF212_1_RESET_PORT	LPC_GPIO2
+#define RF212_1_RESET_PIN	4
+
+/* Radio 1: The sleep trigger pin - P2[5] */
+#define RF212_1_SLPTR_PORT	LPC_GPIO2
+#define RF212_1_SLPTR_PIN	5
+
+/* Radio 1: The interrupt pin - P2[12] / EINT2 */
+#define RF212_1_EINT		2
+
+/* Radio 1: The frame start timestamp, DIG2 - P1[27] / CAP0.1 */
+#define RF212_1_CAP		1
 
 #define FIFOSIZE 8
 
@@ -95,20 +117,29 @@
 #define SSPICR_RTIC     (0x1<<1)
 
 /* -------- Pins -------- */
-void rf212_reset_enable();
-void rf212_reset_disable();
-void rf212_slptr_enable();
-void rf212_slptr_disable();
-void rf212_spi_enable();
-void rf212_spi_disable();
+void rf212_reset_enable(uint8_t n);
+void rf212_reset_disable(uint8_t n);
+void rf212_slptr_enable(uint8_t n);
+void rf212_slptr_disable(uint8_t n);
+void rf212_spi_enable(uint8_t n);
+void rf212_spi_disable(uint8_t n);
 /* -------- SPI -------- */
 uint8_t rf212_xfer(uint8_t data);
 void rf212_spi_init();
 /* -------- Initialisation -------- */
-void rf212_io_init();
+void rf212_io_init(uint8_t n);
+uint8_t rf212_eint_radio(uint8_t eint);
 /* -------- Timer -------- */
-void rf212_delay_us(uint32_t us);
+void rf212_timer_init();
+void rf212_timer_start(uint8_t n, uint32_t us);
+uint8_t rf212_timer_expired();
+uint32_t rf212_clock_us();
+uint32_t rf212_capture_us(uint8_t n);
+/* -------- Critical Sections -------- */
+void rf212_enter_critical();
+void rf212_exit_critical();
 /* -------- High Priority Interrupt -------- */
-void rf212_trigger_interrupt(void);
+void rf212_trigger_interrupt(uint8_t n);
+uint8_t rf212_triggered();
 
 #endif /* RF212_FUNCTIONS_H */
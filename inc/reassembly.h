@@ -0,0 +1,83 @@
+/* 
+ * Reassembles long records sent in several frames
+ * Copyright (C) 2013  Richard Meadows
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef REASSEMBLY_H
+#define REASSEMBLY_H
+
+#include "radio.h"
+#include "memory/memory.h"
+
+/**
+ * ======== Fragmented Transfers ========
+ *
+ * A node sends anything longer than a record, like a full spectrum, as
+ * a transfer of up to REASSEMBLY_MAX_FRAGMENTS 'F' frames
+ * ------------------------------------------------------------------------
+ * | 'F' | Transfer (1) | Fragment (1) | Fragment Size (1) | Length (2)   |
+ * ------------------------------------------------------------------------
+ * -----------------------------------
+ * | Record Kind (1) | Data          |
+ * -----------------------------------
+ * Every fragment but the last carries Fragment Size octets of data, and
+ * the last carries the rest of Length. Length can be up to
+ * MEMORY_LONG_RECORD_MAX. The transfer number should change for each
+ * transfer a node makes, and every fragment of a transfer must give the
+ * same size, length and kind.
+ *
+ * When the last fragment arrives the gateway replies with a 'G' frame
+ * ---------------------------------------------------
+ * | 'G' | Transfer (1) | Received Bitmap (4 octets) |
+ * ---------------------------------------------------
+ * Bit n of the bitmap is set if fragment n has arrived. The node sends
+ * the fragments that are missing, and then the last fragment again to
+ * get another 'G'. Once every bit is set the data has been stored as a
+ * long record; if the 'G' is lost, sending any fragment of the transfer
+ * again gets another.
+ *
+ * If the gateway can't store the finished transfer its 'G' has an empty
+ * bitmap and a Back-off octet after it, and the node should send the
+ * whole transfer again after that many seconds. A 'G' for a stored
+ * transfer can have a Back-off octet too. See the back-pressure notes in
+ * frame_processor.h.
+ *
+ * Each transfer in progress takes one of REASSEMBLY_BUFFERS buffers,
+ * which is freed after REASSEMBLY_TIMEOUT_TICKS without a fragment. A
+ * node only gets one at a time; starting a new transfer abandons the
+ * last. Fragments that arrive when every buffer is busy are dropped.
+ *
+ * The long record's flags hold the node's address in bits 0-15 and the
+ * record kind in bits 16-23. All fields are little endian.
+ */
+enum {
+  REASSEMBLY_BUFFERS		= 2,
+  REASSEMBLY_MAX_FRAGMENTS	= 32,	/* Bits in the 'G' bitmap */
+  REASSEMBLY_HEADER		= 7,
+  REASSEMBLY_TIMEOUT_TICKS	= 2000*10	/* 10 seconds */
+};
+
+void reassembly_frame(struct rx_frame* rx);
+void reassembly_service(void);
+void reassembly_init(void);
+
+#endif /* REASSEMBLY_H */
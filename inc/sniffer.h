@@ -0,0 +1,75 @@
+/* 
+ * Streams received frames to a collector as ZEP
+ * Copyright (C) 2013  Richard Meadows
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef SNIFFER_H
+#define SNIFFER_H
+
+#include "radio.h"
+
+/**
+ * Set to 1 to stream every frame the radios hear to SNIFFER_COLLECTOR.
+ * This puts the radios in promiscuous mode.
+ */
+#define SNIFFER_ENABLED		0
+#define SNIFFER_COLLECTOR	"192.168.1.8"
+
+/**
+ * ======== Sniffer ========
+ *
+ * Each frame is copied from the radio interrupt into a ring of
+ * SNIFFER_RING_SIZE, with its ED level, CRC status and timestamp. The
+ * main loop sends them to SNIFFER_COLLECTOR over UDP as ZEP version 2
+ * data packets, SNIFFER_BATCH to a datagram or whatever's there after
+ * SNIFFER_FLUSH_TICKS.
+ * ---------------------------------------------------------------------
+ * | "EX" | Version 2 (1) | Type 1 (1) | Channel (1) | Device ID (2)    |
+ * ---------------------------------------------------------------------
+ * ---------------------------------------------------------------------
+ * | CRC Mode 1 (1) | LQI (1) | NTP Timestamp (8) | Sequence (4)        |
+ * ---------------------------------------------------------------------
+ * --------------------------------------------------------------
+ * | Reserved (10) | Length (1) | PSDU, including the FCS        |
+ * --------------------------------------------------------------
+ * Fields are big endian. The device ID is the radio the frame arrived on
+ * and the LQI is its PHY_ED_LEVEL. Each packet gives its own length, so a
+ * collector can split a batch; set SNIFFER_BATCH to 1 for tools that
+ * expect one packet to a datagram.
+ *
+ * Frames that arrive with the ring full, or that we can't get a buffer
+ * for, are counted and dropped. The normal receive path never waits on
+ * the sniffer.
+ */
+enum {
+  SNIFFER_PORT		= 17754,	/* ZEP */
+  SNIFFER_RING_SIZE	= 8,
+  SNIFFER_BATCH		= 4,
+  SNIFFER_FLUSH_TICKS	= 2000/20,	/* 50ms */
+  SNIFFER_ZEP_HEADER	= 32
+};
+
+void sniffer_frame(struct rx_frame* rx, uint8_t* psdu, uint8_t len, struct radif* radif);
+void sniffer_service(void);
+void sniffer_init(void);
+
+#endif /* SNIFFER_H */
@@ -25,6 +25,8 @@ void ntp_set_current_time(uint32_t secs, uint32_t us);
 
 /* Returns the current 64-bit time (Epoch 1970.0) */
 uint64_t get_current_time();
+/* Reads the seconds and microseconds straight from the timer */
+void get_timer_time(uint32_t* secs, uint32_t* us);
 uint8_t is_time_valid();
 void print_current_time();
 
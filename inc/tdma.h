@@ -0,0 +1,72 @@
+/* 
+ * Schedules upload slots for each node
+ * Copyright (C) 2013  Richard Meadows
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef TDMA_H
+#define TDMA_H
+
+#include "radio.h"
+
+/**
+ * Set to 1 to give each node its own upload slot. Useful on sites with
+ * more than a handful of nodes, where contention costs more than it saves.
+ */
+#define TDMA_ENABLED	0
+
+/**
+ * ======== Slotted Uploads ========
+ *
+ * Each second on the gateway's clock (Timer 3) is a superframe. At the
+ * start of each one the gateway broadcasts a 'B' beacon
+ * -------------------------------------------------------------------
+ * | 'B' | Superframe (4 octets) | Offset (4 octets) | Slot Length (1) |
+ * -------------------------------------------------------------------
+ * -----------------------------------------------------------------
+ * | First Slot (1) | Slots (1) | Address of each slot (2 octets each) |
+ * -----------------------------------------------------------------
+ * The superframe is the gateway time in seconds and the offset is how
+ * far into the superframe the beacon goes out, in µs, from how long
+ * recent beacons have waited to go. The slot
+ * length and first slot are in ms, and an address of 0 is an empty slot.
+ * All fields are little endian.
+ *
+ * A node with a slot should only upload inside it. Nodes without a slot,
+ * and requests that aren't uploads, use the time after the last slot.
+ *
+ * The gateway gives a slot to every node it hears from, while there are
+ * slots free. A node that doesn't use its slot for TDMA_SLOT_EXPIRY
+ * superframes loses it.
+ */
+enum {
+  TDMA_SLOTS		= 40,
+  TDMA_SLOT_MS		= 20,
+  TDMA_FIRST_SLOT_MS	= 50,	/* Leaves time for the beacon */
+  TDMA_SLOT_EXPIRY	= 60,	/* Superframes */
+  TDMA_BEACON_HEADER	= 12
+};
+
+void tdma_frame_received(struct rx_frame* rx);
+void tdma_service(void);
+void tdma_init(void);
+
+#endif /* TDMA_H */
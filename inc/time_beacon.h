@@ -0,0 +1,65 @@
+/* 
+ * Broadcasts the gateway time for nodes to listen to
+ * Copyright (C) 2013  Richard Meadows
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef TIME_BEACON_H
+#define TIME_BEACON_H
+
+#include "radio.h"
+
+/**
+ * ======== Time Beacons ========
+ *
+ * Once the gateway knows the time it broadcasts a time beacon on each
+ * radio every TIME_BEACON_TICKS
+ * ---------------------------------------------------------------------------
+ * | 'M' | Sequence (1) | Time (8 octets) | µs (4) | Last Correction (4)      |
+ * ---------------------------------------------------------------------------
+ * The time is the gateway time in seconds, as in a 'T' reply, and µs is
+ * how far into that second the beacon was queued. The beacon goes out
+ * some time after that, once the channel is free.
+ *
+ * Last correction is how many µs after its own time and µs the beacon
+ * before (Sequence - 1) finished sending its PHR. That's the point a
+ * receiver takes its timestamp at, so a node that noted when it heard
+ * that beacon knows the gateway time at that moment exactly:
+ *   gateway time = time + µs + last correction
+ * It's TIME_BEACON_NO_CORRECTION if we don't know, because that beacon
+ * didn't go out or its end was only noticed late. A node that just
+ * wants the time to the nearest few ms can use the time and µs straight
+ * away. All fields are little endian, and the correction is signed.
+ *
+ * Nodes should listen for beacons rather than asking. A node that hasn't
+ * got the time yet, or hasn't heard a beacon for a few periods, can
+ * still send a 'T' request and get a reply of its own.
+ */
+enum {
+  TIME_BEACON_TICKS		= 2000*60,	/* 1 minute */
+  TIME_BEACON_LENGTH		= 18,
+  TIME_BEACON_NO_CORRECTION	= 0x7FFFFFFF
+};
+
+void time_beacon_service(void);
+void time_beacon_init(void);
+
+#endif /* TIME_BEACON_H */
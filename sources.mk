@@ -10,12 +10,26 @@ src/net_init_service.c \
 src/http_rx.c \
 src/debug.c \
 src/frame_processor.c \
+src/reassembly.c \
+src/association.c \
+src/channel_survey.c \
+src/csma_tuning.c \
+src/tdma.c \
+src/time_beacon.c \
+src/dissemination.c \
+src/sniffer.c \
+src/frame_security.c \
+src/node_table.c \
 src/radio/radio_irq.c \
 src/radio/ieee_frame.c \
 src/radio/rf212_functions.c \
 src/radio/radio.c \
 src/radio/rf212.c \
 src/radio/radio_functions.c \
+src/radio/radio_link.c \
+src/radio/radio_airtime.c \
+src/radio/aes.c \
+src/radio/ccm.c \
 src/main.c \
 src/radio_init_service.c \
 src/upload.c \
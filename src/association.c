@@ -0,0 +1,312 @@
+/* 
+ * Hands out short addresses to nodes that ask for one
+ * Copyright (C) 2013  Richard Meadows
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <string.h>
+#include "association.h"
+#include "radio.h"
+#include "radio/ieee_frame.h"
+#include "sntp/time.h"
+#include "memory/memory.h"
+#include "memory/checksum.h"
+#include "console.h"
+
+struct association_lease {
+  uint64_t ext_address;	/* 0 if this lease is free */
+  uint16_t short_address;
+  uint16_t reserved;
+  uint32_t last_seen;	/* Gateway time, seconds */
+};
+/**
+ * Laid out exactly as it's stored, one block
+ */
+struct association_table {
+  uint32_t magic;
+  uint32_t crc;		/* Of everything after it */
+  uint16_t next_address; /* The next address to try handing out */
+  uint16_t reserved[3];
+  struct association_lease leases[ASSOCIATION_LEASES];
+};
+
+struct association_table association_table;
+uint8_t association_dirty; /* Leases have been renewed since we last wrote them */
+uint32_t association_early; /* Bit n is set if lease n was renewed before we knew the time */
+uint32_t association_ticks;
+
+uint8_t lease_packet[11];
+
+/**
+ * Returns the current gateway time in seconds.
+ */
+uint32_t association_now(void) {
+  uint32_t secs, us;
+
+  get_timer_time(&secs, &us);
+
+  return secs;
+}
+/**
+ * Returns the lease held by an extended address, or 0.
+ */
+struct association_lease* association_find_ext(uint64_t ext_address) {
+  uint8_t i;
+
+  for (i = 0; i < ASSOCIATION_LEASES; i++) {
+    if (association_table.leases[i].ext_address == ext_address) {
+      return &association_table.leases[i];
+    }
+  }
+
+  return 0;
+}
+/**
+ * Returns the lease on a short address, or 0.
+ */
+struct association_lease* association_find_short(uint16_t short_address) {
+  uint8_t i;
+
+  for (i = 0; i < ASSOCIATION_LEASES; i++) {
+    if (association_table.leases[i].ext_address != 0 &&
+	association_table.leases[i].short_address == short_address) {
+      return &association_table.leases[i];
+    }
+  }
+
+  return 0;
+}
+
+/**
+ * Notes that we've heard from the holder of a lease. Until we know the
+ * time, the lease is only marked, and stamped once we do.
+ */
+void association_renew(struct association_lease* lease) {
+  if (is_time_valid()) {
+    lease->last_seen = association_now();
+  } else {
+    association_early |= 1UL << (lease - association_table.leases);
+  }
+  association_dirty = 1;
+}
+/**
+ * Stamps the leases that were renewed before we knew the time, now that
+ * we do.
+ */
+void association_stamp_early(void) {
+  uint32_t now = association_now();
+  uint8_t i;
+
+  for (i = 0; i < ASSOCIATION_LEASES; i++) {
+    if (association_early & (1UL << i)) {
+      association_table.leases[i].last_seen = now;
+    }
+  }
+  association_early = 0;
+}
+
+/* -------- Storage -------- */
+
+/**
+ * Writes the table to the SD card. Returns 1 on success.
+ */
+uint8_t association_write(void) {
+  association_table.magic = ASSOCIATION_MAGIC;
+  association_table.crc = calculate_crc32((uint8_t*)&association_table + 8,
+					  sizeof(association_table) - 8);
+
+  if (!put_lease_block((uint8_t*)&association_table, sizeof(association_table))) {
+    console_puts("Association: Couldn't write the leases!\n");
+    return 0;
+  }
+
+  association_dirty = 0;
+  return 1;
+}
+/**
+ * Reads the table from the SD card, or starts an empty one if there
+ * isn't a valid one there.
+ */
+void association_read(void) {
+  if (get_lease_block((uint8_t*)&association_table, sizeof(association_table)) &&
+      association_table.magic == ASSOCIATION_MAGIC &&
+      association_table.crc == calculate_crc32((uint8_t*)&association_table + 8,
+					       sizeof(association_table) - 8)) {
+    return;
+  }
+
+  console_puts("Association: No leases stored, starting afresh\n");
+
+  memset(&association_table, 0, sizeof(association_table));
+  association_table.next_address = ASSOCIATION_FIRST_ADDRESS;
+}
+
+/* -------- Leases -------- */
+
+/**
+ * Returns the next short address that no lease is using.
+ */
+uint16_t association_next_address(void) {
+  uint16_t address = association_table.next_address;
+
+  /* There are far more addresses than leases, so this always finds one */
+  while (address < ASSOCIATION_FIRST_ADDRESS || address > ASSOCIATION_LAST_ADDRESS ||
+	 association_find_short(address)) {
+    address = (address < ASSOCIATION_FIRST_ADDRESS || address >= ASSOCIATION_LAST_ADDRESS) ?
+      ASSOCIATION_FIRST_ADDRESS : address + 1;
+  }
+  association_table.next_address = address + 1;
+
+  return address;
+}
+/**
+ * Gives a new lease to an extended address, taking over a free lease or
+ * the one that ran out longest ago. Returns 0 if every lease is in use.
+ */
+struct association_lease* association_allocate(uint64_t ext_address) {
+  struct association_lease* lease = association_find_ext(0);
+  uint32_t now = association_now();
+  uint8_t i;
+
+  /* Don't trust the leases to have run out until we know the time */
+  if (lease == 0 && is_time_valid()) {
+    for (i = 0; i < ASSOCIATION_LEASES; i++) {
+      struct association_lease* l = &association_table.leases[i];
+
+      if (now - l->last_seen > ASSOCIATION_LEASE_SECS &&
+	  (lease == 0 || now - l->last_seen > now - lease->last_seen)) {
+	lease = l;
+      }
+    }
+  }
+  if (lease == 0) {
+    return 0;
+  }
+
+  lease->ext_address = ext_address;
+  lease->short_address = association_next_address();
+  lease->last_seen = 0;
+  association_renew(lease);
+
+  /* The node mustn't use the address unless we'll remember it */
+  if (!association_write()) {
+    lease->ext_address = 0;
+    return 0;
+  }
+
+  return lease;
+}
+/**
+ * Sends an 'L' frame. With no lease it tells the node to try again after
+ * lease_secs.
+ */
+void send_lease(struct rx_frame* rx, struct association_lease* lease, uint32_t lease_secs) {
+  uint16_t short_address = lease ? lease->short_address : RADIF_NO_SHORT_ADDRESS;
+
+  lease_packet[0] = 'L';
+  lease_packet[1] = short_address & 0xFF;
+  lease_packet[2] = (short_address >> 8) & 0xFF;
+  lease_packet[3] = rx->radif->pan_id & 0xFF;
+  lease_packet[4] = (rx->radif->pan_id >> 8) & 0xFF;
+  lease_packet[5] = rx->radif->short_address & 0xFF;
+  lease_packet[6] = (rx->radif->short_address >> 8) & 0xFF;
+  lease_packet[7] = lease_secs & 0xFF;
+  lease_packet[8] = (lease_secs >> 8) & 0xFF;
+  lease_packet[9] = (lease_secs >> 16) & 0xFF;
+  lease_packet[10] = (lease_secs >> 24) & 0xFF;
+
+  radif_reply(rx, lease_packet, 11, RADIF_TX_ACK_REQUEST | RADIF_TX_SUPERSEDES, 0);
+}
+
+/* -------- Frames -------- */
+
+/**
+ * Used to process a join request.
+ */
+void association_request(struct rx_frame* rx) {
+  struct association_lease* lease;
+
+  if (rx->source_addr_mode != FRAME_PAN_ID_64BIT_ADDR) {
+    /* Already has an address. association_frame_received has dealt with it */
+    return;
+  }
+
+  lease = association_find_ext(rx->source_ext_address);
+  if (lease) { /* Asking again, maybe it's restarted */
+    association_renew(lease);
+  } else {
+    lease = association_allocate(rx->source_ext_address);
+  }
+
+  if (lease) {
+    console_printf("Association: %08lx%08lx has %04x\n",
+		   (uint32_t)(rx->source_ext_address >> 32), (uint32_t)rx->source_ext_address,
+		   lease->short_address);
+    send_lease(rx, lease, ASSOCIATION_LEASE_SECS);
+  } else {
+    console_puts("Association: No leases left!\n");
+    send_lease(rx, 0, ASSOCIATION_RETRY_SECS);
+  }
+}
+/**
+ * Renews the lease of every node we hear from, and tells those that
+ * don't have a lease to join again.
+ */
+void association_frame_received(struct rx_frame* rx) {
+  struct association_lease* lease;
+
+  if (rx->source_addr_mode != FRAME_PAN_ID_16BIT_ADDR ||
+      rx->source_address < ASSOCIATION_FIRST_ADDRESS ||
+      rx->source_address > ASSOCIATION_LAST_ADDRESS) {
+    return; /* Not one of ours */
+  }
+
+  lease = association_find_short(rx->source_address);
+  if (lease) {
+    association_renew(lease);
+  } else {
+    send_lease(rx, 0, 0);
+  }
+}
+
+/**
+ * Writes out renewed leases now and then. Should be called from the
+ * main processing loop.
+ */
+void association_service(void) {
+  association_ticks++;
+
+  if (association_early && is_time_valid()) {
+    association_stamp_early();
+  }
+  if ((association_ticks % ASSOCIATION_WRITE_TICKS) == 0 && association_dirty) {
+    association_write();
+  }
+}
+/**
+ * Initialises association, reading the leases back from the SD card.
+ */
+void association_init(void) {
+  association_read();
+  association_dirty = 0;
+  association_early = 0;
+  association_ticks = 0;
+}
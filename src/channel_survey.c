@@ -0,0 +1,284 @@
+/* 
+ * Surveys the radio channels and moves away from busy ones
+ * Copyright (C) 2013  Richard Meadows
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <string.h>
+#include "channel_survey.h"
+#include "csma_tuning.h"
+#include "radio.h"
+#include "radio/rf212.h"
+#include "memory/write.h"
+#include "debug.h"
+
+/**
+ * The channels we're allowed to use, in 100s of kHz
+ */
+const uint16_t survey_channels[] = { 8683, 8686, 8690, 8695 };
+#define NUM_SURVEY_CHANNELS	(sizeof(survey_channels)/sizeof(survey_channels[0]))
+
+struct channel_survey {
+  uint8_t occupancy[NUM_SURVEY_CHANNELS]; /* Out of 255 */
+  uint8_t scan_index; /* The channel we'll measure next */
+
+  volatile uint8_t scan_busy; /* A measurement is in progress */
+  volatile uint8_t scan_ready; /* A measurement has finished */
+  volatile uint8_t scan_result; /* The ED level it measured */
+
+  uint16_t last_channel_fail; /* tx_channel_fail at our last decision */
+
+  uint16_t new_freq; /* The channel we're moving to */
+  uint8_t announcements; /* Left to send before we move */
+  uint8_t announce_packet[4];
+};
+
+struct channel_survey channel_surveys[RF212_NUM_RADIOS];
+uint32_t channel_survey_ticks;
+
+/**
+ * Returns the index in survey_channels of freq, or NUM_SURVEY_CHANNELS
+ * if it isn't one of them.
+ */
+uint8_t survey_channel_index(uint16_t freq) {
+  uint8_t i;
+
+  for (i = 0; i < NUM_SURVEY_CHANNELS; i++) {
+    if (survey_channels[i] == freq) {
+      return i;
+    }
+  }
+
+  return NUM_SURVEY_CHANNELS;
+}
+/**
+ * Returns 1 if another radio is already using freq.
+ */
+uint8_t survey_channel_taken(uint16_t freq, struct radif* radif) {
+  uint8_t n;
+
+  for (n = 0; n < RF212_NUM_RADIOS; n++) {
+    if (&rf212_radif[n] != radif && rf212_radif[n].freq == freq) {
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+/* -------- Measurement -------- */
+
+/**
+ * Called from the radio interrupt when a measurement has finished.
+ */
+void survey_scan_done(uint8_t command, uint8_t output, struct radif* radif) {
+  struct channel_survey* survey = &channel_surveys[radif->index];
+
+  (void)command;
+
+  if (output == RADIO_SUCCESS) {
+    survey->scan_result = radif->energy_level;
+    survey->scan_ready = 1;
+  }
+  survey->scan_busy = 0;
+}
+/**
+ * Folds a measurement into the rolling occupancy for the channel.
+ */
+void survey_update(struct channel_survey* survey) {
+  uint8_t i = survey->scan_index;
+  uint8_t busy = (survey->scan_result >= CHANNEL_SURVEY_BUSY_ED) ? 255 : 0;
+
+  survey->scan_ready = 0;
+
+  /* Moving average over about 16 measurements */
+  survey->occupancy[i] = (uint8_t)(((uint16_t)survey->occupancy[i] * 15 + busy) / 16);
+
+  survey->scan_index = (i + 1) % NUM_SURVEY_CHANNELS;
+}
+/**
+ * Starts measuring the next channel.
+ */
+void survey_scan(struct channel_survey* survey, struct radif* radif) {
+  if (!radif->up || survey->scan_busy) {
+    return;
+  }
+
+  if (radif_command_arg(RADIF_ENERGY_SCAN, survey_channels[survey->scan_index],
+			survey_scan_done, radif) == RADIO_SUCCESS) {
+    survey->scan_busy = 1;
+  }
+}
+
+/* -------- Channel Changes -------- */
+
+/**
+ * Decides if we should move to another channel. Returns the frequency to
+ * move to, or 0 if we should stay where we are.
+ *
+ * The energy we measure on our own channel includes our own nodes'
+ * frames, so whether to leave it is decided from failed channel access
+ * alone. Otherwise the traffic would follow us and we'd move straight back.
+ */
+uint16_t survey_decide(struct channel_survey* survey, struct radif* radif) {
+  uint8_t current = survey_channel_index(radif->freq);
+  uint16_t channel_fail = radif->tx_channel_fail - survey->last_channel_fail;
+  uint8_t i, best = NUM_SURVEY_CHANNELS;
+
+  survey->last_channel_fail = radif->tx_channel_fail;
+
+  if (current == NUM_SURVEY_CHANNELS) { /* We're on a channel we don't manage */
+    return 0;
+  }
+  if (channel_fail < CHANNEL_SURVEY_FAIL_LIMIT) { /* Our channel is fine */
+    return 0;
+  }
+
+  /* Find the quietest channel no other radio is using */
+  for (i = 0; i < NUM_SURVEY_CHANNELS; i++) {
+    if (i != current && !survey_channel_taken(survey_channels[i], radif) &&
+	(best == NUM_SURVEY_CHANNELS || survey->occupancy[i] < survey->occupancy[best])) {
+      best = i;
+    }
+  }
+
+  if (best == NUM_SURVEY_CHANNELS ||
+      survey->occupancy[best] + CHANNEL_SURVEY_HYSTERESIS > CHANNEL_SURVEY_BUSY_LIMIT) {
+    return 0; /* Nowhere quiet to go */
+  }
+
+  debug_printf("Radio %d: Channel %d failing (%d failures), moving to %d (%d/255)\n",
+	       radif->index, radif->freq, channel_fail,
+	       survey_channels[best], survey->occupancy[best]);
+
+  return survey_channels[best];
+}
+/**
+ * Changes channel. The CSMA settings were tuned for the old channel, so
+ * they go back to their defaults in the same batch.
+ */
+void survey_move(struct channel_survey* survey, struct radif* radif) {
+  struct radif_command commands[2];
+
+  commands[0].command = RADIF_SET_FREQ;
+  commands[0].flags = RADIF_COMMAND_ARGUMENT;
+  commands[0].argument = survey->new_freq;
+  commands[0].callback = 0;
+
+  commands[1].command = RADIF_SET_CSMA;
+  commands[1].flags = RADIF_COMMAND_ARGUMENT;
+  commands[1].argument = csma_tuning_defaults();
+  commands[1].callback = 0;
+
+  radif_command_batch(commands, 2, radif);
+}
+/**
+ * Called from the radio interrupt once the last announcement has gone
+ * out, or failed to. Commands run before frames are sent, so we can't
+ * queue the move until now.
+ */
+void survey_announced(uint16_t destination_address, uint8_t status, struct radif* radif) {
+  (void)destination_address;
+  (void)status;
+
+  survey_move(&channel_surveys[radif->index], radif);
+}
+/**
+ * Tells the nodes we're about to move, and moves once the last
+ * announcement has gone.
+ */
+void survey_announce(struct channel_survey* survey, struct radif* radif) {
+  survey->announcements--;
+
+  survey->announce_packet[0] = 'C';
+  survey->announce_packet[1] = survey->new_freq & 0xFF;
+  survey->announce_packet[2] = (survey->new_freq >> 8) & 0xFF;
+  survey->announce_packet[3] = survey->announcements;
+
+  if (survey->announcements) {
+    radif_send(survey->announce_packet, 4, 0xFFFF, 0, 0, radif);
+  } else if (radif_send(survey->announce_packet, 4, 0xFFFF, 0,
+			survey_announced, radif) != RADIO_SUCCESS) {
+    survey_move(survey, radif); /* It's not going, so move now */
+  }
+}
+
+/* -------- Telemetry -------- */
+
+/**
+ * Stores the occupancy map as a record.
+ */
+void survey_record(struct channel_survey* survey, struct radif* radif) {
+  uint32_t flags = (CHANNEL_SURVEY_RECORD_TYPE << 26) |
+    (radif->index << 8) |
+    (survey_channel_index(radif->freq) << 4) |
+    NUM_SURVEY_CHANNELS;
+  uint32_t data[2] = { 0, 0 };
+  uint8_t i;
+
+  for (i = 0; i < NUM_SURVEY_CHANNELS; i++) {
+    data[i / 4] |= (uint32_t)survey->occupancy[i] << (8 * (i % 4));
+  }
+
+  write_sample_to_mem(flags, data[0], data[1], 0);
+}
+
+/**
+ * Called every tick to run the surveys for each radio.
+ */
+void channel_survey_service(void) {
+  uint8_t n;
+
+  channel_survey_ticks++;
+
+  for (n = 0; n < RF212_NUM_RADIOS; n++) {
+    struct channel_survey* survey = &channel_surveys[n];
+    struct radif* radif = &rf212_radif[n];
+
+    if (survey->scan_ready) {
+      survey_update(survey);
+    }
+    if ((channel_survey_ticks % CHANNEL_SURVEY_SCAN_TICKS) == 0) {
+      survey_scan(survey, radif);
+    }
+
+    if (survey->announcements) { /* Moving */
+      if ((channel_survey_ticks % CHANNEL_SURVEY_ANNOUNCE_TICKS) == 0) {
+	survey_announce(survey, radif);
+      }
+    } else if ((channel_survey_ticks % CHANNEL_SURVEY_DECIDE_TICKS) == 0) {
+      if ((survey->new_freq = survey_decide(survey, radif))) {
+	survey->announcements = CHANNEL_SURVEY_ANNOUNCEMENTS;
+      }
+    }
+
+    if ((channel_survey_ticks % CHANNEL_SURVEY_RECORD_TICKS) == 0) {
+      survey_record(survey, radif);
+    }
+  }
+}
+/**
+ * Initialises the channel surveys.
+ */
+void channel_survey_init(void) {
+  memset(channel_surveys, 0, sizeof(channel_surveys));
+  channel_survey_ticks = 0;
+}
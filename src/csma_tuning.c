@@ -0,0 +1,209 @@
+/* 
+ * Tunes the CSMA and retry settings to the channel we see
+ * Copyright (C) 2013  Richard Meadows
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <string.h>
+#include "csma_tuning.h"
+#include "radio.h"
+#include "radio/rf212.h"
+#include "radio/radio_functions.h"
+#include "memory/write.h"
+#include "debug.h"
+
+struct csma_tuning {
+  /* The statistics at the end of the last window */
+  uint16_t last_success;
+  uint16_t last_channel_fail;
+  uint16_t last_noack;
+
+  uint8_t quiet_windows; /* In a row with hardly any failures */
+};
+
+struct csma_tuning csma_tunings[RF212_NUM_RADIOS];
+uint32_t csma_tuning_ticks;
+
+/**
+ * Returns the radio's settings packed as for RADIF_SET_CSMA.
+ */
+uint32_t csma_tuning_pack(struct radif* radif) {
+  return radif->frame_retries |
+    (radif->csma_retries << 4) |
+    (radif->min_be << 8) |
+    (radif->max_be << 12) |
+    ((uint32_t)radif->cca_threshold << 16);
+}
+/**
+ * Returns the default settings, packed as for RADIF_SET_CSMA.
+ */
+uint32_t csma_tuning_defaults(void) {
+  return RADIO_MAX_FRAME_RETRIES |
+    (RADIO_MAX_CSMA_RETRIES << 4) |
+    (CHB_MIN_BE << 8) |
+    (CHB_MAX_BE << 12) |
+    ((uint32_t)CHB_CCA_ED_THRES << 16);
+}
+/**
+ * Returns the settings with one of them raised for a busy channel, or
+ * the same settings if they're all at their limits.
+ */
+uint32_t csma_tuning_busy(uint32_t settings) {
+  if (((settings >> 4) & 0x7) < CSMA_TUNING_MAX_CSMA_RETRIES) {
+    return settings + (1 << 4);
+  }
+  if (((settings >> 12) & 0xF) < CSMA_TUNING_MAX_BE) {
+    return settings + (1 << 12);
+  }
+  if (((settings >> 16) & 0xF) < CSMA_TUNING_MAX_CCA_THRESHOLD) {
+    return settings + (1 << 16);
+  }
+
+  return settings;
+}
+/**
+ * Returns the settings with one of them raised for frames that aren't
+ * being acknowledged, or the same settings if they're all at their
+ * limits.
+ */
+uint32_t csma_tuning_noack(uint32_t settings) {
+  if (((settings >> 8) & 0xF) < ((settings >> 12) & 0xF)) { /* min_be can't pass max_be */
+    return settings + (1 << 8);
+  }
+  if ((settings & 0xF) < CSMA_TUNING_MAX_FRAME_RETRIES) {
+    return settings + 1;
+  }
+
+  return settings;
+}
+/**
+ * Returns the settings with one of them stepped back towards its
+ * default, or the same settings if they're all at their defaults.
+ */
+uint32_t csma_tuning_relax(uint32_t settings) {
+  if (((settings >> 16) & 0xF) > CHB_CCA_ED_THRES) {
+    return settings - (1 << 16);
+  }
+  if (((settings >> 12) & 0xF) > CHB_MAX_BE &&
+      ((settings >> 12) & 0xF) > ((settings >> 8) & 0xF)) {
+    return settings - (1 << 12);
+  }
+  if (((settings >> 4) & 0x7) > RADIO_MAX_CSMA_RETRIES) {
+    return settings - (1 << 4);
+  }
+  if ((settings & 0xF) > RADIO_MAX_FRAME_RETRIES) {
+    return settings - 1;
+  }
+  if (((settings >> 8) & 0xF) > CHB_MIN_BE) {
+    return settings - (1 << 8);
+  }
+
+  return settings;
+}
+
+/* -------- Telemetry -------- */
+
+/**
+ * Prints and stores a change of settings.
+ */
+void csma_tuning_record(uint16_t success, uint16_t channel_fail, uint16_t noack,
+			uint32_t old_settings, uint32_t new_settings,
+			struct radif* radif) {
+  uint32_t flags = (CSMA_TUNING_RECORD_TYPE << 26) |
+    ((uint32_t)(radif->index & 0x3) << 24) |
+    ((uint32_t)(radif->last_trac_status & 0x7) << 20) |
+    new_settings;
+
+  debug_printf("Radio %d: %d acked, %d channel access failures, %d not acked (TRAC %d), "
+	       "CSMA %05lx -> %05lx\n", radif->index, success, channel_fail, noack,
+	       radif->last_trac_status, old_settings, new_settings);
+
+  write_sample_to_mem(flags, ((uint32_t)channel_fail << 16) | success,
+		      (old_settings << 12) | ((noack > 0xFFF) ? 0xFFF : noack), 0);
+}
+
+/* -------- Decisions -------- */
+
+/**
+ * Looks at how the last window went and adjusts the settings if needed.
+ */
+void csma_tuning_window(struct csma_tuning* tuning, struct radif* radif) {
+  uint16_t success = radif->tx_success_count - tuning->last_success;
+  uint16_t channel_fail = radif->tx_channel_fail - tuning->last_channel_fail;
+  uint16_t noack = radif->tx_noack - tuning->last_noack;
+  uint32_t attempts = (uint32_t)success + channel_fail + noack;
+  uint32_t fail_rate, noack_rate;
+  uint32_t settings, new_settings;
+
+  tuning->last_success = radif->tx_success_count;
+  tuning->last_channel_fail = radif->tx_channel_fail;
+  tuning->last_noack = radif->tx_noack;
+
+  if (!radif->up || attempts < CSMA_TUNING_MIN_ATTEMPTS) { /* Not enough to go on */
+    return;
+  }
+
+  fail_rate = (channel_fail * 255) / attempts;
+  noack_rate = (success + noack) ? (noack * 255) / (success + noack) : 0;
+  settings = new_settings = csma_tuning_pack(radif);
+
+  if (fail_rate > CSMA_TUNING_FAIL_HIGH) {
+    new_settings = csma_tuning_busy(settings);
+    tuning->quiet_windows = 0;
+  } else if (noack_rate > CSMA_TUNING_NOACK_HIGH) {
+    new_settings = csma_tuning_noack(settings);
+    tuning->quiet_windows = 0;
+  } else if (fail_rate < CSMA_TUNING_LOW && noack_rate < CSMA_TUNING_LOW) {
+    if (++tuning->quiet_windows >= CSMA_TUNING_RELAX_WINDOWS) {
+      new_settings = csma_tuning_relax(settings);
+      tuning->quiet_windows = 0;
+    }
+  } else {
+    tuning->quiet_windows = 0;
+  }
+
+  if (new_settings != settings &&
+      radif_command_arg(RADIF_SET_CSMA, new_settings, 0, radif) == RADIO_SUCCESS) {
+    csma_tuning_record(success, channel_fail, noack, settings, new_settings, radif);
+  }
+}
+
+/**
+ * Called every tick to tune each radio.
+ */
+void csma_tuning_service(void) {
+  uint8_t n;
+
+  csma_tuning_ticks++;
+
+  if ((csma_tuning_ticks % CSMA_TUNING_WINDOW_TICKS) == 0) {
+    for (n = 0; n < RF212_NUM_RADIOS; n++) {
+      csma_tuning_window(&csma_tunings[n], &rf212_radif[n]);
+    }
+  }
+}
+/**
+ * Initialises the CSMA tuning.
+ */
+void csma_tuning_init(void) {
+  memset(csma_tunings, 0, sizeof(csma_tunings));
+  csma_tuning_ticks = 0;
+}
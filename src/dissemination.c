@@ -0,0 +1,430 @@
+/* 
+ * Broadcasts firmware and configuration images to the nodes
+ * Copyright (C) 2013  Richard Meadows
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <string.h>
+#include "dissemination.h"
+#include "radio.h"
+#include "radio/rf212.h"
+#include "memory/memory.h"
+#include "memory/checksum.h"
+#include "console.h"
+
+enum {
+  DISSEMINATION_IDLE = 0,	/* Waiting to poll again, or there's no image */
+  DISSEMINATION_POLL_DUE,	/* The next round's poll needs sending */
+  DISSEMINATION_POLL,		/* Collecting NAKs */
+  DISSEMINATION_SEND		/* Broadcasting the missing blocks */
+};
+
+/**
+ * The image on the SD card
+ */
+struct dissemination_image {
+  uint8_t valid;
+  uint16_t image;
+  uint8_t kind;
+  uint32_t length;
+  uint32_t crc;
+  uint16_t blocks;
+
+  uint8_t checking; /* We're still checking it against its CRC */
+  uint32_t checked; /* Octets checked so far */
+  uint32_t check_crc; /* Of those octets */
+};
+
+/**
+ * Where each radio has got to
+ */
+struct dissemination {
+  uint8_t state;
+  uint8_t round;
+  uint8_t quiet_polls;	/* In a row without a NAK */
+  uint32_t countdown;	/* Ticks left in this state */
+  uint8_t read_failures;	/* In a row, reading the image to send it */
+
+  uint8_t missing[DISSEMINATION_MAX_BLOCKS/8]; /* The union of the NAKs */
+  uint16_t next_block;	/* Where we've got to in this round */
+
+  volatile uint8_t in_flight; /* A block is queued */
+  volatile uint8_t failed; /* It didn't go out */
+  uint16_t in_flight_block;
+
+  uint8_t packet[DISSEMINATION_HEADER + DISSEMINATION_BLOCK_SIZE];
+};
+
+struct dissemination_image dissemination_image;
+struct dissemination disseminations[RF212_NUM_RADIOS];
+
+/* ---- Statistics ---- */
+uint32_t dissemination_blocks_sent;
+uint32_t dissemination_naks;
+
+/* -------- The Image -------- */
+
+/**
+ * Reads block n of the image into packet, after the header. Returns the
+ * length of the block, or 0 if it can't be read.
+ */
+uint8_t dissemination_read_block(uint16_t n, uint8_t* packet) {
+  uint16_t index = 1 + (n / (512 / DISSEMINATION_BLOCK_SIZE));
+  uint16_t offset = (n % (512 / DISSEMINATION_BLOCK_SIZE)) * DISSEMINATION_BLOCK_SIZE;
+  uint32_t remaining = dissemination_image.length - ((uint32_t)n * DISSEMINATION_BLOCK_SIZE);
+
+  if (memory_sector_block != (uint32_t)MEMORY_IMAGE_BLOCK + index) { /* Not already there */
+    memory_sector_block = 0;
+    if (!get_image_block(memory_sector, 512, index)) {
+      return 0;
+    }
+    memory_sector_block = MEMORY_IMAGE_BLOCK + index;
+  }
+
+  if (remaining > DISSEMINATION_BLOCK_SIZE) {
+    remaining = DISSEMINATION_BLOCK_SIZE;
+  }
+  memcpy(packet + DISSEMINATION_HEADER, memory_sector + offset, remaining);
+
+  return remaining;
+}
+/**
+ * Reads the image header. The image is checked against its CRC by
+ * dissemination_check() from the service, as that takes a while.
+ */
+void dissemination_load(void) {
+  struct dissemination_image* img = &dissemination_image;
+  uint32_t* words = (uint32_t*)memory_sector;
+
+  memset(img, 0, sizeof(struct dissemination_image));
+  memory_sector_block = 0;
+
+  if (!get_image_block(memory_sector, 16, 0) || words[0] != DISSEMINATION_MAGIC) {
+    return; /* No image */
+  }
+
+  img->image = memory_sector[4] | (memory_sector[5] << 8);
+  img->kind = memory_sector[6];
+  img->length = words[2];
+  img->crc = words[3];
+
+  if (img->length == 0 ||
+      img->length > (uint32_t)DISSEMINATION_MAX_BLOCKS * DISSEMINATION_BLOCK_SIZE) {
+    console_puts("Dissemination: Bad image length!\n");
+    return;
+  }
+
+  img->checking = 1;
+}
+/**
+ * Checks the next DISSEMINATION_CHECK_BLOCKS SD blocks of the image
+ * against its CRC. Once it's all been checked the image is valid and the
+ * radios start sending it.
+ */
+void dissemination_check(void) {
+  struct dissemination_image* img = &dissemination_image;
+  uint8_t i, n;
+
+  for (i = 0; i < DISSEMINATION_CHECK_BLOCKS && img->checked < img->length; i++) {
+    uint16_t index = 1 + (img->checked / 512);
+    uint16_t len = (img->length - img->checked > 512) ? 512 : img->length - img->checked;
+
+    memory_sector_block = 0;
+    if (!get_image_block(memory_sector, 512, index)) {
+      console_puts("Dissemination: Couldn't read the image!\n");
+      img->checking = 0;
+      return;
+    }
+    memory_sector_block = MEMORY_IMAGE_BLOCK + index;
+
+    img->check_crc = update_crc32(img->check_crc, memory_sector, len);
+    img->checked += len;
+  }
+  if (img->checked < img->length) { /* More next time */
+    return;
+  }
+
+  img->checking = 0;
+
+  if (img->check_crc != img->crc) {
+    console_puts("Dissemination: Bad image CRC!\n");
+    return;
+  }
+
+  img->blocks = (img->length + DISSEMINATION_BLOCK_SIZE - 1) / DISSEMINATION_BLOCK_SIZE;
+  img->valid = 1;
+
+  console_printf("Dissemination: Image %d, kind %d, %lu octets\n",
+		 img->image, img->kind, img->length);
+
+  for (n = 0; n < RF212_NUM_RADIOS; n++) {
+    disseminations[n].state = DISSEMINATION_POLL_DUE;
+  }
+}
+
+/* -------- Bitmap -------- */
+
+uint8_t dissemination_is_missing(struct dissemination* d, uint16_t n) {
+  return (d->missing[n / 8] >> (n % 8)) & 1;
+}
+void dissemination_set_missing(struct dissemination* d, uint16_t n) {
+  d->missing[n / 8] |= 1 << (n % 8);
+}
+/**
+ * Returns the first missing block from n onwards, or the number of
+ * blocks if there are none.
+ */
+uint16_t dissemination_next_missing(struct dissemination* d, uint16_t n) {
+  while (n < dissemination_image.blocks) {
+    if (d->missing[n / 8] == 0) { /* Skip whole octets */
+      n = (n + 8) & ~7;
+    } else if (dissemination_is_missing(d, n)) {
+      return n;
+    } else {
+      n++;
+    }
+  }
+
+  return dissemination_image.blocks;
+}
+
+/* -------- Frames -------- */
+
+/**
+ * Called from the radio interrupt once a block has gone, or failed to.
+ */
+void dissemination_sent(uint16_t destination_address, uint8_t status, struct radif* radif) {
+  struct dissemination* d = &disseminations[radif->index];
+
+  (void)destination_address;
+
+  d->failed = (status == RADIO_SUCCESS) ? 0 : 1;
+  d->in_flight = 0;
+}
+/**
+ * Broadcasts a poll to start a round.
+ */
+uint8_t dissemination_send_poll(struct dissemination* d, struct radif* radif) {
+  struct dissemination_image* img = &dissemination_image;
+  uint8_t* packet = d->packet;
+
+  packet[0] = 'Q';
+  packet[1] = img->image & 0xFF;
+  packet[2] = (img->image >> 8) & 0xFF;
+  packet[3] = img->kind;
+  packet[4] = img->length & 0xFF;
+  packet[5] = (img->length >> 8) & 0xFF;
+  packet[6] = (img->length >> 16) & 0xFF;
+  packet[7] = (img->length >> 24) & 0xFF;
+  packet[8] = img->crc & 0xFF;
+  packet[9] = (img->crc >> 8) & 0xFF;
+  packet[10] = (img->crc >> 16) & 0xFF;
+  packet[11] = (img->crc >> 24) & 0xFF;
+  packet[12] = DISSEMINATION_BLOCK_SIZE;
+  packet[13] = d->round;
+
+  return radif_send(packet, DISSEMINATION_POLL_LENGTH, 0xFFFF, 0, 0, radif);
+}
+/**
+ * Gives up on the image until DISSEMINATION_REPOLL_TICKS from now, or
+ * until a node NAKs it.
+ */
+void dissemination_give_up(struct dissemination* d) {
+  console_puts("Dissemination: Giving up for now\n");
+  memset(d->missing, 0, sizeof(d->missing));
+  d->read_failures = 0;
+  d->state = DISSEMINATION_IDLE;
+  d->countdown = DISSEMINATION_REPOLL_TICKS;
+}
+/**
+ * Broadcasts the next missing block. Returns 0 once there are none left
+ * in this round.
+ */
+uint8_t dissemination_send_block(struct dissemination* d, struct radif* radif) {
+  uint8_t* packet = d->packet;
+  uint16_t n = dissemination_next_missing(d, d->next_block);
+  uint8_t length;
+
+  if (n >= dissemination_image.blocks) {
+    return 0;
+  }
+  if ((length = dissemination_read_block(n, packet)) == 0) {
+    if (++d->read_failures >= DISSEMINATION_READ_FAILURES) {
+      console_puts("Dissemination: Couldn't read the image!\n");
+      dissemination_give_up(d);
+    }
+    return 1; /* Try again next time */
+  }
+  d->read_failures = 0;
+
+  packet[0] = 'I';
+  packet[1] = dissemination_image.image & 0xFF;
+  packet[2] = (dissemination_image.image >> 8) & 0xFF;
+  packet[3] = n & 0xFF;
+  packet[4] = (n >> 8) & 0xFF;
+
+  /* One at a time, so we don't crowd everything else out of the queue */
+  d->in_flight = 1;
+  if (radif_send(packet, DISSEMINATION_HEADER + length, 0xFFFF, 0,
+		 dissemination_sent, radif) != RADIO_SUCCESS) {
+    d->in_flight = 0;
+    return 1;
+  }
+
+  d->in_flight_block = n;
+  d->missing[n / 8] &= ~(1 << (n % 8));
+  d->next_block = n + 1;
+  dissemination_blocks_sent++;
+
+  return 1;
+}
+/**
+ * Used to process a NAK. Adds the blocks the node is missing to the next
+ * round.
+ */
+void dissemination_nak(struct rx_frame* rx) {
+  struct dissemination* d = &disseminations[rx->radif->index];
+  uint16_t image, first, i;
+  uint8_t bitmap_len;
+
+  if (rx->length < DISSEMINATION_HEADER + 1) {
+    console_puts("Radio NAK too short!\n");
+    return;
+  }
+
+  image = rx->data[1] | (rx->data[2] << 8);
+  first = rx->data[3] | (rx->data[4] << 8);
+  bitmap_len = rx->length - DISSEMINATION_HEADER;
+
+  if (!dissemination_image.valid || image != dissemination_image.image ||
+      bitmap_len > DISSEMINATION_MAX_NAK) {
+    return; /* Not something we're sending */
+  }
+
+  dissemination_naks++;
+
+  for (i = 0; i < bitmap_len * 8 && first + i < dissemination_image.blocks; i++) {
+    if ((rx->data[DISSEMINATION_HEADER + (i / 8)] >> (i % 8)) & 1) {
+      dissemination_set_missing(d, first + i);
+    }
+  }
+
+  if (d->state == DISSEMINATION_IDLE) { /* Someone's turned up late */
+    d->round = 0;
+    d->quiet_polls = 0;
+    d->next_block = 0;
+    d->state = DISSEMINATION_SEND;
+  }
+}
+
+/* -------- Rounds -------- */
+
+/**
+ * Decides what to do once the NAKs are in.
+ */
+void dissemination_poll_done(struct dissemination* d) {
+  if (dissemination_next_missing(d, 0) < dissemination_image.blocks) {
+    d->quiet_polls = 0;
+
+    if (++d->round > DISSEMINATION_MAX_ROUNDS) {
+      dissemination_give_up(d);
+      return;
+    }
+
+    d->next_block = 0;
+    d->state = DISSEMINATION_SEND;
+  } else if (++d->quiet_polls >= DISSEMINATION_QUIET_POLLS) {
+    console_puts("Dissemination: Every node has the image\n");
+    d->state = DISSEMINATION_IDLE;
+    d->countdown = DISSEMINATION_REPOLL_TICKS;
+  } else {
+    d->state = DISSEMINATION_POLL_DUE;
+  }
+}
+/**
+ * Moves a radio's dissemination along.
+ */
+void dissemination_step(struct dissemination* d, struct radif* radif) {
+  if (d->in_flight) { /* Wait for the last block to go */
+    return;
+  }
+  if (d->failed) { /* Send it again */
+    d->failed = 0;
+    dissemination_set_missing(d, d->in_flight_block);
+    if (d->in_flight_block < d->next_block) {
+      d->next_block = d->in_flight_block;
+    }
+  }
+
+  switch (d->state) {
+    case DISSEMINATION_IDLE:
+      if (d->countdown && --d->countdown == 0) {
+	d->round = 0;
+	d->quiet_polls = 0;
+	d->state = DISSEMINATION_POLL_DUE;
+      }
+      break;
+    case DISSEMINATION_POLL_DUE:
+      if (dissemination_send_poll(d, radif) == RADIO_SUCCESS) {
+	d->countdown = DISSEMINATION_NAK_TICKS;
+	d->state = DISSEMINATION_POLL;
+      }
+      break;
+    case DISSEMINATION_POLL:
+      if (--d->countdown == 0) {
+	dissemination_poll_done(d);
+      }
+      break;
+    case DISSEMINATION_SEND:
+      if (!dissemination_send_block(d, radif)) { /* That's the round done */
+	d->state = DISSEMINATION_POLL_DUE;
+      }
+      break;
+  }
+}
+
+/**
+ * Called every tick to move each radio's dissemination along.
+ */
+void dissemination_service(void) {
+  uint8_t n;
+
+  if (dissemination_image.checking) {
+    dissemination_check();
+  }
+  if (!dissemination_image.valid) {
+    return;
+  }
+
+  for (n = 0; n < RF212_NUM_RADIOS; n++) {
+    if (rf212_radif[n].up) {
+      dissemination_step(&disseminations[n], &rf212_radif[n]);
+    }
+  }
+}
+/**
+ * Initialises dissemination, and reads the header of the image on the SD
+ * card if there is one. It's sent once it's been checked.
+ */
+void dissemination_init(void) {
+  memset(disseminations, 0, sizeof(disseminations));
+  dissemination_load();
+}
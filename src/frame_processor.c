@@ -25,26 +25,91 @@
 #include <string.h>
 #include "frame_processor.h"
 #include "radio.h"
-#include "radio/rf212.h"
+#include "node_table.h"
 #include "memory/memory.h"
 #include "memory/checksum.h"
 #include "console.h"
 
 uint8_t record[MEMORY_RECORD_SIZE];
 
-uint8_t sample_ack_packet[9];
+uint8_t sample_ack_packet[10];
+uint8_t hold_packet[6];
 
+/* ---- Back-pressure ---- */
+uint32_t upload_last_read_index; /* memory_indexes.read_index when we last looked */
+uint32_t upload_stall_secs; /* Seconds with records waiting and none uploaded */
+uint32_t upload_refused; /* Records we couldn't store and asked the node to hold */
+
+/**
+ * Returns how many seconds nodes should wait before sending more
+ * records, or 0 if they needn't. Set refused if we've just failed to
+ * store one.
+ */
+uint8_t upload_backoff(uint8_t refused) {
+  uint8_t backoff = 0;
+
+  if (get_blocks_free() < UPLOAD_BACKOFF_LOW_BLOCKS) {
+    backoff = UPLOAD_BACKOFF_FULL_SECS;
+  } else if (upload_stall_secs > UPLOAD_BACKOFF_STALL_SECS) {
+    backoff = UPLOAD_BACKOFF_STALLED_SECS;
+  }
+  if (refused && backoff < UPLOAD_BACKOFF_HOLD_SECS) {
+    backoff = UPLOAD_BACKOFF_HOLD_SECS;
+  }
+
+  return backoff;
+}
 /**
- * Constructs and sends a frame acknowledgement packet.
+ * Keeps count of how long the uplink has gone without taking any
+ * records from memory.
  */
-void send_upload_ack(uint16_t rf_address, uint32_t mem_address, uint32_t checksum) {
+void upload_stall_update(void) {
+  if (memory_indexes.read_index != upload_last_read_index) { /* Uploading */
+    upload_last_read_index = memory_indexes.read_index;
+    upload_stall_secs = 0;
+  } else if (memory_indexes.read_index == memory_indexes.write_index) { /* Nothing to upload */
+    upload_stall_secs = 0;
+  } else {
+    upload_stall_secs++;
+  }
+}
+
+/**
+ * Constructs and sends a frame acknowledgement packet, with a back-off
+ * if nodes should slow down.
+ */
+void send_upload_ack(uint16_t rf_address, uint32_t mem_address, uint32_t checksum,
+		     struct radif* radif) {
+  uint8_t backoff = upload_backoff(0);
+
   /* Assemble an ack packet */
   sample_ack_packet[0] = 'A';
   uint32_t* addr_ptr = (uint32_t*)(sample_ack_packet+1); addr_ptr[0] = mem_address;
   uint32_t* chk_ptr = (uint32_t*)(sample_ack_packet+5); chk_ptr[0] = checksum;
+  sample_ack_packet[9] = backoff;
 
   /* Send the frame */
-  radif_send(sample_ack_packet, 9, rf_address, 1, &rf212_radif);
+  radif_send(sample_ack_packet, backoff ? 10 : 9, rf_address,
+	     RADIF_TX_ACK_REQUEST | RADIF_TX_UPLOAD_ACK, 0, radif);
+}
+/**
+ * Tells a node we couldn't store the record at mem_address, or any after
+ * it in the same frame.
+ */
+void send_upload_hold(uint16_t rf_address, uint32_t mem_address, struct radif* radif) {
+  upload_refused++;
+
+  hold_packet[0] = 'H';
+  hold_packet[1] = mem_address & 0xFF;
+  hold_packet[2] = (mem_address >> 8) & 0xFF;
+  hold_packet[3] = (mem_address >> 16) & 0xFF;
+  hold_packet[4] = (mem_address >> 24) & 0xFF;
+  hold_packet[5] = upload_backoff(1);
+
+  radif_send(hold_packet, 6, rf_address,
+	     RADIF_TX_ACK_REQUEST | RADIF_TX_UPLOAD_ACK, 0, radif);
+
+  console_puts("Radio Upload Frame Refused, memory full\n");
 }
 
 /**
@@ -57,6 +122,41 @@ uint32_t get_memory_address_from_rx(struct rx_frame* rx) {
     rx->data[4] << 24;
 }
 
+/* ======== Duplicate Filter ======== */
+
+/**
+ * The (node, memory address) of records we've stored from 'U' frames. If
+ * our 'A' is lost the node sends the record again. The filter is direct
+ * mapped, so a collision only forgets an older record. It never makes us
+ * drop a record we haven't stored.
+ */
+uint16_t upload_filter_nodes[UPLOAD_FILTER_SIZE];
+uint32_t upload_filter_addrs[UPLOAD_FILTER_SIZE];
+
+/**
+ * Returns the filter entry for a record.
+ */
+uint8_t upload_filter_index(uint16_t source_address, uint32_t mem_addr) {
+  uint32_t hash = (mem_addr * 2654435761UL) ^ (source_address * 40503U);
+
+  return (hash >> 24) & (UPLOAD_FILTER_SIZE - 1);
+}
+/**
+ * Returns 1 if we've already stored this record.
+ */
+uint8_t upload_filter_seen(uint16_t source_address, uint32_t mem_addr) {
+  uint8_t i = upload_filter_index(source_address, mem_addr);
+
+  return (upload_filter_nodes[i] == source_address &&
+	  upload_filter_addrs[i] == mem_addr) ? 1 : 0;
+}
+void upload_filter_add(uint16_t source_address, uint32_t mem_addr) {
+  uint8_t i = upload_filter_index(source_address, mem_addr);
+
+  upload_filter_nodes[i] = source_address;
+  upload_filter_addrs[i] = mem_addr;
+}
+
 /**
  * Used to process a data frame that has just been uploaded.
  */
@@ -77,14 +177,27 @@ void block_uploaded(struct rx_frame* rx) {
       /* Extract the memory address */
       mem_addr = get_memory_address_from_rx(rx);
 
-      /* Acknowledge the frame */
-      send_upload_ack(rx->source_address, mem_addr, checksum);
+      if (upload_filter_seen(rx->source_address, mem_addr)) {
+	/* Acknowledge it again, it means our last 'A' was lost */
+	send_upload_ack(rx->source_address, mem_addr, checksum, rx->radif);
+	node_table_duplicate(rx->source_address);
+
+	console_puts("Radio Upload Frame Duplicate\n");
+	return;
+      }
 
-      /* Write the record out to memory */
-      put_sample(record);
+      /* Write the record out to memory, and only acknowledge it if that worked */
+      if (put_sample(record)) {
+	upload_filter_add(rx->source_address, mem_addr);
+	node_table_record_stored(rx->source_address);
+	send_upload_ack(rx->source_address, mem_addr, checksum, rx->radif);
 
-      console_puts("Radio Upload Frame OK\n");
+	console_puts("Radio Upload Frame OK\n");
+      } else {
+	send_upload_hold(rx->source_address, mem_addr, rx->radif);
+      }
     } else {
+      node_table_checksum_failure(rx->source_address);
       console_puts("Radio Upload Frame Checksum Error!\n");
       console_printf("Frame: %04x\nCalc: %04x\n", checksum, actual_checksum);
     }
@@ -92,3 +205,441 @@ void block_uploaded(struct rx_frame* rx) {
     console_puts("Radio Upload Frame too short!\n");
   }
 }
+
+/* ======== Windowed Uploads ======== */
+
+/**
+ * The receive window we keep for each node that uses 'W' frames.
+ */
+struct upload_window {
+  uint8_t in_use;
+  uint16_t source_address;
+  struct radif* radif;	/* The interface we last heard this node on */
+
+  uint32_t cumulative;	/* The first record address that hasn't been stored */
+  uint32_t bitmap;	/* Bit n is set if record (cumulative + n) has been stored */
+
+  uint8_t unacked;	/* Frames received since our last 'S' frame */
+  uint8_t refused;	/* We've failed to store a record since our last 'S' frame */
+  uint16_t ack_countdown; /* Ticks until we send an 'S' frame anyway */
+  uint32_t last_active;	/* The tick at which we last heard from this node */
+};
+
+struct upload_window upload_windows[UPLOAD_WINDOW_NODES];
+uint32_t frame_processor_ticks;
+
+uint8_t sack_packet[10];
+
+/**
+ * Constructs and sends a selective acknowledgement packet for the
+ * window, with a back-off if nodes should slow down.
+ */
+void send_window_ack(struct upload_window* window) {
+  /* Bit 0 of our bitmap is always clear, the cumulative address covers it */
+  uint32_t sack = window->bitmap >> 1;
+  uint8_t backoff = upload_backoff(window->refused);
+
+  /* Assemble the 'S' packet */
+  sack_packet[0] = 'S';
+  sack_packet[1] = window->cumulative & 0xFF;
+  sack_packet[2] = (window->cumulative >> 8) & 0xFF;
+  sack_packet[3] = (window->cumulative >> 16) & 0xFF;
+  sack_packet[4] = (window->cumulative >> 24) & 0xFF;
+  sack_packet[5] = sack & 0xFF;
+  sack_packet[6] = (sack >> 8) & 0xFF;
+  sack_packet[7] = (sack >> 16) & 0xFF;
+  sack_packet[8] = (sack >> 24) & 0xFF;
+  sack_packet[9] = backoff;
+
+  /* Send the frame. If there's no room we'll try again on the next service */
+  if (radif_send(sack_packet, backoff ? 10 : 9, window->source_address,
+		 RADIF_TX_ACK_REQUEST | RADIF_TX_UPLOAD_ACK | RADIF_TX_SUPERSEDES,
+		 0, window->radif) == RADIO_SUCCESS) {
+    window->unacked = 0;
+    window->refused = 0;
+  }
+}
+/**
+ * Returns the window for the given node, taking over the least
+ * recently active window if the node doesn't have one yet.
+ */
+struct upload_window* get_upload_window(uint16_t source_address, uint32_t mem_addr) {
+  struct upload_window* oldest = &upload_windows[0];
+  uint8_t i;
+
+  for (i = 0; i < UPLOAD_WINDOW_NODES; i++) {
+    struct upload_window* window = &upload_windows[i];
+
+    if (window->in_use && window->source_address == source_address) {
+      return window;
+    }
+    if (!window->in_use) {
+      oldest = window;
+    } else if (oldest->in_use &&
+	       (frame_processor_ticks - window->last_active) >
+	       (frame_processor_ticks - oldest->last_active)) {
+      oldest = window;
+    }
+  }
+
+  /* Don't leave the previous owner without its acknowledgement */
+  if (oldest->in_use && oldest->unacked) {
+    send_window_ack(oldest);
+  }
+
+  /* Start a new window at this record */
+  memset(oldest, 0, sizeof(struct upload_window));
+  oldest->in_use = 1;
+  oldest->source_address = source_address;
+  oldest->cumulative = mem_addr;
+
+  return oldest;
+}
+/**
+ * Returns 1 if the record at mem_addr still needs to be stored, or 0
+ * if it has been stored already and this frame is a retransmission.
+ */
+uint8_t window_record_needed(struct upload_window* window, uint32_t mem_addr) {
+  int32_t offset = (int32_t)(mem_addr - window->cumulative);
+
+  if (offset < 0 && offset >= -UPLOAD_WINDOW_SIZE) { /* Behind the cumulative address */
+    return 0;
+  }
+  if (offset >= 0 && offset < UPLOAD_WINDOW_SIZE) { /* Inside the window */
+    return (window->bitmap & (1UL << offset)) ? 0 : 1;
+  }
+
+  /* The node has moved on without us. Restart the window here */
+  window->cumulative = mem_addr;
+  window->bitmap = 0;
+
+  return 1;
+}
+/**
+ * Records that the record at mem_addr has been stored, and slides the
+ * window forward over every contiguous record.
+ */
+void window_record_stored(struct upload_window* window, uint32_t mem_addr) {
+  window->bitmap |= 1UL << (mem_addr - window->cumulative);
+
+  while (window->bitmap & 1) {
+    window->bitmap >>= 1;
+    window->cumulative++;
+  }
+}
+/**
+ * Used to process a data frame that has been uploaded as part of a
+ * window.
+ */
+void window_block_uploaded(struct rx_frame* rx) {
+  uint32_t mem_addr;
+  uint32_t checksum, actual_checksum;
+
+  if (rx->length >= 5 + MEMORY_RECORD_SIZE) {
+    /* Copy the record from the radio packet. Skip the header and memory address */
+    memcpy(record, rx->data+5, MEMORY_RECORD_SIZE);
+
+    /* Calculate the checksum */
+    actual_checksum = calculate_checksum(record);
+    /* Read the checksum */
+    checksum = get_checksum(record);
+
+    if (checksum == actual_checksum) {
+      /* Extract the memory address */
+      mem_addr = get_memory_address_from_rx(rx);
+
+      struct upload_window* window = get_upload_window(rx->source_address, mem_addr);
+      window->last_active = frame_processor_ticks;
+      window->radif = rx->radif;
+
+      if (window_record_needed(window, mem_addr)) {
+	/* Write the record out to memory */
+	if (put_sample(record)) {
+	  window_record_stored(window, mem_addr);
+	  node_table_record_stored(rx->source_address);
+	} else { /* Left clear in the bitmap, with a back-off on the 'S' */
+	  upload_refused++;
+	  window->refused = 1;
+	}
+      } else {
+	node_table_duplicate(rx->source_address);
+      }
+
+      /* Even a retransmission needs acknowledging, it means our last 'S' was lost */
+      if (window->unacked++ == 0) {
+	window->ack_countdown = UPLOAD_WINDOW_ACK_TICKS;
+      }
+      if (window->unacked >= UPLOAD_WINDOW_ACK_RECORDS) {
+	send_window_ack(window);
+      }
+    } else {
+      node_table_checksum_failure(rx->source_address);
+      console_puts("Radio Window Frame Checksum Error!\n");
+      console_printf("Frame: %04x\nCalc: %04x\n", checksum, actual_checksum);
+    }
+  } else {
+    console_puts("Radio Window Frame too short!\n");
+  }
+}
+
+/* ======== Compressed Uploads ======== */
+
+/**
+ * The record a 'Z' frame is coded against.
+ */
+struct delta_base {
+  uint32_t flags;
+  uint64_t time;
+  uint32_t left;
+  uint32_t right;
+};
+/**
+ * The decoder state we keep for each node that uses 'Z' frames.
+ */
+struct upload_delta {
+  uint8_t in_use;
+  uint16_t source_address;
+  uint32_t last_active;	/* The tick at which we last heard from this node */
+
+  uint8_t synced;	/* Set if base is the last record of the last frame */
+  struct delta_base base;
+  uint32_t next_addr;	/* The memory address the next frame should start at */
+  uint32_t last_checksum; /* Of the last record, to acknowledge it again */
+};
+
+struct upload_delta upload_deltas[UPLOAD_DELTA_NODES];
+uint32_t delta_record[MEMORY_RECORD_SIZE/4];
+
+uint8_t key_request_packet[5];
+
+/**
+ * Asks a node to start again from mem_addr with a key frame.
+ */
+void send_key_request(uint16_t rf_address, uint32_t mem_addr, struct radif* radif) {
+  key_request_packet[0] = 'K';
+  key_request_packet[1] = mem_addr & 0xFF;
+  key_request_packet[2] = (mem_addr >> 8) & 0xFF;
+  key_request_packet[3] = (mem_addr >> 16) & 0xFF;
+  key_request_packet[4] = (mem_addr >> 24) & 0xFF;
+
+  radif_send(key_request_packet, 5, rf_address,
+	     RADIF_TX_ACK_REQUEST | RADIF_TX_UPLOAD_ACK, 0, radif);
+}
+/**
+ * Returns the decoder state for the given node, taking over the least
+ * recently active one if the node doesn't have one yet.
+ */
+struct upload_delta* get_upload_delta(uint16_t source_address) {
+  struct upload_delta* oldest = &upload_deltas[0];
+  uint8_t i;
+
+  for (i = 0; i < UPLOAD_DELTA_NODES; i++) {
+    struct upload_delta* delta = &upload_deltas[i];
+
+    if (delta->in_use && delta->source_address == source_address) {
+      return delta;
+    }
+    if (!delta->in_use) {
+      oldest = delta;
+    } else if (oldest->in_use &&
+	       (frame_processor_ticks - delta->last_active) >
+	       (frame_processor_ticks - oldest->last_active)) {
+      oldest = delta;
+    }
+  }
+
+  /* Start again without a base. The node will need to send a key frame */
+  memset(oldest, 0, sizeof(struct upload_delta));
+  oldest->in_use = 1;
+  oldest->source_address = source_address;
+
+  return oldest;
+}
+/**
+ * Reads a zigzag coded varint. Returns 0 if it runs past the end.
+ */
+uint8_t delta_read_varint(uint8_t** ptr, uint8_t* end, int64_t* value) {
+  uint64_t raw = 0;
+  uint8_t shift = 0;
+
+  do {
+    if (*ptr >= end || shift > 63) {
+      return 0;
+    }
+    raw |= (uint64_t)(**ptr & 0x7F) << shift;
+    shift += 7;
+  } while (*(*ptr)++ & 0x80);
+
+  *value = (int64_t)(raw >> 1) ^ -(int64_t)(raw & 1);
+
+  return 1;
+}
+/**
+ * Decodes the records in a 'Z' frame into delta_record one at a time,
+ * moving the base along, and stores each one if store is set. Returns
+ * count if the frame was decoded to the last octet, in which case
+ * delta_record holds the last record. If a record can't be stored it
+ * returns how many were stored before it, and 0 if the frame is bad.
+ */
+uint8_t delta_decode(struct delta_base* base, struct rx_frame* rx,
+		     uint32_t mem_addr, uint8_t count, uint8_t store) {
+  uint8_t* ptr = rx->data + UPLOAD_DELTA_HEADER;
+  uint8_t* end = rx->data + rx->length;
+  int64_t time, left, right;
+  uint8_t i;
+
+  for (i = 0; i < count; i++) {
+    if (ptr >= end) {
+      return 0;
+    }
+
+    if (*ptr++ & 1) { /* New flags */
+      if (end - ptr < 4) {
+	return 0;
+      }
+      base->flags = ptr[0] | ptr[1] << 8 | ptr[2] << 16 | (uint32_t)ptr[3] << 24;
+      ptr += 4;
+    }
+    if (!delta_read_varint(&ptr, end, &time) ||
+	!delta_read_varint(&ptr, end, &left) ||
+	!delta_read_varint(&ptr, end, &right)) {
+      return 0;
+    }
+    base->time += time;
+    base->left += (uint32_t)left;
+    base->right += (uint32_t)right;
+
+    /* Expand it to a standard record */
+    delta_record[0] = base->flags;
+    delta_record[1] = base->time & 0xFFFFFFFF;
+    delta_record[2] = base->time >> 32;
+    delta_record[3] = base->left;
+    delta_record[4] = base->right;
+    delta_record[5] = calculate_checksum((uint8_t*)delta_record);
+
+    if (store) {
+      if (upload_filter_seen(rx->source_address, mem_addr + i)) {
+	node_table_duplicate(rx->source_address);
+      } else if (put_sample((uint8_t*)delta_record)) {
+	upload_filter_add(rx->source_address, mem_addr + i);
+	node_table_record_stored(rx->source_address);
+      } else {
+	return i;
+      }
+    }
+  }
+
+  return (ptr == end) ? count : 0;
+}
+/**
+ * Used to process a compressed data frame.
+ */
+void delta_block_uploaded(struct rx_frame* rx) {
+  struct upload_delta* delta;
+  struct delta_base base, trial;
+  uint32_t mem_addr, checksum;
+  uint8_t key, count, stored;
+
+  if (rx->length < UPLOAD_DELTA_HEADER) {
+    console_puts("Radio Compressed Frame too short!\n");
+    return;
+  }
+
+  mem_addr = get_memory_address_from_rx(rx);
+  key = rx->data[5] & UPLOAD_DELTA_KEY;
+  count = rx->data[5] & ~UPLOAD_DELTA_KEY;
+  checksum = rx->data[6] | rx->data[7] << 8 | rx->data[8] << 16 | (uint32_t)rx->data[9] << 24;
+
+  if (count == 0 || count > UPLOAD_DELTA_MAX_RECORDS) {
+    console_puts("Radio Compressed Frame bad count!\n");
+    return;
+  }
+
+  delta = get_upload_delta(rx->source_address);
+  delta->last_active = frame_processor_ticks;
+
+  if (delta->synced && mem_addr + count == delta->next_addr &&
+      checksum == delta->last_checksum) {
+    /* We've decoded this already, our 'A' was lost */
+    node_table_duplicate(rx->source_address);
+    send_upload_ack(rx->source_address, mem_addr + count - 1, checksum, rx->radif);
+    return;
+  }
+
+  if (key) {
+    memset(&base, 0, sizeof(base));
+  } else if (delta->synced && mem_addr == delta->next_addr) {
+    base = delta->base;
+  } else { /* We can't decode this */
+    send_key_request(rx->source_address, mem_addr, rx->radif);
+    return;
+  }
+
+  /* Decode it once to check the result, before storing anything */
+  trial = base;
+  if (delta_decode(&trial, rx, mem_addr, count, 0) != count || delta_record[5] != checksum) {
+    node_table_checksum_failure(rx->source_address);
+    console_puts("Radio Compressed Frame Checksum Error!\n");
+
+    delta->synced = 0;
+    send_key_request(rx->source_address, mem_addr, rx->radif);
+    return;
+  }
+
+  /* And again, storing it this time */
+  stored = delta_decode(&base, rx, mem_addr, count, 1);
+  if (stored != count) {
+    /* The node will start again from the first we couldn't store */
+    delta->synced = 0;
+    send_upload_hold(rx->source_address, mem_addr + stored, rx->radif);
+    return;
+  }
+
+  delta->synced = 1;
+  delta->base = base;
+  delta->next_addr = mem_addr + count;
+  delta->last_checksum = checksum;
+
+  send_upload_ack(rx->source_address, mem_addr + count - 1, checksum, rx->radif);
+}
+
+/**
+ * Sends any selective acknowledgements that are due, and watches the
+ * uplink. Should be called from the main processing loop.
+ */
+void frame_processor_service(void) {
+  uint8_t i;
+
+  frame_processor_ticks++;
+
+  if ((frame_processor_ticks % 2000) == 0) { /* Every second */
+    upload_stall_update();
+  }
+
+  for (i = 0; i < UPLOAD_WINDOW_NODES; i++) {
+    struct upload_window* window = &upload_windows[i];
+
+    if (window->in_use && window->unacked) {
+      if (window->ack_countdown == 0) {
+	send_window_ack(window);
+      } else {
+	window->ack_countdown--;
+      }
+    }
+  }
+}
+/**
+ * Initialises the frame processor.
+ */
+void frame_processor_init(void) {
+  memset(upload_windows, 0, sizeof(upload_windows));
+  memset(upload_deltas, 0, sizeof(upload_deltas));
+  frame_processor_ticks = 0;
+
+  upload_last_read_index = memory_indexes.read_index;
+  upload_stall_secs = 0;
+  upload_refused = 0;
+
+  /* No node has the broadcast address, so this empties the filter */
+  memset(upload_filter_nodes, 0xFF, sizeof(upload_filter_nodes));
+}
@@ -0,0 +1,443 @@
+/* 
+ * Authenticates frames from the nodes
+ * Copyright (C) 2013  Richard Meadows
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <string.h>
+#include "frame_security.h"
+#include "radio.h"
+#include "radio/rf212.h"
+#include "radio/radio_functions.h"
+#include "radio/ieee_frame.h"
+#include "radio/ccm.h"
+#include "memory/memory.h"
+#include "memory/checksum.h"
+#include "console.h"
+#include "debug.h"
+
+struct frame_security_key {
+  uint8_t index;
+  uint8_t reserved[3];
+  uint8_t key[16];
+};
+/**
+ * The keys the nodes have been given, laid out exactly as they're stored
+ */
+struct frame_security_key_table {
+  uint32_t magic;
+  uint32_t crc;		/* Of everything after it */
+  uint8_t count;
+  uint8_t reserved[3];
+  struct frame_security_key keys[FRAME_SECURITY_MAX_KEYS];
+};
+
+struct frame_security_key_table frame_security_keys;
+struct aes_key frame_security_aes; /* Only the key we last used in software */
+uint8_t frame_security_aes_key; /* Which one that is, FRAME_SECURITY_MAX_KEYS for none */
+
+struct frame_security_replay {
+  uint64_t source; /* 0 if empty */
+  uint32_t frame_counter;
+  uint32_t last_heard; /* frame_security_ticks */
+};
+/**
+ * Laid out exactly as it's stored, one per block. It's built in
+ * memory_sector.
+ */
+struct frame_security_replay_block {
+  uint32_t magic;
+  uint32_t crc;		/* Of everything after it */
+  struct frame_security_replay replays[FRAME_SECURITY_REPLAY_PER_BLOCK];
+};
+
+struct frame_security_replay frame_security_replays[FRAME_SECURITY_REPLAY_SIZE];
+uint8_t frame_security_replay_dirty; /* Counters have moved since we last wrote them */
+
+uint32_t frame_security_ticks;
+uint8_t frame_security_hw_fail; /* The AES engine timed out on this frame */
+uint8_t frame_security_copy[0x7F]; /* The payload as received, in case we have to start again */
+
+/* ---- Statistics ---- */
+uint32_t frame_security_ok; /* Frames that passed */
+uint32_t frame_security_bad_mic;
+uint32_t frame_security_replay;
+uint32_t frame_security_replay_full; /* Sources we had no room to track */
+uint32_t frame_security_insecure; /* Frames without a MIC */
+uint32_t frame_security_unknown_key;
+uint32_t frame_security_hw_fallback; /* Frames redone in software */
+
+/* ---- Benchmark, in µs for a FRAME_SECURITY_BENCH_LEN octet frame ---- */
+uint32_t frame_security_bench_sw_seal, frame_security_bench_sw_open;
+uint32_t frame_security_bench_hw_seal, frame_security_bench_hw_open;
+
+/**
+ * Runs one block through a radio's AES engine. The key must already be
+ * loaded.
+ */
+void frame_security_hw_block(const uint8_t* in, uint8_t* out, void* context) {
+  struct radif* radif = (struct radif*)context;
+
+  radif->enter_critical();
+  if (radio_aes_encrypt(in, out, radif) != RADIO_SUCCESS) {
+    frame_security_hw_fail = 1;
+  }
+  radif->exit_critical();
+}
+/**
+ * Sets up a cipher for a key, on the radio's AES engine if we can.
+ */
+void frame_security_cipher(struct ccm_cipher* cipher, uint8_t key,
+			   uint8_t hw, struct radif* radif) {
+  frame_security_hw_fail = 0;
+
+  if (hw && radif->up) {
+    radif->enter_critical();
+    radio_aes_set_key(frame_security_keys.keys[key].key, radif);
+    radif->exit_critical();
+
+    cipher->encrypt = frame_security_hw_block;
+    cipher->context = radif;
+  } else {
+    if (frame_security_aes_key != key) { /* Expand it */
+      aes_set_key(frame_security_keys.keys[key].key, &frame_security_aes);
+      frame_security_aes_key = key;
+    }
+
+    cipher->encrypt = aes_encrypt;
+    cipher->context = &frame_security_aes;
+  }
+}
+/**
+ * Returns where in frame_security_keys the key with a key index is, or
+ * FRAME_SECURITY_MAX_KEYS if we don't have it.
+ */
+uint8_t frame_security_key(uint8_t index) {
+  uint8_t i;
+
+  for (i = 0; i < frame_security_keys.count; i++) {
+    if (frame_security_keys.keys[i].index == index) {
+      return i;
+    }
+  }
+
+  return FRAME_SECURITY_MAX_KEYS;
+}
+/**
+ * Reads the keys from the SD card. Without them every secured frame is
+ * dropped.
+ */
+void frame_security_read_keys(void) {
+  struct frame_security_key_table* table = &frame_security_keys;
+
+  frame_security_aes_key = FRAME_SECURITY_MAX_KEYS;
+
+  if (!get_key_block((uint8_t*)table, sizeof(struct frame_security_key_table)) ||
+      table->magic != FRAME_SECURITY_KEY_MAGIC ||
+      table->crc != calculate_crc32((uint8_t*)table + 8,
+				    sizeof(struct frame_security_key_table) - 8) ||
+      table->count > FRAME_SECURITY_MAX_KEYS) {
+    console_puts("Frame Security: No keys stored, secured frames will be dropped\n");
+    memset(table, 0, sizeof(struct frame_security_key_table));
+    return;
+  }
+
+  console_printf("Frame Security: %d keys\n", table->count);
+}
+/**
+ * Returns the address the nonce is built from. See frame_security.h.
+ */
+uint64_t frame_security_source(struct rx_frame* rx) {
+  if (rx->source_addr_mode == FRAME_PAN_ID_64BIT_ADDR) {
+    return rx->source_ext_address;
+  }
+
+  return ((uint64_t)rx->source_pan_id << 16) | rx->source_address;
+}
+/**
+ * Builds the CCM* nonce.
+ */
+void frame_security_nonce(uint8_t* nonce, uint64_t source,
+			  uint32_t frame_counter, uint8_t level) {
+  uint8_t i;
+
+  for (i = 0; i < 8; i++) { /* Big endian */
+    nonce[i] = (source >> (8 * (7 - i))) & 0xFF;
+  }
+  for (i = 0; i < 4; i++) {
+    nonce[8 + i] = (frame_counter >> (8 * (3 - i))) & 0xFF;
+  }
+  nonce[12] = level;
+}
+/**
+ * Returns the length of the MIC for a security level.
+ */
+uint8_t frame_security_mic_len(uint8_t level) {
+  return (level & 3) ? (2 << (level & 3)) : 0;
+}
+/**
+ * Checks a frame against the MIC that comes at the end of it, and
+ * decrypts it if it was encrypted. Returns non-zero if it did.
+ */
+uint8_t frame_security_open(struct ccm_cipher* cipher, uint8_t* nonce,
+			    struct rx_frame* rx, uint8_t mic_len) {
+  uint8_t len = rx->length - mic_len;
+
+  if (rx->security_level & 4) { /* Encrypted */
+    return ccm_star_open(cipher, nonce, rx->mhr, rx->mhr_len, 0, 0,
+			 rx->data, len, 1, rx->data + len, mic_len) == 0;
+  }
+
+  return ccm_star_open(cipher, nonce, rx->mhr, rx->mhr_len, rx->data, len,
+		       0, 0, 0, rx->data + len, mic_len) == 0;
+}
+
+/* -------- Replay Protection -------- */
+
+/**
+ * Returns the replay entry for a source, or the one it should take
+ * over. That's an empty one, or one that's been idle for longer than
+ * FRAME_SECURITY_REPLAY_IDLE_TICKS. Returns 0 if there isn't one.
+ */
+struct frame_security_replay* frame_security_replay_entry(uint64_t source) {
+  struct frame_security_replay* oldest = 0;
+  uint8_t i;
+
+  for (i = 0; i < FRAME_SECURITY_REPLAY_SIZE; i++) {
+    struct frame_security_replay* entry = &frame_security_replays[i];
+
+    if (entry->source == source) {
+      return entry;
+    }
+    if (oldest == 0 || oldest->source != 0) {
+      if (entry->source == 0 ||
+	  frame_security_ticks - entry->last_heard > FRAME_SECURITY_REPLAY_IDLE_TICKS) {
+	oldest = entry;
+      }
+    }
+  }
+
+  return oldest;
+}
+/**
+ * Writes the counters to the SD card.
+ */
+void frame_security_replay_write(void) {
+  struct frame_security_replay_block* block =
+    (struct frame_security_replay_block*)memory_sector;
+  uint8_t b;
+
+  for (b = 0; b < MEMORY_REPLAY_BLOCKS; b++) {
+    memory_sector_block = MEMORY_REPLAY_BLOCK + b;
+    block->magic = FRAME_SECURITY_REPLAY_MAGIC;
+    memcpy(block->replays, &frame_security_replays[b * FRAME_SECURITY_REPLAY_PER_BLOCK],
+	   sizeof(block->replays));
+    block->crc = calculate_crc32((uint8_t*)block + 8,
+				 sizeof(struct frame_security_replay_block) - 8);
+
+    if (!put_replay_block((uint8_t*)block, sizeof(struct frame_security_replay_block), b)) {
+      console_puts("Frame Security: Couldn't write the frame counters!\n");
+      return;
+    }
+  }
+
+  frame_security_replay_dirty = 0;
+}
+/**
+ * Reads the counters from the SD card, so frames from before a restart
+ * can't be replayed after it. Each source counts as just heard.
+ */
+void frame_security_replay_read(void) {
+  struct frame_security_replay_block* block =
+    (struct frame_security_replay_block*)memory_sector;
+  struct frame_security_replay* replays;
+  uint8_t b, i;
+
+  memset(frame_security_replays, 0, sizeof(frame_security_replays));
+
+  for (b = 0; b < MEMORY_REPLAY_BLOCKS; b++) {
+    replays = &frame_security_replays[b * FRAME_SECURITY_REPLAY_PER_BLOCK];
+    memory_sector_block = MEMORY_REPLAY_BLOCK + b;
+
+    if (!get_replay_block((uint8_t*)block, sizeof(struct frame_security_replay_block), b) ||
+	block->magic != FRAME_SECURITY_REPLAY_MAGIC ||
+	block->crc != calculate_crc32((uint8_t*)block + 8,
+				      sizeof(struct frame_security_replay_block) - 8)) {
+      console_puts("Frame Security: Frame counters missing, frames could be replayed\n");
+      continue;
+    }
+
+    memcpy(replays, block->replays, sizeof(block->replays));
+    for (i = 0; i < FRAME_SECURITY_REPLAY_PER_BLOCK; i++) {
+      replays[i].last_heard = 0;
+    }
+  }
+}
+
+/**
+ * Called with every frame received. Returns non-zero if the frame should
+ * be dropped, otherwise it's been checked and decrypted, and the MIC has
+ * been taken off its length.
+ */
+uint8_t frame_security_frame(struct rx_frame* rx) {
+  struct frame_security_replay* replay;
+  struct ccm_cipher cipher;
+  uint8_t nonce[CCM_NONCE_LEN];
+  uint8_t mic_len = frame_security_mic_len(rx->security_level);
+  uint64_t source;
+  uint8_t key;
+
+  if (mic_len == 0) { /* Nothing to check */
+    if (rx->security_level == 0 && frame_security_keys.count == 0 &&
+	!FRAME_SECURITY_REQUIRED) { /* We can't expect it to be secured */
+      return 0;
+    }
+    frame_security_insecure++;
+    return 1;
+  }
+
+  key = frame_security_key(rx->key_index);
+  if (key == FRAME_SECURITY_MAX_KEYS) {
+    frame_security_unknown_key++;
+    return 1;
+  }
+  if (rx->mhr_len == 0 || rx->length < mic_len) {
+    frame_security_bad_mic++;
+    return 1;
+  }
+
+  /* Look for a replay before spending time on the MIC */
+  source = frame_security_source(rx);
+  replay = frame_security_replay_entry(source);
+  if (replay == 0) { /* We can't protect it, so we can't take it */
+    frame_security_replay_full++;
+    return 1;
+  }
+  if (replay->source == source && rx->frame_counter <= replay->frame_counter) {
+    frame_security_replay++;
+    return 1;
+  }
+
+  frame_security_nonce(nonce, source, rx->frame_counter, rx->security_level);
+  frame_security_cipher(&cipher, key, FRAME_SECURITY_HW_AES, rx->radif);
+  memcpy(frame_security_copy, rx->data, rx->length);
+
+  if (!frame_security_open(&cipher, nonce, rx, mic_len)) {
+    if (!frame_security_hw_fail) {
+      frame_security_bad_mic++;
+      return 1;
+    }
+    /* The AES engine let us down, try again in software */
+    frame_security_hw_fallback++;
+    memcpy(rx->data, frame_security_copy, rx->length);
+    frame_security_cipher(&cipher, key, 0, rx->radif);
+
+    if (!frame_security_open(&cipher, nonce, rx, mic_len)) {
+      frame_security_bad_mic++;
+      return 1;
+    }
+  }
+
+  /* Good. Only now can the counter move forward */
+  replay->source = source;
+  replay->frame_counter = rx->frame_counter;
+  replay->last_heard = frame_security_ticks;
+  frame_security_replay_dirty = 1;
+
+  rx->length -= mic_len;
+  frame_security_ok++;
+
+  return 0;
+}
+
+/* -------- Benchmark -------- */
+
+/**
+ * Times sealing and opening a level 5 frame, with a cipher on the
+ * radio's AES engine or in software.
+ */
+void frame_security_time(uint8_t hw, uint32_t* seal, uint32_t* open,
+			 struct radif* radif) {
+  uint8_t* frame = frame_security_copy; /* Nothing else needs it right now */
+  struct ccm_cipher cipher;
+  uint8_t nonce[CCM_NONCE_LEN];
+  uint8_t mhr_len = 16, mic_len = 4; /* Short addresses, key index mode */
+  uint8_t m_len = FRAME_SECURITY_BENCH_LEN - mhr_len - mic_len;
+  uint32_t start;
+
+  memset(frame, 0x5A, FRAME_SECURITY_BENCH_LEN);
+  frame_security_nonce(nonce, 0x1234, 1, 5);
+
+  start = radif->clock_us();
+  frame_security_cipher(&cipher, 0, hw, radif);
+  ccm_star_seal(&cipher, nonce, frame, mhr_len, 0, 0, frame + mhr_len, m_len, 1,
+		frame + mhr_len + m_len, mic_len);
+  *seal = radif->clock_us() - start;
+
+  start = radif->clock_us();
+  frame_security_cipher(&cipher, 0, hw, radif);
+  if (ccm_star_open(&cipher, nonce, frame, mhr_len, 0, 0, frame + mhr_len, m_len, 1,
+		    frame + mhr_len + m_len, mic_len) != 0 || frame_security_hw_fail) {
+    debug_printf("Frame Security: %s AES failed its own MIC\n", hw ? "Hardware" : "Software");
+  }
+  *open = radif->clock_us() - start;
+}
+/**
+ * Compares the AES engine on the first radio to software.
+ */
+void frame_security_bench(void) {
+  struct radif* radif = &rf212_radif[0];
+
+  frame_security_time(0, &frame_security_bench_sw_seal,
+		      &frame_security_bench_sw_open, radif);
+
+  if (radif->up) {
+    frame_security_time(1, &frame_security_bench_hw_seal,
+			&frame_security_bench_hw_open, radif);
+  }
+
+  debug_printf("Frame Security: %d octets, software seal %dus open %dus, "
+	       "hardware seal %dus open %dus\n", FRAME_SECURITY_BENCH_LEN,
+	       frame_security_bench_sw_seal, frame_security_bench_sw_open,
+	       frame_security_bench_hw_seal, frame_security_bench_hw_open);
+}
+
+/**
+ * Called every tick.
+ */
+void frame_security_service(void) {
+  if (++frame_security_ticks == FRAME_SECURITY_BENCH_TICKS) {
+    frame_security_bench();
+  }
+  if ((frame_security_ticks % FRAME_SECURITY_WRITE_TICKS) == 0 && frame_security_replay_dirty) {
+    frame_security_replay_write();
+  }
+}
+/**
+ * Reads the keys and the frame counters.
+ */
+void frame_security_init(void) {
+  frame_security_read_keys();
+
+  frame_security_replay_read();
+  frame_security_replay_dirty = 0;
+  frame_security_ticks = 0;
+}
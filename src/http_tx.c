@@ -25,7 +25,9 @@
 #include <stdio.h>
 #include <string.h>
 #include "server_tcp.h"
+#include "http_tx.h"
 #include "base64.h"
+#include "memory/memory.h"
 
 /**
  * ======== Packet Structure ========
@@ -43,7 +45,11 @@
  * ---------------------------------------------------------------------------------
  *
  * Target Frequency:
- *      0-59: Energy Measurement - Value is the target frequency to the nearest kHz
+ *      0-55: Energy Measurement - Value is the target frequency to the nearest kHz
+ *      56: A change to the CSMA settings.
+ *      57: A long record, followed by its data. See MEMORY_LONG_RECORD_TYPE.
+ *      58: Node statistics.
+ *      59: Channel occupancy.
  *      60: Left Data is actually battery measurement.
  *      61: Left Data is actually an radio RSSI measurement.
  *      62: Left Data is actually a time jump record.
@@ -69,8 +75,17 @@
  * The number of characters that each record uses. Records that do not
  * reach this size should be padded out with whitespace until they do
  * (which is fine, whitespace in JSON is cool).
+ *
+ * Long records don't fit, so they take up several of these slots and the
+ * commas between them. The comma goes before each element rather than
+ * after, so that whatever slots are left at the end can be filled with
+ * whitespace too.
  */
 #define JSON_RECORD_CHARS      180
+/**
+ * The most characters a long record uses before its data.
+ */
+#define JSON_LONG_OVERHEAD_CHARS	100
 
 /* ======== Helper Functions for JSONification ======== */
 
@@ -129,6 +144,75 @@ int sprintf_battery(char* buffer, uint32_t value) {
 int sprintf_rssi(char* buffer, uint32_t value) {
   return sprintf(buffer, "\"rssi\":{\"value\":%lu}", value);
 }
+int sprintf_occupancy(char* buffer, uint32_t flags, uint32_t low, uint32_t high) {
+  uint16_t buff_offset = 0;
+  uint8_t channels = flags & 0xF;
+  uint8_t i;
+
+  buff_offset += sprintf(buffer+buff_offset,
+			 "\"occupancy\":{\"radio\":%lu,\"channel\":%lu,\"value\":[",
+			 (flags >> 8) & 0xF, (flags >> 4) & 0xF);
+
+  for (i = 0; i < channels && i < 8; i++) {
+    uint32_t word = (i < 4) ? low : high;
+
+    buff_offset += sprintf(buffer+buff_offset, (i == 0) ? "%lu" : ",%lu",
+			   (word >> (8 * (i % 4))) & 0xFF);
+  }
+
+  buff_offset += sprintf(buffer+buff_offset, "]}");
+
+  return buff_offset; /* Max 88 characters */
+}
+int sprintf_node(char* buffer, uint32_t flags, uint32_t left, uint32_t right) {
+  uint16_t buff_offset = 0;
+
+  buff_offset += sprintf(buffer+buff_offset, "\"node\":{\"address\":%lu,\"ed\":%lu,",
+			 flags & 0xFFFF, (flags >> 16) & 0xFF);
+
+  if (((flags >> 24) & 0x3) == 0) {
+    buff_offset += sprintf(buffer+buff_offset, "\"frames\":%lu,\"bytes\":%lu}",
+			   left, right);
+  } else {
+    buff_offset += sprintf(buffer+buff_offset,
+			   "\"records\":%lu,\"duplicates\":%lu,"
+			   "\"checksum_failures\":%lu,\"seen_secs_ago\":%lu}",
+			   left & 0xFFFF, left >> 16, right & 0xFFFF, right >> 16);
+  }
+
+  return buff_offset; /* Max 120 characters */
+}
+int sprintf_csma(char* buffer, uint32_t flags, uint32_t left, uint32_t right) {
+  uint16_t buff_offset = 0;
+  uint32_t old_settings = right >> 12;
+
+  buff_offset += sprintf(buffer+buff_offset,
+			 "\"csma\":{\"radio\":%lu,\"trac\":%lu,\"acked\":%lu,"
+			 "\"channel_fail\":%lu,\"no_ack\":%lu,",
+			 (flags >> 24) & 0x3, (flags >> 20) & 0x7,
+			 left & 0xFFFF, left >> 16, right & 0xFFF);
+  /* [frame_retries, csma_retries, min_be, max_be, cca_threshold] */
+  buff_offset += sprintf(buffer+buff_offset, "\"from\":[%lu,%lu,%lu,%lu,%lu],",
+			 old_settings & 0xF, (old_settings >> 4) & 0x7,
+			 (old_settings >> 8) & 0xF, (old_settings >> 12) & 0xF,
+			 (old_settings >> 16) & 0xF);
+  buff_offset += sprintf(buffer+buff_offset, "\"to\":[%lu,%lu,%lu,%lu,%lu]}",
+			 flags & 0xF, (flags >> 4) & 0x7, (flags >> 8) & 0xF,
+			 (flags >> 12) & 0xF, (flags >> 16) & 0xF);
+
+  return buff_offset; /* Max 122 characters */
+}
+int sprintf_long(char* buffer, uint32_t flags, uint32_t length, uint8_t* data) {
+  uint16_t buff_offset = 0;
+
+  buff_offset += sprintf(buffer+buff_offset,
+			 "\"long\":{\"node\":%lu,\"type\":%lu,\"length\":%lu,\"data\":\"",
+			 flags & 0xFFFF, (flags >> 16) & 0xFF, length);
+  buff_offset += base64_encode(data, buffer+buff_offset, length);
+  buff_offset += sprintf(buffer+buff_offset, "\"}");
+
+  return buff_offset; /* Max JSON_LONG_OVERHEAD_CHARS + 4/3 of the length */
+}
 int sprintf_envelope(char* buffer, uint32_t left, uint32_t right) {
   uint16_t buff_offset = 0;
 
@@ -144,12 +228,12 @@ int sprintf_envelope(char* buffer, uint32_t left, uint32_t right) {
  * Writes a HTTP header to `buffer` with optional HTTP basic authorization
  * string (Base64 encoded). Returns the number of bytes written.
  */
-int http_header(char* buffer, char* auth, uint16_t records_count) {
+int http_header(char* buffer, char* auth, uint16_t slots_count) {
   int buff_offset = 0;
   /* Calculate the content length */
   unsigned int content_len = JSON_OVERHEAD_CHARS + /* JSON wrapper */
-    (records_count * JSON_RECORD_CHARS) + /* JSON elements */
-    (records_count - 1); /* Commas between JSON elements */
+    (slots_count * JSON_RECORD_CHARS) + /* JSON elements */
+    (slots_count - 1); /* Commas between JSON elements */
 
   /* Header */
   buff_offset += sprintf(buffer+buff_offset, "POST /vlf_fft/_bulk_docs HTTP/1.1\r\nHost: ");
@@ -172,12 +256,34 @@ int json_header(char* buffer) {
   return sprintf(buffer, "{\"docs\":[");
 }
 /**
- * Writes a JSON object that represents the binary data passed to `buffer`.
+ * Returns the number of slots the JSON object for the binary data takes.
+ */
+uint16_t json_element_slots(uint32_t* binary_data) {
+  uint16_t chars;
+
+  if (binary_data == NULL || ((binary_data[0] >> 26) & 0x3F) != MEMORY_LONG_RECORD_TYPE) {
+    return 1;
+  }
+
+  chars = JSON_LONG_OVERHEAD_CHARS + 4 * ((binary_data[3] + 2) / 3);
+
+  /* Each slot after the first also has the comma that would have come before it */
+  return (chars + JSON_RECORD_CHARS + 1) / (JSON_RECORD_CHARS + 1);
+}
+/**
+ * Writes a JSON object that represents the binary data passed to
+ * `buffer`, with a comma in front of it if it isn't the first.
  */
 int json_element(char* buffer, uint32_t* binary_data, uint8_t comma) {
   int buff_offset = 0;
+  int end = (json_element_slots(binary_data) * (JSON_RECORD_CHARS + 1)) - 1;
   uint32_t record_type;
 
+  if (comma) {
+    buff_offset += sprintf(buffer+buff_offset, ",");
+    end++;
+  }
+
   /* Start the object */
   buff_offset += sprintf(buffer+buff_offset, "{");
 
@@ -190,6 +296,22 @@ int json_element(char* buffer, uint32_t* binary_data, uint8_t comma) {
     record_type = (binary_data[0] >> 26) & 0x3F;
 
     switch (record_type) {
+      case MEMORY_LONG_RECORD_TYPE: /* Long Record */
+	buff_offset += sprintf_long(buffer+buff_offset, binary_data[0], binary_data[3],
+				    (uint8_t*)binary_data + MEMORY_RECORD_SIZE);
+	break;
+      case 56: /* CSMA Settings */
+	buff_offset += sprintf_csma(buffer+buff_offset, binary_data[0],
+				    binary_data[3], binary_data[4]);
+	break;
+      case 58: /* Node Statistics */
+	buff_offset += sprintf_node(buffer+buff_offset, binary_data[0],
+				    binary_data[3], binary_data[4]);
+	break;
+      case 59: /* Channel Occupancy */
+	buff_offset += sprintf_occupancy(buffer+buff_offset, binary_data[0],
+					 binary_data[3], binary_data[4]);
+	break;
       case 60: /* Battery */
 	buff_offset += sprintf_battery(buffer+buff_offset, binary_data[3]);
 	break;
@@ -209,7 +331,7 @@ int json_element(char* buffer, uint32_t* binary_data, uint8_t comma) {
   }
 
   /* Pad the object out to it's full length */
-  while (buff_offset < (JSON_RECORD_CHARS-1)) {
+  while (buff_offset < (end-1)) {
     *(buffer+buff_offset) = ' ';
     buff_offset++;
   }
@@ -217,14 +339,22 @@ int json_element(char* buffer, uint32_t* binary_data, uint8_t comma) {
   /* Finish the object */
   buff_offset += sprintf(buffer+buff_offset, "}");
 
-  /* At this point buff_offset should always equal JSON_RECORD_CHARS */
-
-  if (comma) {
-    buff_offset += sprintf(buffer+buff_offset, ",");
-  }
+  /* At this point buff_offset should always equal end */
 
   return buff_offset;
 }
+/**
+ * Fills the slots that are left at the end with whitespace. Returns the
+ * number of bytes written.
+ */
+int json_filler(char* buffer, uint16_t slots, uint8_t comma) {
+  int len = (slots * (JSON_RECORD_CHARS + 1)) - (comma ? 0 : 1);
+
+  memset(buffer, ' ', len);
+  buffer[len] = '\0';
+
+  return len;
+}
 /**
  * Returns a pointer to a buffer containing a JSON footer. Returns the number of
  * bytes written.
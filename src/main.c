@@ -58,7 +58,8 @@ int main(void) {
   radio_init();
   init_current_time();
 
-  /* Switch to a stable clock source from the radio */
+  /* Switch to a stable clock source from the radio. radio_init() has
+   * waited for the radios to start up and drive CLKM */
   switch_to_stable_clock();
 
   /* Setup the Repetitive Interrupt Timer (RIT) */
@@ -31,7 +31,7 @@
 /**
  * A table of CRC-32 values for every value from 0-255. The Polynomial used is 0xEDB88320.
  */
-static uint32_t crc32_table[] = {
+static const uint32_t crc32_table[] = {
   0x00000000,0x77073096,0xEE0E612C,0x990951BA,0x076DC419,0x706AF48F,0xE963A535,0x9E6495A3,
   0x0EDB8832,0x79DCB8A4,0xE0D5E91E,0x97D2D988,0x09B64C2B,0x7EB17CBD,0xE7B82D07,0x90BF1D91,
   0x1DB71064,0x6AB020F2,0xF3B97148,0x84BE41DE,0x1ADAD47D,0x6DDDE4EB,0xF4D4B551,0x83D385C7,
@@ -66,19 +66,32 @@ static uint32_t crc32_table[] = {
   0xB3667A2E,0xC4614AB8,0x5D681B02,0x2A6F2B94,0xB40BBE37,0xC30C8EA1,0x5A05DF1B,0x2D02EF8D
 };
 /**
- * Performs a CRC-32 checksum on a record of length MEMORY_RECORD_SIZE.
- * The last 4 octets are ignored as this is where the CRC value itself will go.
+ * Carries on a CRC-32 checksum over another length octets. Start with a
+ * crc of 0.
  */
-uint32_t calculate_checksum(uint8_t* record) {
-  uint32_t checksum = ~0U; /* By convention the CRC starts with 0xFFFFFFFF */
+uint32_t update_crc32(uint32_t crc, uint8_t* data, uint16_t length) {
+  uint32_t checksum = crc ^ ~0U; /* By convention the CRC starts with 0xFFFFFFFF */
   uint16_t i;
 
-  for (i = 0; i < MEMORY_RECORD_SIZE-4; i++) {
-    checksum = crc32_table[(checksum ^ record[i]) & 0xFF] ^ (checksum >> 8);
+  for (i = 0; i < length; i++) {
+    checksum = crc32_table[(checksum ^ data[i]) & 0xFF] ^ (checksum >> 8);
   }
 
   return checksum ^ ~0U; /* By convention we NOT all the bits */
 }
+/**
+ * Performs a CRC-32 checksum on length octets.
+ */
+uint32_t calculate_crc32(uint8_t* data, uint16_t length) {
+  return update_crc32(0, data, length);
+}
+/**
+ * Performs a CRC-32 checksum on a record of length MEMORY_RECORD_SIZE.
+ * The last 4 octets are ignored as this is where the CRC value itself will go.
+ */
+uint32_t calculate_checksum(uint8_t* record) {
+  return calculate_crc32(record, MEMORY_RECORD_SIZE-4);
+}
 /**
  * Gets the checksum described in a record.
  */
@@ -33,18 +33,24 @@
 #define NULL (void*)0
 
 #define INDEXES_LEN 32
-uint8_t indexes_buf[INDEXES_LEN];
+/* After the copies of the indexes is the first record block they're for */
+#define INDEXES_LAYOUT_WORD (INDEXES_LEN/4)
+uint8_t indexes_buf[INDEXES_LEN+4];
+
+/* The first record block when the card was last written */
+uint32_t indexes_layout;
 
 uint8_t get_memory_indexes(struct memory_indexes* indexes) {
   /* If the indexes are invalid they will be set to the value 0xFFFFFFFF */
 
   /* Read the first page of the memory */
-  disk_read(indexes_buf, INDEXES_LEN, 0);
+  disk_read(indexes_buf, INDEXES_LEN+4, 0);
 
   uint32_t* words = (uint32_t*)indexes_buf;
 
   indexes->read_index = words[0];
   indexes->write_index = words[1];
+  indexes_layout = words[INDEXES_LAYOUT_WORD];
 
   uint16_t i;
   for (i = 2; i < INDEXES_LEN/4; i+=2) {
@@ -67,12 +73,66 @@ uint8_t put_memory_indexes(struct memory_indexes* indexes) {
     words[i] = indexes->read_index+i;
     words[i+1] = indexes->write_index+i;
   }
+  words[INDEXES_LAYOUT_WORD] = MEMORY_FIRST_RECORD_BLOCK;
 
   /* Write the first page of the memory */
-  disk_write(indexes_buf, INDEXES_LEN, 0);
+  disk_write(indexes_buf, INDEXES_LEN+4, 0);
 
   return 1;
 }
+/**
+ * Reads the association leases. Returns 1 on success. It's up to the
+ * caller to check what it reads is valid.
+ */
+uint8_t get_lease_block(uint8_t* buffer, uint16_t length) {
+  return disk_read(buffer, length, MEMORY_LEASE_BLOCK) ? 0 : 1;
+}
+/**
+ * Writes the association leases. Returns 1 on success.
+ */
+uint8_t put_lease_block(uint8_t* buffer, uint16_t length) {
+  return disk_write(buffer, length, MEMORY_LEASE_BLOCK) ? 0 : 1;
+}
+/**
+ * Reads the frame security keys. Returns 1 on success. It's up to the
+ * caller to check what it reads is valid.
+ */
+uint8_t get_key_block(uint8_t* buffer, uint16_t length) {
+  return disk_read(buffer, length, MEMORY_KEY_BLOCK) ? 0 : 1;
+}
+/**
+ * Reads block index of the frame security counters. Returns 1 on
+ * success. It's up to the caller to check what it reads is valid.
+ */
+uint8_t get_replay_block(uint8_t* buffer, uint16_t length, uint8_t index) {
+  if (index >= MEMORY_REPLAY_BLOCKS) {
+    return 0;
+  }
+
+  return disk_read(buffer, length, MEMORY_REPLAY_BLOCK + index) ? 0 : 1;
+}
+/**
+ * Writes block index of the frame security counters. Returns 1 on
+ * success.
+ */
+uint8_t put_replay_block(uint8_t* buffer, uint16_t length, uint8_t index) {
+  if (index >= MEMORY_REPLAY_BLOCKS) {
+    return 0;
+  }
+
+  return disk_write(buffer, length, MEMORY_REPLAY_BLOCK + index) ? 0 : 1;
+}
+/**
+ * Reads block index of the node image, where block 0 is its
+ * header. Returns 1 on success.
+ */
+uint8_t get_image_block(uint8_t* buffer, uint16_t length, uint16_t index) {
+  if (index >= MEMORY_IMAGE_BLOCKS) {
+    return 0;
+  }
+
+  return disk_read(buffer, length, MEMORY_IMAGE_BLOCK + index) ? 0 : 1;
+}
 
 /* ======== Block Control ======== */
 
@@ -80,7 +140,7 @@ uint8_t put_memory_indexes(struct memory_indexes* indexes) {
  * Returns 1 if the block is valid, 0 is it isn't.
  */
 uint8_t is_block_valid(uint32_t block) {
-  return (block == 0x00000000 ||	/* Reserved for the indexes */
+  return (block < MEMORY_FIRST_RECORD_BLOCK ||	/* Reserved for the indexes, leases and image */
 	  block > 0x007FFFFF ||		/* Outside the 32-bit address space */
 	  block > disk_sectors()-1) ? 0 : 1;	/* Beyond the size of the disk */
 }
@@ -91,7 +151,7 @@ uint32_t next_block(uint32_t current_block) {
   uint32_t next = current_block+1;
 
   if (!is_block_valid(next)) {
-    next = 0x00000001; /* Goto the first block */
+    next = MEMORY_FIRST_RECORD_BLOCK; /* Goto the first block */
   }
 
   return next;
@@ -102,20 +162,40 @@ uint32_t next_block(uint32_t current_block) {
 uint32_t last_write_time;
 
 /**
- * Returns the record at the given index.
+ * Returns the record at the given index. A long record is followed by
+ * its data.
  */
 uint32_t* get_sample(uint32_t index) {
+  uint32_t* record = (uint32_t*)memory_sector;
+  uint32_t length;
+
+  memory_sector_block = 0; /* It won't be a copy of the whole block */
+
   /* Read the page */
-  if (disk_read((uint8_t*)mem_buf, MEMORY_RECORD_SIZE, index)) {
+  if (disk_read(memory_sector, MEMORY_RECORD_SIZE, index)) {
     /* Disk Read Error */
     return NULL;
   }
-  if (evaluate_checksum((uint8_t*)mem_buf) == CHECKSUM_FAIL) {
+  if (evaluate_checksum(memory_sector) == CHECKSUM_FAIL) {
     /* Bad Checksum */
     return NULL;
   }
 
-  return mem_buf;
+  if (((record[0] >> 26) & 0x3F) == MEMORY_LONG_RECORD_TYPE) {
+    length = record[3];
+
+    /* Read the page again, this time with the data */
+    if (length > MEMORY_LONG_RECORD_MAX ||
+	disk_read(memory_sector, MEMORY_RECORD_SIZE + length, index)) {
+      return NULL;
+    }
+    if (calculate_crc32(memory_sector + MEMORY_RECORD_SIZE, length) != record[4]) {
+      /* Bad Data */
+      return NULL;
+    }
+  }
+
+  return record;
 }
 /**
  * Returns the current read index.
@@ -123,16 +203,48 @@ uint32_t* get_sample(uint32_t index) {
 uint32_t get_current_read_block(void) {
   return memory_indexes.read_index;
 }
+/**
+ * Returns the highest block a record can be stored in.
+ */
+uint32_t get_last_record_block(void) {
+  uint32_t last = 0x007FFFFF; /* The end of the 32-bit address space */
+
+  if (disk_sectors() - 1 < last) {
+    last = disk_sectors() - 1;
+  }
+
+  return last;
+}
+/**
+ * Returns the number of blocks from the read index to the write index,
+ * allowing for the write index having wrapped round to
+ * MEMORY_FIRST_RECORD_BLOCK. Both must be valid.
+ */
+uint32_t get_blocks_used(void) {
+  uint32_t size = get_last_record_block() - MEMORY_FIRST_RECORD_BLOCK + 1;
+
+  if (memory_indexes.write_index >= memory_indexes.read_index) {
+    return memory_indexes.write_index - memory_indexes.read_index;
+  }
+
+  return size - (memory_indexes.read_index - memory_indexes.write_index);
+}
 /**
  * Returns the number of blocks that are available to be read from memory.
  */
 uint16_t get_blocks_to_read(void) {
-  int32_t blocks = memory_indexes.write_index - memory_indexes.read_index;
+  uint32_t blocks;
 
-  if (blocks < 0) {
-    /* There are no blocks available */
+  if (!is_block_valid(memory_indexes.write_index)) {
+    /* Nothing has been written */
     return 0;
   }
+  if (!is_block_valid(memory_indexes.read_index)) {
+    /* Reading it moves the read index onto the first block */
+    blocks = 1;
+  } else {
+    blocks = get_blocks_used();
+  }
 
   /* If we wrote to memory during the last 3 seconds */
   if (LPC_TIM3->TC - last_write_time < 3) {
@@ -144,14 +256,41 @@ uint16_t get_blocks_to_read(void) {
   return (blocks < 1000) ? blocks : 1000;
 }
 /**
- * Puts a record into memory.
+ * Returns the number of blocks that can be written before we'd have to
+ * overwrite ones that haven't been uploaded yet.
+ */
+uint32_t get_blocks_free(void) {
+  uint32_t size = get_last_record_block() - MEMORY_FIRST_RECORD_BLOCK + 1;
+
+  if (!is_block_valid(memory_indexes.read_index) ||
+      !is_block_valid(memory_indexes.write_index)) {
+    return size - 1; /* Nothing written yet */
+  }
+
+  return size - 1 - get_blocks_used();
+}
+/**
+ * Puts a record into memory. Returns 1 if it was stored.
  */
 uint8_t put_sample(uint8_t* block) {
+  return put_long_sample(block, 0);
+}
+/**
+ * Puts a record followed by length octets of data into memory. Returns
+ * 1 if it was stored, or 0 if memory is full or the write failed.
+ */
+uint8_t put_long_sample(uint8_t* block, uint16_t length) {
   uint32_t next = next_block(memory_indexes.write_index);
 
+  if (length > MEMORY_LONG_RECORD_MAX) {
+    return 0;
+  }
+
   if (next != memory_indexes.read_index) { /* If we're not about to overwrite valid data */
     /* Write to disk */
-    disk_write(block, MEMORY_RECORD_SIZE, next);
+    if (disk_write(block, MEMORY_RECORD_SIZE + length, next)) {
+      return 0; /* Disk Write Error */
+    }
 
     /* Update the indexes */
     memory_indexes.write_index = next;
@@ -187,18 +326,105 @@ void good_upload_done(void) {
  */
 void bad_upload_done(void) {
   /* Read the block in question */
-  if (disk_read((uint8_t*)mem_buf, MEMORY_RECORD_SIZE, memory_indexes.read_index)) {
+  memory_sector_block = 0;
+  if (disk_read(memory_sector, MEMORY_RECORD_SIZE, memory_indexes.read_index)) {
     return; /* Fail */
   }
 
   /* TODO: Evaluate if the checksum on the block itself is okay */
   /* If it is, re-write the block at the current memory address */
-  //	uint32_t checksum = get_checksum(mem_buf+1);
+  //	uint32_t checksum = get_checksum(memory_sector+4);
 
   /* Move the indexes forward as if the upload had been successful */
   good_upload_done();
 }
 
+/* ======== Older Layouts ======== */
+
+/**
+ * Copies the record in block to the end of the queue. Returns 1 if there
+ * was a record there and it was copied.
+ */
+uint8_t relocate_record(uint32_t block) {
+  uint32_t* record = get_sample(block);
+  uint16_t length = 0;
+
+  if (record == NULL) { /* Not a record, or it's been overwritten */
+    return 0;
+  }
+  if (((record[0] >> 26) & 0x3F) == MEMORY_LONG_RECORD_TYPE) {
+    length = record[3];
+  }
+
+  return put_long_sample((uint8_t*)record, length);
+}
+/**
+ * Copies the records from blocks first to last, but only those below
+ * MEMORY_FIRST_RECORD_BLOCK, to the end of the queue. Returns the number
+ * copied.
+ */
+uint32_t relocate_records(uint32_t first, uint32_t last) {
+  uint32_t block, moved = 0;
+
+  if (last >= MEMORY_FIRST_RECORD_BLOCK) {
+    last = MEMORY_FIRST_RECORD_BLOCK - 1;
+  }
+
+  for (block = first; block <= last; block++) {
+    moved += relocate_record(block);
+  }
+
+  return moved;
+}
+/**
+ * Older firmware stored records from a lower block, so there can be
+ * records waiting to be uploaded in what are now reserved blocks. These
+ * are copied to the end of the queue, and the indexes moved out of the
+ * reserved blocks. The records are read read_index to write_index, and
+ * wrap round to old_first.
+ */
+void relocate_reserved_records(uint32_t old_first) {
+  uint32_t read = memory_indexes.read_index;
+  uint32_t write = memory_indexes.write_index;
+  uint32_t last = get_last_record_block();
+  uint32_t moved = 0;
+
+  if (old_first == 0 || old_first >= MEMORY_FIRST_RECORD_BLOCK) {
+    old_first = 1; /* We don't know, so look at everything */
+  }
+
+  /* First keep what's already past the reserved blocks */
+  if (read <= write) {
+    if (write < MEMORY_FIRST_RECORD_BLOCK) { /* There's nothing */
+      memory_indexes.read_index = memory_indexes.write_index = 0xFFFFFFFF;
+    } else if (read < MEMORY_FIRST_RECORD_BLOCK) {
+      memory_indexes.read_index = MEMORY_FIRST_RECORD_BLOCK;
+    }
+  } else if (write < MEMORY_FIRST_RECORD_BLOCK) { /* Wrapped into the reserved blocks */
+    if (read < MEMORY_FIRST_RECORD_BLOCK) {
+      memory_indexes.read_index = MEMORY_FIRST_RECORD_BLOCK;
+    }
+    memory_indexes.write_index = last;
+  }
+
+  /* Then append the records from the reserved blocks, in order */
+  if (read <= write) {
+    moved += relocate_records(read, write);
+  } else {
+    moved += relocate_records(read, last);
+    moved += relocate_records(old_first, write);
+  }
+
+  if (memory_indexes.read_index == 0xFFFFFFFF &&
+      memory_indexes.write_index != 0xFFFFFFFF) { /* We started from nothing */
+    memory_indexes.read_index = MEMORY_FIRST_RECORD_BLOCK;
+  }
+  put_memory_indexes(&memory_indexes);
+
+  console_printf("Memory: Records now start at block %d, moved %lu records from reserved blocks\n",
+		 MEMORY_FIRST_RECORD_BLOCK, moved);
+}
+
 /* ======== Initialisation ======== */
 uint8_t memory_init(void) {
   /* Set up the SD card */
@@ -212,7 +438,10 @@ uint8_t memory_init(void) {
   memory_indexes.read_index = memory_indexes.write_index = 0xFFFFFFFF;
 
   /* Get the memory indexes we need */
-  get_memory_indexes(&memory_indexes);
+  if (get_memory_indexes(&memory_indexes) &&
+      indexes_layout != MEMORY_FIRST_RECORD_BLOCK) { /* Written by older firmware */
+    relocate_reserved_records(indexes_layout);
+  }
 
   /* Optionally reset the indexes */
   //memory_indexes.read_index = memory_indexes.write_index = 0;
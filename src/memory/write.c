@@ -38,6 +38,9 @@
  * 4:		RIGHT CHANNEL READING
  * 5:		CHECKSUM
  *
+ * A long record is followed in its block by its data. See
+ * MEMORY_LONG_RECORD_TYPE.
+ *
  * There are an integer number of records stored in each 64
  * KByte. This value is called RECORDS_PER_PAGE
  *
@@ -52,11 +55,12 @@ uint32_t write_block[MEMORY_RECORD_SIZE/4];
  * Writes a sample to memory with the specified record_flags. The
  * time_ago parameter is used to specify how many seconds ago the
  * reading is from, which is useful if the reading is averaged over
- * say n seconds then is is from n/2 seconds ago.
+ * say n seconds then is is from n/2 seconds ago. Returns 1 if the sample
+ * was stored.
  */
-void write_sample_to_mem(uint32_t record_flags,
-			 uint32_t left_data, uint32_t right_data,
-			 uint32_t time_ago) {
+uint8_t write_sample_to_mem(uint32_t record_flags,
+			    uint32_t left_data, uint32_t right_data,
+			    uint32_t time_ago) {
   /* Populate the write_block */
   write_block[0] = record_flags; /* Record flags */
 
@@ -73,5 +77,31 @@ void write_sample_to_mem(uint32_t record_flags,
   write_block[5] = calculate_checksum((uint8_t*)write_block); /* Checksum */
 
   /* Write out the sample */
-  put_sample((uint8_t*)write_block);
+  return put_sample((uint8_t*)write_block);
+}
+/**
+ * Writes a long record with the specified record_flags. The block must
+ * have room for the record before its length octets of data, so the data
+ * isn't copied. Returns 1 if the record was stored.
+ */
+uint8_t write_long_record_to_mem(uint32_t record_flags, uint32_t* block,
+				 uint16_t length, uint32_t time_ago) {
+  uint8_t* data = (uint8_t*)block + MEMORY_RECORD_SIZE;
+
+  block[0] = (MEMORY_LONG_RECORD_TYPE << 26) | (record_flags & 0x3FFFFFF);
+
+  uint64_t time = get_current_time();
+  time -= time_ago;
+  uint32_t* t_ptr = (uint32_t*)&time;
+
+  block[1] = t_ptr[0];
+  block[2] = t_ptr[1];
+
+  block[3] = length; /* Data */
+  block[4] = calculate_crc32(data, length);
+
+  block[5] = calculate_checksum((uint8_t*)block); /* Checksum */
+
+  /* Write out the record and its data */
+  return put_long_sample((uint8_t*)block, length);
 }
@@ -0,0 +1,270 @@
+/* 
+ * Keeps link and traffic statistics for each node
+ * Copyright (C) 2013  Richard Meadows
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <string.h>
+#include "node_table.h"
+#include "radio.h"
+#include "sntp/time.h"
+#include "memory/write.h"
+
+struct node_stats node_table[NODE_TABLE_SIZE];
+uint8_t node_table_count;
+
+uint32_t node_table_ticks;
+uint8_t node_table_snapshot; /* The next entry to snapshot, NODE_TABLE_SIZE when done */
+uint8_t node_table_snapshot_part;
+
+/**
+ * Returns the current gateway time in seconds.
+ */
+uint32_t node_table_now(void) {
+  uint32_t secs, us;
+
+  get_timer_time(&secs, &us);
+
+  return secs;
+}
+/**
+ * Returns the entry an address would first be looked for in.
+ */
+uint8_t node_table_hash(uint16_t address) {
+  /* Fibonacci hashing */
+  return (uint8_t)(((uint16_t)(address * 40503U)) >> (16 - NODE_TABLE_BITS));
+}
+/**
+ * Returns the entry for an address, or the empty entry it would go in.
+ */
+struct node_stats* node_table_probe(uint16_t address) {
+  uint8_t i = node_table_hash(address);
+
+  while (node_table[i].address != 0 && node_table[i].address != address) {
+    i = (i + 1) & (NODE_TABLE_SIZE - 1);
+  }
+
+  return &node_table[i];
+}
+/**
+ * Removes an entry, moving back any entries after it that would no
+ * longer be found.
+ */
+void node_table_remove(uint8_t hole) {
+  uint8_t i = hole;
+
+  node_table[hole].address = 0;
+  node_table_count--;
+
+  while (1) {
+    i = (i + 1) & (NODE_TABLE_SIZE - 1);
+
+    if (node_table[i].address == 0) {
+      return;
+    }
+
+    /* Can this entry move back into the hole? */
+    uint8_t home = node_table_hash(node_table[i].address);
+
+    if (((i - home) & (NODE_TABLE_SIZE - 1)) >= ((i - hole) & (NODE_TABLE_SIZE - 1))) {
+      node_table[hole] = node_table[i];
+      node_table[i].address = 0;
+      hole = i;
+    }
+  }
+}
+/**
+ * Makes room by dropping the node we heard from least recently.
+ */
+void node_table_evict(void) {
+  uint32_t now = node_table_now();
+  uint8_t i, oldest = 0;
+
+  for (i = 0; i < NODE_TABLE_SIZE; i++) {
+    if (node_table[i].address != 0 &&
+	(node_table[oldest].address == 0 ||
+	 (now - node_table[i].last_seen) > (now - node_table[oldest].last_seen))) {
+      oldest = i;
+    }
+  }
+
+  node_table_remove(oldest);
+}
+
+/**
+ * Returns the statistics for an address, or NULL if we don't have any.
+ */
+struct node_stats* node_table_find(uint16_t address) {
+  struct node_stats* node;
+
+  if (address == 0) {
+    return NULL;
+  }
+
+  node = node_table_probe(address);
+
+  return (node->address == address) ? node : NULL;
+}
+/**
+ * Returns the statistics for an address, adding it if needed.
+ */
+struct node_stats* node_table_get(uint16_t address) {
+  struct node_stats* node = node_table_find(address);
+
+  if (node == NULL && address != 0) {
+    if (node_table_count >= NODE_TABLE_MAX_NODES) {
+      node_table_evict();
+    }
+
+    node = node_table_probe(address);
+    memset(node, 0, sizeof(struct node_stats));
+    node->address = address;
+    node_table_count++;
+  }
+
+  return node;
+}
+
+/**
+ * Returns 1 if we've had this MAC sequence number from the node recently,
+ * and adds it to the window.
+ */
+uint8_t node_table_seq_seen(struct node_stats* node, uint8_t seq, uint32_t now) {
+  uint8_t behind = node->seq_last - seq;
+  uint8_t ahead = seq - node->seq_last;
+
+  if (node->frames == 0 || (now - node->last_seen) > NODE_TABLE_SEQ_SECONDS) {
+    /* Start the window again */
+    node->seq_window = 1;
+  } else if (behind < NODE_TABLE_SEQ_WINDOW) { /* Inside the window */
+    if (node->seq_window & (1 << behind)) {
+      return 1;
+    }
+    node->seq_window |= (1 << behind);
+    return 0;
+  } else if (ahead < 0x80) { /* Move the window forward */
+    node->seq_window = (ahead < NODE_TABLE_SEQ_WINDOW) ? (node->seq_window << ahead) | 1 : 1;
+  } else { /* Far behind, the node must have restarted */
+    node->seq_window = 1;
+  }
+
+  node->seq_last = seq;
+
+  return 0;
+}
+/**
+ * Called for every frame received. Returns 1 if the frame is a MAC
+ * retransmission of one we've already had.
+ */
+uint8_t node_table_frame(struct rx_frame* rx) {
+  struct node_stats* node;
+  uint32_t now = node_table_now();
+  uint8_t duplicate;
+
+  if (rx->source_address >= RADIF_NO_SHORT_ADDRESS || (node = node_table_get(rx->source_address)) == NULL) {
+    return 0;
+  }
+
+  duplicate = node_table_seq_seen(node, rx->seq, now);
+  if (duplicate) {
+    node->duplicates++;
+  }
+
+  if (node->frames == 0) {
+    node->ed_average = rx->energy_detect;
+  } else { /* Moving average over about 8 frames */
+    node->ed_average = (uint8_t)(((uint16_t)node->ed_average * 7 + rx->energy_detect) / 8);
+  }
+
+  /* Retransmissions still count, they use airtime */
+  node->frames++;
+  node->bytes += rx->length;
+  node->last_seen = now;
+
+  return duplicate;
+}
+void node_table_record_stored(uint16_t address) {
+  struct node_stats* node = node_table_find(address);
+  if (node) { node->records++; }
+}
+void node_table_duplicate(uint16_t address) {
+  struct node_stats* node = node_table_find(address);
+  if (node) { node->duplicates++; }
+}
+void node_table_checksum_failure(uint16_t address) {
+  struct node_stats* node = node_table_find(address);
+  if (node) { node->checksum_failures++; }
+}
+
+/**
+ * Stores one part of the snapshot of a node.
+ */
+void node_table_store(struct node_stats* node, uint8_t part) {
+  uint32_t flags = (NODE_TABLE_RECORD_TYPE << 26) | (part << 24) |
+    (node->ed_average << 16) | node->address;
+  uint32_t ago;
+
+  if (part == 0) {
+    write_sample_to_mem(flags, node->frames, node->bytes, 0);
+  } else {
+    ago = node_table_now() - node->last_seen;
+    if (ago > 0xFFFF) { ago = 0xFFFF; }
+
+    write_sample_to_mem(flags,
+			node->records | ((uint32_t)node->duplicates << 16),
+			node->checksum_failures | (ago << 16), 0);
+  }
+}
+/**
+ * Called every tick. Takes a snapshot of the table every
+ * NODE_TABLE_SNAPSHOT_TICKS, storing one record each tick.
+ */
+void node_table_service(void) {
+  if (++node_table_ticks >= NODE_TABLE_SNAPSHOT_TICKS) {
+    node_table_ticks = 0;
+    node_table_snapshot = 0;
+    node_table_snapshot_part = 0;
+  }
+
+  /* Find the next entry in the snapshot */
+  while (node_table_snapshot < NODE_TABLE_SIZE &&
+	 node_table[node_table_snapshot].address == 0) {
+    node_table_snapshot++;
+  }
+
+  if (node_table_snapshot < NODE_TABLE_SIZE) {
+    node_table_store(&node_table[node_table_snapshot], node_table_snapshot_part);
+
+    if (++node_table_snapshot_part > 1) {
+      node_table_snapshot_part = 0;
+      node_table_snapshot++;
+    }
+  }
+}
+/**
+ * Initialises the table.
+ */
+void node_table_init(void) {
+  memset(node_table, 0, sizeof(node_table));
+  node_table_count = 0;
+  node_table_ticks = 0;
+  node_table_snapshot = NODE_TABLE_SIZE;
+}
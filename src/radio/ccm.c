@@ -0,0 +1,171 @@
+/* 
+ * CCM* authenticated encryption
+ * Copyright (C) 2013  Richard Meadows
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <string.h>
+#include "ccm.h"
+
+/**
+ * A CBC-MAC in progress. Octets are XORed into x, which is encrypted
+ * each time it fills.
+ */
+struct ccm_mac {
+  uint8_t x[16];
+  uint8_t fill;
+};
+
+void ccm_mac_update(struct ccm_cipher* cipher, struct ccm_mac* mac,
+		    const uint8_t* data, uint8_t len) {
+  while (len--) {
+    mac->x[mac->fill++] ^= *data++;
+
+    if (mac->fill == 16) {
+      cipher->encrypt(mac->x, mac->x, cipher->context);
+      mac->fill = 0;
+    }
+  }
+}
+/**
+ * Pads what's there so far with zeros to the end of a block.
+ */
+void ccm_mac_pad(struct ccm_cipher* cipher, struct ccm_mac* mac) {
+  if (mac->fill) {
+    cipher->encrypt(mac->x, mac->x, cipher->context);
+    mac->fill = 0;
+  }
+}
+/**
+ * Works out the unencrypted authentication tag T over a1, a2 and m.
+ */
+void ccm_star_tag(struct ccm_cipher* cipher, const uint8_t* nonce,
+		  const uint8_t* a1, uint8_t a1_len, const uint8_t* a2, uint8_t a2_len,
+		  const uint8_t* m, uint8_t m_len, uint8_t* tag, uint8_t mic_len) {
+  struct ccm_mac mac;
+  uint16_t a_len = a1_len + a2_len;
+  uint8_t b[2];
+
+  /* B0: Flags, the nonce and the length of m */
+  mac.x[0] = (a_len ? 0x40 : 0) | (mic_len ? ((mic_len - 2) / 2) << 3 : 0) | (2 - 1);
+  memcpy(mac.x + 1, nonce, CCM_NONCE_LEN);
+  mac.x[14] = 0;
+  mac.x[15] = m_len;
+  cipher->encrypt(mac.x, mac.x, cipher->context);
+  mac.fill = 0;
+
+  /* The authenticated data, prefixed with its length */
+  if (a_len) {
+    b[0] = a_len >> 8;
+    b[1] = a_len & 0xFF;
+    ccm_mac_update(cipher, &mac, b, 2);
+    ccm_mac_update(cipher, &mac, a1, a1_len);
+    ccm_mac_update(cipher, &mac, a2, a2_len);
+    ccm_mac_pad(cipher, &mac);
+  }
+
+  /* Then the message */
+  ccm_mac_update(cipher, &mac, m, m_len);
+  ccm_mac_pad(cipher, &mac);
+
+  memcpy(tag, mac.x, mic_len);
+}
+/**
+ * Encrypts block i of the key stream into s.
+ */
+void ccm_star_keystream(struct ccm_cipher* cipher, const uint8_t* nonce,
+			uint16_t i, uint8_t* s) {
+  s[0] = (2 - 1); /* Flags */
+  memcpy(s + 1, nonce, CCM_NONCE_LEN);
+  s[14] = i >> 8;
+  s[15] = i & 0xFF;
+  cipher->encrypt(s, s, cipher->context);
+}
+/**
+ * Encrypts or decrypts m in counter mode, starting from block 1.
+ */
+void ccm_star_ctr(struct ccm_cipher* cipher, const uint8_t* nonce,
+		  uint8_t* m, uint8_t m_len) {
+  uint8_t s[16];
+  uint16_t i;
+  uint8_t j;
+
+  for (i = 1; m_len; i++) {
+    ccm_star_keystream(cipher, nonce, i, s);
+
+    for (j = 0; j < 16 && m_len; j++, m_len--) {
+      *m++ ^= s[j];
+    }
+  }
+}
+
+/**
+ * Authenticates a1, a2 and m, and encrypts m in place if encrypt is
+ * set. The MIC is written to mic.
+ */
+void ccm_star_seal(struct ccm_cipher* cipher, const uint8_t* nonce,
+		   const uint8_t* a1, uint8_t a1_len, const uint8_t* a2, uint8_t a2_len,
+		   uint8_t* m, uint8_t m_len, uint8_t encrypt,
+		   uint8_t* mic, uint8_t mic_len) {
+  uint8_t s[16];
+  uint8_t i;
+
+  if (mic_len) {
+    ccm_star_tag(cipher, nonce, a1, a1_len, a2, a2_len, m, m_len, mic, mic_len);
+
+    /* The MIC is encrypted with the first block of the key stream */
+    ccm_star_keystream(cipher, nonce, 0, s);
+    for (i = 0; i < mic_len; i++) {
+      mic[i] ^= s[i];
+    }
+  }
+
+  if (encrypt) {
+    ccm_star_ctr(cipher, nonce, m, m_len);
+  }
+}
+/**
+ * Decrypts m in place if encrypt is set, and checks the MIC. Returns 0
+ * if it matches. m is left decrypted either way.
+ */
+uint8_t ccm_star_open(struct ccm_cipher* cipher, const uint8_t* nonce,
+		      const uint8_t* a1, uint8_t a1_len, const uint8_t* a2, uint8_t a2_len,
+		      uint8_t* m, uint8_t m_len, uint8_t encrypt,
+		      const uint8_t* mic, uint8_t mic_len) {
+  uint8_t tag[CCM_MAX_MIC], s[16];
+  uint8_t i, diff = 0;
+
+  if (encrypt) {
+    ccm_star_ctr(cipher, nonce, m, m_len);
+  }
+
+  if (mic_len) {
+    ccm_star_tag(cipher, nonce, a1, a1_len, a2, a2_len, m, m_len, tag, mic_len);
+    ccm_star_keystream(cipher, nonce, 0, s);
+
+    /* Look at every octet, so the time taken doesn't say where it differs */
+    for (i = 0; i < mic_len; i++) {
+      diff |= tag[i] ^ s[i] ^ mic[i];
+    }
+  }
+
+  return diff;
+}
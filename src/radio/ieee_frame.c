@@ -33,16 +33,56 @@ uint16_t read_spi_word(struct radif* radif) {
   uint16_t lsb = radif->spi_xfer(BLANK_SPI_CHARACTER);
   return (radif->spi_xfer(BLANK_SPI_CHARACTER) << 8) | lsb;
 }
+void write_spi_ext_address(uint64_t address, struct radif* radif) {
+  uint8_t i;
 
-uint8_t ieee_header_len(struct tx_frame* tx) {
-  /* TODO this might be determined by what addressing is in use in the tx status */
-  return 9;
+  for (i = 0; i < 8; i++) { /* Least significant octet first */
+    radif->spi_xfer(address & 0xFF);
+    address >>= 8;
+  }
+}
+uint64_t read_spi_ext_address(struct radif* radif) {
+  uint64_t address = 0;
+  uint8_t i;
+
+  for (i = 0; i < 8; i++) {
+    address |= (uint64_t)radif->spi_xfer(BLANK_SPI_CHARACTER) << (8*i);
+  }
+
+  return address;
+}
+
+/**
+ * Returns the number of octets an address takes up in the header.
+ */
+uint8_t ieee_address_len(uint8_t mode) {
+  switch (mode) {
+    case FRAME_PAN_ID_16BIT_ADDR: return 2;
+    case FRAME_PAN_ID_64BIT_ADDR: return 8;
+    default: return 0;
+  }
+}
+/**
+ * We use our short address if we've got one, otherwise our extended one.
+ */
+uint8_t ieee_source_mode(struct radif* radif) {
+  if (radif->short_address < RADIF_NO_SHORT_ADDRESS || radif->ext_address == 0) {
+    return FRAME_PAN_ID_16BIT_ADDR;
+  }
+  return FRAME_PAN_ID_64BIT_ADDR;
+}
+
+uint8_t ieee_header_len(struct tx_frame* tx, struct radif* radif) {
+  /* FCF and Sequence Number. Both addresses share the PAN ID */
+  return 3 + 2 + ieee_address_len(tx->dest_addr_mode) +
+    ieee_address_len(ieee_source_mode(radif));
 }
 void write_out_ieee_header(struct tx_frame* tx, struct radif* radif) {
-  uint16_t fcf = (FRAME_PAN_ID_16BIT_ADDR << 14) | /* Source addressing mode */
+  uint8_t src_addr_mode = ieee_source_mode(radif);
+  uint16_t fcf = (src_addr_mode << 14) | /* Source addressing mode */
     (FRAME_VERSION_IEEE_2006 << 12) | /* Frame version */
-    (FRAME_PAN_ID_16BIT_ADDR << 10) | /* Destination addressing mode */
-    FCF_PAN_ID_COMPRESSION |
+    (tx->dest_addr_mode << 10) | /* Destination addressing mode */
+    FCF_PAN_ID_COMPRESSION | /* The source is in the same PAN */
     FRAME_TYPE_DATA; /* Frame type = data */
   /* Set the acknowledge flag if we've been asked */
   if (tx->ack > 0) { fcf |= FCF_ACKNOWLEDGE_REQUEST; }
@@ -57,10 +97,18 @@ void write_out_ieee_header(struct tx_frame* tx, struct radif* radif) {
   write_spi_word(radif->pan_id, radif);
 
   /* Destination Address */
-  write_spi_word(tx->destination_address, radif);
+  if (tx->dest_addr_mode == FRAME_PAN_ID_64BIT_ADDR) {
+    write_spi_ext_address(tx->dest_ext_address, radif);
+  } else {
+    write_spi_word(tx->destination_address, radif);
+  }
 
-  /* Source Address */
-  write_spi_word(radif->short_address, radif);
+  /* Source Address. The PAN ID is compressed */
+  if (src_addr_mode == FRAME_PAN_ID_64BIT_ADDR) {
+    write_spi_ext_address(radif->ext_address, radif);
+  } else {
+    write_spi_word(radif->short_address, radif);
+  }
 
   /* Possible Security Header */
 }
@@ -74,43 +122,94 @@ uint8_t read_in_ieee_header(struct rx_frame* rx, struct radif* radif) {
   uint8_t dest_addr_mode = (fcf >> 10) & 0x3;
   uint8_t frame_version = (fcf >> 12) & 0x3;
   uint8_t src_addr_mode = (fcf >> 14) & 0x3;
+  uint16_t dest_pan_id = 0;
 
   /* Sequence Number */
-  uint8_t seq = radif->spi_xfer(BLANK_SPI_CHARACTER);
+  rx->seq = radif->spi_xfer(BLANK_SPI_CHARACTER);
 
   /* Keep track for how many bytes we've read from this point on */
   uint8_t read = 3;
 
-  if (dest_addr_mode == FRAME_PAN_ID_16BIT_ADDR) {
-    read_spi_word(radif); /* PAN ID */
-    read_spi_word(radif); /* Destination Address */
-    read += 4;
-  } else if (dest_addr_mode == FRAME_PAN_ID_64BIT_ADDR) {
-    read_spi_word(radif); /* PAN ID */
-    read += 2;
-    /* TODO */
+  if (dest_addr_mode == 1 || src_addr_mode == 1 ||	/* Reserved addressing modes */
+      frame_version > FRAME_VERSION_IEEE_2006) {	/* A version we don't know */
+    return 0;
   }
 
-  if (src_addr_mode == FRAME_PAN_ID_16BIT_ADDR) {
-    if (pan_id_compression) {
-      /* TODO */
+  /* Destination. The radio has already filtered on this unless it's promiscuous */
+  rx->to_us = 1; /* Frames without a destination are for the PAN coordinator, us */
+
+  if (dest_addr_mode != FRAME_NO_ADDRESS) {
+    dest_pan_id = read_spi_word(radif); /* PAN ID */
+    read += 2;
+
+    if (dest_pan_id != radif->pan_id && dest_pan_id != 0xFFFF) {
+      rx->to_us = 0;
+    }
+
+    if (dest_addr_mode == FRAME_PAN_ID_64BIT_ADDR) {
+      if (read_spi_ext_address(radif) != radif->ext_address) {
+	rx->to_us = 0;
+      }
     } else {
-      read_spi_word(radif); /* PAN ID */
+      uint16_t dest_address = read_spi_word(radif);
+
+      if (dest_address != radif->short_address && dest_address != 0xFFFF) {
+	rx->to_us = 0;
+      }
+    }
+    read += ieee_address_len(dest_addr_mode);
+  }
+
+  /* Source */
+  rx->source_addr_mode = src_addr_mode;
+  rx->source_address = RADIF_NO_SHORT_ADDRESS;
+  rx->source_ext_address = 0;
+  rx->source_pan_id = dest_pan_id;
+
+  if (src_addr_mode != FRAME_NO_ADDRESS) {
+    /* The source PAN ID is left out if it's the same as the destination's */
+    if (!(pan_id_compression && dest_addr_mode != FRAME_NO_ADDRESS)) {
+      rx->source_pan_id = read_spi_word(radif);
       read += 2;
     }
-    rx->source_address = read_spi_word(radif); /* Source Address */
-    read += 2;
-  } else if (src_addr_mode == FRAME_PAN_ID_64BIT_ADDR) {
-    if (pan_id_compression) {
-      /* TODO */
+
+    if (src_addr_mode == FRAME_PAN_ID_64BIT_ADDR) {
+      rx->source_ext_address = read_spi_ext_address(radif);
     } else {
-      read_spi_word(radif); /* PAN ID */
-      read += 2;
+      rx->source_address = read_spi_word(radif);
     }
-    /* TODO */
+    read += ieee_address_len(src_addr_mode);
   }
 
-  /* TODO: Possible Security Header */
+  /* Auxiliary Security Header. The MIC is checked further up */
+  rx->security_level = 0;
+  rx->key_index = 0;
+  rx->frame_counter = 0;
+
+  if (fcf & FCF_SECURITY_ENABLED) {
+    uint8_t control = radif->spi_xfer(BLANK_SPI_CHARACTER);
+    uint8_t key_id_mode = (control >> SECURITY_KEY_ID_MODE_SHIFT) & SECURITY_KEY_ID_MODE_MASK;
+    uint8_t i;
+
+    if (frame_version < FRAME_VERSION_IEEE_2006) { /* 2003 security isn't supported */
+      return 0;
+    }
+    if (key_id_mode == 0) { /* Nor is an implicit key, there'd be no key index */
+      return 0;
+    }
+
+    rx->security_level = control & SECURITY_LEVEL_MASK;
+    rx->frame_counter = read_spi_word(radif);
+    rx->frame_counter |= (uint32_t)read_spi_word(radif) << 16;
+    read += 5;
+
+    /* Key Identifier. We only use the index, the key source must be ours */
+    for (i = 0; i < (key_id_mode == 1 ? 0 : key_id_mode == 2 ? 4 : 8); i++) {
+      radif->spi_xfer(BLANK_SPI_CHARACTER);
+    }
+    rx->key_index = radif->spi_xfer(BLANK_SPI_CHARACTER);
+    read += i + 1;
+  }
 
   return read;
 }
@@ -25,30 +25,112 @@
 #include <string.h>
 #include <stdlib.h>
 #include "radio.h"
+#include "ieee_frame.h"
+#include "radio_airtime.h"
+#include "radio_functions.h"
 
 /**
- * Do a command
+ * Queues a batch of commands, all or none of them. Each callback, if
+ * there is one, is called from the radio interrupt once its command has
+ * completed. Returns RADIO_BUSY_STATE if the command queue is too full.
+ *
+ * This can also be called from a tx or command callback.
  */
-uint8_t radif_command(uint8_t command, struct radif* radif) {
-  radif->Command = command;
+uint8_t radif_command_batch(const struct radif_command* commands, uint8_t count,
+			    struct radif* radif) {
+  uint8_t index, space, i;
 
-  /* Trigger the interrupt */
+  /* Stop a callback in the radio interrupt queueing commands at the same time */
+  radif->enter_critical();
+
+  index = radif->CommandProduceIndex;
+  space = (radif->CommandConsumeIndex + NUM_COMMANDS - index - 1) % NUM_COMMANDS;
+
+  if (count == 0 || count > space) { /* The queue is full */
+    radif->exit_critical();
+    return RADIO_BUSY_STATE;
+  }
+
+  for (i = 0; i < count; i++) {
+    radif->Commands[index] = commands[i];
+
+    /* Every command but the last is followed straight on by the next */
+    if (i < count - 1) {
+      radif->Commands[index].flags |= RADIF_COMMAND_CONTINUE;
+    } else {
+      radif->Commands[index].flags &= ~RADIF_COMMAND_CONTINUE;
+    }
+
+    index = (index+1) % NUM_COMMANDS;
+  }
+
+  /* Move the produce index past them all at once */
+  radif->CommandProduceIndex = index;
+
+  radif->exit_critical();
+
+  /* Trigger the interrupt to get the command started if possible */
   radif->interrupt_trigger();
 
-  /* Wait for the command to be completed */
-  while (radif->Command != 0);
+  return RADIO_SUCCESS;
+}
+/**
+ * Queues a command that changes a setting to argument. See
+ * RADIF_COMMAND_ARGUMENT.
+ */
+uint8_t radif_command_arg(uint8_t command, uint32_t argument,
+			  command_callback_func callback, struct radif* radif) {
+  struct radif_command c;
+
+  c.command = command;
+  c.flags = RADIF_COMMAND_ARGUMENT;
+  c.argument = argument;
+  c.callback = callback;
+
+  return radif_command_batch(&c, 1, radif);
+}
+/**
+ * Queues a command.
+ */
+uint8_t radif_command(uint8_t command, command_callback_func callback, struct radif* radif) {
+  struct radif_command c;
+
+  c.command = command;
+  c.flags = 0;
+  c.argument = 0;
+  c.callback = callback;
 
-  return radif->CommandOutput;
+  return radif_command_batch(&c, 1, radif);
+}
+/**
+ * Records how long a frame waited between arriving and being handled.
+ */
+void radif_rx_latency(struct rx_frame* rx, struct radif* radif) {
+  uint32_t latency = radif->clock_us() - rx->rx_time;
+
+  radif->rx_latency_last = latency;
+  radif->rx_latency_average += ((int32_t)(latency - radif->rx_latency_average)) / 8;
+  if (latency > radif->rx_latency_max) {
+    radif->rx_latency_max = latency;
+  }
 }
 /**
  * Calls the receive callback on all pending frames
  */
 void radif_service(struct radif* radif) {
+  /* Keep the airtime accounting up to date, even when we're not sending */
+  radif->enter_critical();
+  radio_airtime_update(radif);
+  radif->exit_critical();
+
   /* While there's something to read from the rx buffer */
   while (radif->RxConsumeIndex != radif->RxProduceIndex) {
     if (radif->rx_callback != 0) { /* If we actually have a callback to use */
       uint16_t index = radif->RxConsumeIndex;
 
+      /* Update the statistics */
+      radif_rx_latency(&radif->RxFrames[index], radif);
+
       /* Make the callback */
       radif->rx_callback(&radif->RxFrames[index]);
 
@@ -58,43 +140,224 @@ void radif_service(struct radif* radif) {
   }
 }
 /**
- * Transmits a frame over the radio interface
+ * Returns the priority that a frame with these flags is sent at.
+ */
+uint8_t radif_tx_priority(uint8_t flags) {
+  if (flags & RADIF_TX_TIME_CRITICAL) {
+    return RADIF_PRIORITY_TIME;
+  } else if (flags & RADIF_TX_UPLOAD_ACK) {
+    return RADIF_PRIORITY_ACK;
+  }
+
+  return RADIF_PRIORITY_BULK;
+}
+/**
+ * Returns the number of frames waiting in a queue.
+ */
+uint8_t radif_tx_queued(struct tx_queue* queue) {
+  return (queue->ProduceIndex + TX_QUEUE_LENGTH - queue->ConsumeIndex) % TX_QUEUE_LENGTH;
+}
+/**
+ * Takes a free frame from radif->TxFrames for a frame at this priority.
+ * Bulk frames can only take NUM_TXFRAMES_BULK of them, so time sync
+ * replies and acks always have space. Returns NUM_TXFRAMES if there
+ * isn't one.
+ */
+uint8_t radif_tx_take(uint8_t priority, struct radif* radif) {
+  uint8_t index = NUM_TXFRAMES;
+  uint8_t i;
+
+  /* The radio interrupt frees frames as it sends them */
+  radif->enter_critical();
+
+  if (priority != RADIF_PRIORITY_BULK ||
+      radif_tx_queued(&radif->TxQueues[priority]) < NUM_TXFRAMES_BULK) {
+    for (i = 0; i < NUM_TXFRAMES; i++) {
+      if (!(radif->TxFramesUsed & (1 << i))) {
+	radif->TxFramesUsed |= (1 << i);
+	index = i;
+	break;
+      }
+    }
+  }
+
+  radif->exit_critical();
+
+  return index;
+}
+/**
+ * Returns a frame taken by radif_tx_take() that wasn't queued.
+ */
+void radif_tx_give_back(uint8_t index, struct radif* radif) {
+  radif->enter_critical();
+  radif->TxFramesUsed &= ~(1 << index);
+  radif->exit_critical();
+}
+/**
+ * Removes the oldest frame from the acknowledgement queue to make space.
+ * Returns zero if there wasn't one.
+ */
+uint8_t radif_drop_oldest_ack(struct radif* radif) {
+  struct tx_queue* queue = &radif->TxQueues[RADIF_PRIORITY_ACK];
+  struct tx_frame dropped;
+  uint8_t index;
+
+  /* Stop the radio interrupt from taking the frame while we drop it */
+  radif->enter_critical();
+
+  if (queue->ConsumeIndex == queue->ProduceIndex) {
+    radif->exit_critical();
+    return 0;
+  }
+
+  index = queue->Frames[queue->ConsumeIndex];
+  dropped = radif->TxFrames[index];
+  queue->ConsumeIndex = (queue->ConsumeIndex+1) % TX_QUEUE_LENGTH;
+  radif->TxFramesUsed &= ~(1 << index);
+
+  radif->exit_critical();
+
+  radif->tx_drop_ack++;
+
+  if (dropped.callback != 0) {
+    dropped.callback(dropped.destination_address, RADIO_BUSY_STATE, radif);
+  }
+
+  return 1;
+}
+/**
+ * Transmits a frame over the radio interface. The callback, if there is
+ * one, is called once the transmission is complete, or with
+ * RADIO_BUSY_STATE if the queued frame is later dropped to make space.
+ *
+ * Frames are queued by priority, see radif_tx_priority().
+ *
+ * Returns RADIO_SUCCESS if the frame was queued for transmission. If the
+ * queue is full what happens depends on radif->tx_full_policy.
+ *
+ * dest_mode is the addressing mode from ieee_frame.h, either
+ * FRAME_PAN_ID_16BIT_ADDR (dest_addr) or FRAME_PAN_ID_64BIT_ADDR (dest_ext).
  */
-void radif_send(uint8_t* frame, uint8_t len, uint16_t dest_addr, uint8_t ack, struct radif* radif) {
-  /* If the length is too big, halt! */
+uint8_t radif_send_to(uint8_t* frame, uint8_t len, uint8_t dest_mode,
+		      uint16_t dest_addr, uint64_t dest_ext, uint8_t flags,
+		      tx_callback_func callback, struct radif* radif) {
+  /* If the length is too big we can't send this */
   if (len > 127) {
-    while(1); // ERROR - Frame too long!
+    radif->tx_drop_invalid++;
+    return RADIO_INVALID_ARGUMENT;
   }
 
-  uint8_t index = radif->TxProduceIndex;
-  uint8_t next = (index+1) % NUM_TXFRAMES;
+  uint8_t priority = radif_tx_priority(flags);
+  struct tx_queue* queue = &radif->TxQueues[priority];
+  uint8_t index = radif_tx_take(priority, radif);
+
+  if (index == NUM_TXFRAMES) { /* If there isn't a frame free */
+    if (!radif->up) { /* We simply can't send */
+      radif->tx_drop_down++;
+      return RADIO_WRONG_STATE;
+    }
+
+    radif->interrupt_trigger(); /* Trigger some data getting sent */
+
+    switch (radif->tx_full_policy) {
+      case RADIF_TX_DROP_OLDEST_ACK:
+	if (priority == RADIF_PRIORITY_ACK && radif_drop_oldest_ack(radif)) {
+	  index = radif_tx_take(priority, radif);
+	}
+	if (index == NUM_TXFRAMES) {
+	  radif->tx_drop_full++;
+	  return RADIO_BUSY_STATE;
+	}
+	break;
 
-  if (next == radif->TxConsumeIndex) { /* If we're about to run into the consume index */
-    if (radif->up) { /* If the interface is up */
-      radif->interrupt_trigger(); /* Trigger some data getting sent */
-      while (next == radif->TxConsumeIndex); /* Wait for the condition to clear */
-    } else { return; } /* We simply can't send */
+      case RADIF_TX_BLOCK: {
+	uint32_t start = radif->clock_us();
+
+	/* Wait for the condition to clear */
+	while ((index = radif_tx_take(priority, radif)) == NUM_TXFRAMES) {
+	  if (radif->clock_us() - start > radif->tx_block_timeout) {
+	    radif->tx_drop_timeout++;
+	    return RADIO_TIMED_OUT;
+	  }
+	}
+	break;
+      }
+      default: /* RADIF_TX_DROP_NEWEST */
+	radif->tx_drop_full++;
+	return RADIO_BUSY_STATE;
+    }
   }
 
   struct tx_frame* tx = &radif->TxFrames[index];
 
   /* Setup the frame in the buffer */
   memcpy(tx->data, frame, len);
+  tx->dest_addr_mode = dest_mode;
   tx->destination_address = dest_addr;
+  tx->dest_ext_address = dest_ext;
   tx->length = len;
-  tx->ack = ack;
+  tx->ack = (flags & RADIF_TX_ACK_REQUEST) ? 1 : 0;
+  tx->flags = flags;
+  tx->callback = callback;
+  tx->queued_at = radif->clock_us();
+  tx->deferred = 0;
 
-  /* Increment the produce index */
-  radif->TxProduceIndex = next;
+  /* Check it'll fit with the header and FCS */
+  if (len + ieee_header_len(tx, radif) + 2 > 127) {
+    radif_tx_give_back(index, radif);
+    radif->tx_drop_invalid++;
+    return RADIO_INVALID_ARGUMENT;
+  }
+
+  /* Queue it, and increment the produce index */
+  queue->Frames[queue->ProduceIndex] = index;
+  queue->ProduceIndex = (queue->ProduceIndex+1) % TX_QUEUE_LENGTH;
 
   /* Trigger the interrupt to get the frame sent if possible */
   radif->interrupt_trigger();
+
+  return RADIO_SUCCESS;
+}
+
+/**
+ * Transmits a frame to a short address. See radif_send_to().
+ */
+uint8_t radif_send(uint8_t* frame, uint8_t len, uint16_t dest_addr, uint8_t flags,
+		   tx_callback_func callback, struct radif* radif) {
+  return radif_send_to(frame, len, FRAME_PAN_ID_16BIT_ADDR, dest_addr, 0,
+		       flags, callback, radif);
+}
+/**
+ * Transmits a frame to an extended (EUI-64) address. See radif_send_to().
+ */
+uint8_t radif_send_ext(uint8_t* frame, uint8_t len, uint64_t dest_ext, uint8_t flags,
+		       tx_callback_func callback, struct radif* radif) {
+  return radif_send_to(frame, len, FRAME_PAN_ID_64BIT_ADDR, RADIF_NO_SHORT_ADDRESS, dest_ext,
+		       flags, callback, radif);
 }
+/**
+ * Transmits a frame back to where a received frame came from, using
+ * whichever address it came from. See radif_send_to().
+ */
+uint8_t radif_reply(struct rx_frame* rx, uint8_t* frame, uint8_t len, uint8_t flags,
+		    tx_callback_func callback) {
+  if (rx->source_addr_mode == FRAME_PAN_ID_64BIT_ADDR) {
+    return radif_send_ext(frame, len, rx->source_ext_address, flags, callback, rx->radif);
+  }
 
+  return radif_send(frame, len, rx->source_address, flags, callback, rx->radif);
+}
 /**
  * Initialises the radio interface
  */
 void radif_init_struct(struct radif* radif) {
   /* Clear everything in the struct to zero */
   memset((void*)radif, 0, sizeof(struct radif));
+
+  /* The CSMA settings the radio starts with */
+  radif->frame_retries = RADIO_MAX_FRAME_RETRIES;
+  radif->csma_retries = RADIO_MAX_CSMA_RETRIES;
+  radif->min_be = CHB_MIN_BE;
+  radif->max_be = CHB_MAX_BE;
+  radif->cca_threshold = CHB_CCA_ED_THRES;
 }
@@ -0,0 +1,229 @@
+/* 
+ * Airtime and duty cycle accounting
+ * Copyright (C) 2013  Richard Meadows
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "radio.h"
+#include "radio_functions.h"
+#include "radio_airtime.h"
+#include "ieee_frame.h"
+
+/**
+ * The sub-bands with a duty cycle limit, in 100s of kHz. The limit is in
+ * 1/1000ths of the time.
+ */
+struct radio_airtime_band {
+  uint16_t low, high;
+  uint16_t limit;
+};
+const struct radio_airtime_band radio_airtime_bands[] = {
+  { 8630, 8680, 1 },	/* 863.0 - 868.0 MHz: 0.1% */
+  { 8680, 8686, 10 },	/* 868.0 - 868.6 MHz: 1% */
+  { 8687, 8692, 1 },	/* 868.7 - 869.2 MHz: 0.1% */
+  { 8694, 8697, 100 },	/* 869.4 - 869.65 MHz: 10% */
+  { 8697, 8700, 10 },	/* 869.7 - 870.0 MHz: 1% */
+};
+#define RADIO_AIRTIME_BANDS	(sizeof(radio_airtime_bands)/sizeof(radio_airtime_bands[0]))
+
+/* The SHR (preamble and SFD) and PHR, in octets. The same for O-QPSK and BPSK */
+#define RADIO_AIRTIME_SHR_PHR	6
+
+/**
+ * Returns the duty cycle limit for a channel in 1/1000ths, or
+ * RADIO_AIRTIME_NO_LIMIT. A channel on the edge of two sub-bands gets the
+ * stricter limit.
+ */
+uint16_t radio_airtime_limit(uint16_t freq) {
+  uint16_t limit = RADIO_AIRTIME_NO_LIMIT;
+  uint8_t i;
+
+  if (freq < 1000) { /* Given in MHz */
+    freq *= 10;
+  }
+
+  for (i = 0; i < RADIO_AIRTIME_BANDS; i++) {
+    const struct radio_airtime_band* band = &radio_airtime_bands[i];
+
+    if (band->low <= freq && freq <= band->high && band->limit < limit) {
+      limit = band->limit;
+    }
+  }
+
+  return limit;
+}
+/**
+ * Returns the lowest rate for the modulation bits of TRX_CTRL_2 in
+ * kbit/s. The SHR and PHR always go at this rate.
+ */
+uint32_t radio_airtime_base_rate(uint8_t modulation) {
+  if (modulation & RADIF_OQPSK) {
+    return (modulation & 0x04) ? 250 : 100;
+  }
+
+  return (modulation & 0x04) ? 40 : 20;
+}
+/**
+ * Returns the µs it takes to send one attempt at a frame, given the
+ * modulation bits of TRX_CTRL_2.
+ */
+uint32_t radio_airtime_estimate(struct tx_frame* tx, uint8_t modulation, struct radif* radif) {
+  /* The PSDU is the MAC header, the data and the FCS */
+  uint32_t psdu = ieee_header_len(tx, radif) + tx->length + 2;
+  uint32_t base, rate; /* kbit/s */
+
+  base = rate = radio_airtime_base_rate(modulation);
+  if (modulation & RADIF_OQPSK) {
+    rate = base << (modulation & 0x3);
+  }
+
+  /* 1000/rate is the µs per bit */
+  return (RADIO_AIRTIME_SHR_PHR * 8 * 1000) / base + (psdu * 8 * 1000) / rate;
+}
+/**
+ * Returns the most µs of airtime the token bucket holds at a limit.
+ */
+uint32_t radio_airtime_capacity(uint16_t limit) {
+  return (uint32_t)limit * (RADIO_AIRTIME_BURST_S * 1000);
+}
+/**
+ * Returns the µs of airtime we're allowed in the window at a limit.
+ */
+uint32_t radio_airtime_allowance(uint16_t limit) {
+  return (uint32_t)limit * (NUM_AIRTIME_BUCKETS * (RADIO_AIRTIME_BUCKET_US / 1000));
+}
+
+/**
+ * Fills the token bucket and moves the window along for the time that's
+ * passed. This needs calling more often than clock_us wraps.
+ */
+void radio_airtime_update(struct radif* radif) {
+  struct radif_airtime* air = &radif->airtime;
+  uint16_t limit = radio_airtime_limit(radif->freq);
+  uint32_t capacity = radio_airtime_capacity(limit);
+  uint32_t now = radif->clock_us();
+  uint32_t elapsed = now - air->last_update;
+  uint64_t refill, tokens;
+
+  air->last_update = now;
+
+  if (!air->running) { /* Start with a full bucket */
+    air->running = 1;
+    air->tokens = capacity;
+    return;
+  }
+
+  /* Fill the token bucket at the duty cycle rate */
+  refill = (uint64_t)elapsed * limit + air->tokens_remainder;
+  air->tokens_remainder = refill % 1000;
+  tokens = air->tokens + (refill / 1000);
+  air->tokens = (tokens < capacity) ? tokens : capacity;
+
+  /* Drop minutes off the end of the window */
+  air->bucket_time += elapsed;
+  while (air->bucket_time >= RADIO_AIRTIME_BUCKET_US) {
+    air->bucket_time -= RADIO_AIRTIME_BUCKET_US;
+    air->bucket = (air->bucket + 1) % NUM_AIRTIME_BUCKETS;
+    air->window -= air->used[air->bucket];
+    air->used[air->bucket] = 0;
+  }
+}
+/**
+ * Returns non-zero if tx, at the head of the given priority, can be sent
+ * now. Otherwise the timer is set for when it might be and we return 0.
+ */
+uint8_t radio_airtime_allow(uint8_t priority, struct tx_frame* tx, struct radif* radif) {
+  struct radif_airtime* air = &radif->airtime;
+  uint16_t limit = radio_airtime_limit(radif->freq);
+  uint32_t estimate, worst, need, allowance, wait;
+
+  if (limit >= RADIO_AIRTIME_NO_LIMIT) {
+    return 1;
+  }
+
+  radio_airtime_update(radif);
+
+  /* The configured rate is the slowest any link uses */
+  estimate = radio_airtime_estimate(tx, radif->modulation, radif);
+  worst = tx->ack ? estimate * (radif->frame_retries + 1) : estimate;
+
+  /* Bulk frames leave a reserve for acknowledgements and time replies */
+  need = estimate;
+  allowance = radio_airtime_allowance(limit);
+  if (priority == RADIF_PRIORITY_BULK) {
+    need += radio_airtime_capacity(limit) / 4;
+    allowance -= allowance / 4;
+  }
+
+  if (air->tokens >= need && air->window + worst <= allowance) {
+    return 1;
+  }
+
+  if (air->tokens < need) { /* Come back when the bucket has refilled */
+    wait = (uint32_t)(((uint64_t)(need - air->tokens) * 1000) / limit) + 1;
+  } else { /* Come back when the oldest minute drops out of the window */
+    wait = RADIO_AIRTIME_BUCKET_US - air->bucket_time;
+  }
+
+  if (!tx->deferred) { /* Only count each frame once, however often we look */
+    tx->deferred = 1;
+    radif->tx_deferred++;
+  }
+  radif->timer_start(wait);
+
+  return 0;
+}
+/**
+ * Called once tx has been written to the radio, with the rate and power
+ * it'll go at already set.
+ */
+void radio_airtime_tx_start(struct tx_frame* tx, struct radif* radif) {
+  /* TRX_CTRL_2 is shadowed, so this doesn't touch the SPI */
+  uint8_t modulation = radio_reg_read(TRX_CTRL_2, radif) & 0x3F;
+
+  radif->airtime.tx_estimate = radio_airtime_estimate(tx, modulation, radif);
+  radif->airtime.tx_header_us =
+    (RADIO_AIRTIME_SHR_PHR * 8 * 1000) / radio_airtime_base_rate(modulation);
+}
+/**
+ * Charges the airtime for the frame that's just finished.
+ */
+void radio_airtime_tx_done(uint8_t status, struct radif* radif) {
+  struct radif_airtime* air = &radif->airtime;
+  uint32_t airtime;
+
+  if (status == RADIO_CHANNEL_ACCESS_FAILURE) { /* It never went out */
+    airtime = 0;
+  } else if (status == RADIO_NO_ACK) { /* Every attempt went out */
+    airtime = air->tx_estimate * (radif->frame_retries + 1);
+  } else {
+    airtime = air->tx_estimate;
+  }
+  air->tx_estimate = 0;
+
+  radio_airtime_update(radif);
+
+  air->tokens = (air->tokens > airtime) ? air->tokens - airtime : 0;
+  air->used[air->bucket] += airtime;
+  air->window += airtime;
+
+  radif->tx_airtime += airtime;
+}
@@ -22,6 +22,7 @@
  * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
  */
 
+#include <string.h>
 #include "radio.h"
 #include "radio_functions.h"
 
@@ -32,9 +33,42 @@
  * be called from more than one interrupt level
  */
 
+/* -------- Shadow Registers -------- */
+
+/**
+ * These configuration registers only ever change when we write to them,
+ * so we keep a copy in radif->shadow and don't read them over SPI again.
+ */
+static const uint64_t radio_shadowed_regs =
+  (1ULL << TRX_CTRL_0) | (1ULL << TRX_CTRL_1) | (1ULL << TRX_CTRL_2) |
+  (1ULL << PHY_TX_PWR) | (1ULL << IRQ_MASK) | (1ULL << RF_CTRL_0) |
+  (1ULL << CC_CTRL_0) | (1ULL << CC_CTRL_1) | (1ULL << CCA_THRES) |
+  (1ULL << XAH_CTRL_0) | (1ULL << XAH_CTRL_1) |
+  (1ULL << CSMA_SEED_0) | (1ULL << CSMA_SEED_1) | (1ULL << CSMA_BE) |
+  (1ULL << SHORT_ADDR_0) | (1ULL << SHORT_ADDR_1) |
+  (1ULL << PAN_ID_0) | (1ULL << PAN_ID_1) |
+  (0xFFULL << IEEE_ADDR_0); /* All eight of them */
+
+uint8_t radio_reg_is_shadowed(uint8_t addr) {
+  return (addr < RADIO_SHADOW_SIZE && ((radio_shadowed_regs >> addr) & 1)) ? 1 : 0;
+}
+/**
+ * Forgets all the shadowed values, for when the radio is reset.
+ */
+void radio_shadow_invalidate(struct radif* radif) {
+  radif->shadow_valid = 0;
+  radif->state_known = 0;
+}
+
 /* -------- Register Read, Write & Read-Modify-Write -------- */
 
 uint8_t radio_reg_read(uint8_t addr, struct radif* radif) {
+  uint8_t shadowed = radio_reg_is_shadowed(addr);
+
+  if (shadowed && (radif->shadow_valid & (1ULL << addr))) { /* We already know */
+    return radif->shadow[addr];
+  }
+
   radif->spi_start();
 
   /* Send Register address and read register content.*/
@@ -43,6 +77,11 @@ uint8_t radio_reg_read(uint8_t addr, struct radif* radif) {
 
   radif->spi_stop();
 
+  if (shadowed) {
+    radif->shadow[addr] = val;
+    radif->shadow_valid |= (1ULL << addr);
+  }
+
   return val;
 }
 uint16_t radio_reg_read16(uint8_t addr, struct radif* radif) {
@@ -60,6 +99,12 @@ void radio_reg_write(uint8_t addr, uint8_t val, struct radif* radif) {
   radif->spi_xfer(val);
 
   radif->spi_stop();
+
+  /* Write through to the shadow copy */
+  if (radio_reg_is_shadowed(addr)) {
+    radif->shadow[addr] = val;
+    radif->shadow_valid |= (1ULL << addr);
+  }
 }
 void radio_reg_write16(uint8_t addr, uint16_t val, struct radif* radif) {
 
@@ -85,7 +130,32 @@ void radio_reg_read_mod_write(uint8_t addr, uint8_t val, uint8_t mask, struct ra
 
 /* -------- Frame Read & Write -------- */
 
+/* -------- Frame Tap -------- */
+
+/* A copy of the PSDU being read, for the MIC check and radif->sniff */
+uint8_t radio_tap_psdu[0x7F];
+uint8_t radio_tap_len;
+spi_xfer_func radio_tap_spi_xfer;
+
+/**
+ * Stands in for radif->spi_xfer while a frame is read, keeping a copy of
+ * each octet that comes back. All the radio interrupts share a priority,
+ * so there's only ever one frame being read.
+ */
+uint8_t radio_tap_xfer(uint8_t data) {
+  uint8_t octet = radio_tap_spi_xfer(data);
+
+  if (radio_tap_len < sizeof(radio_tap_psdu)) {
+    radio_tap_psdu[radio_tap_len++] = octet;
+  }
+
+  return octet;
+}
+
+/* Returns non-zero if the frame is valid. rx->to_us says if it's ours */
 uint8_t radio_frame_read(struct rx_frame* rx, struct radif* radif) {
+  uint8_t valid = 0xFF;
+
   radif->spi_start();
 
   /* Send frame read command */
@@ -93,22 +163,57 @@ uint8_t radio_frame_read(struct rx_frame* rx, struct radif* radif) {
 
   /* Read the of the whole frame */
   uint8_t mpdu_len = radif->spi_xfer(BLANK_SPI_CHARACTER);
+
+  /* Keep a copy of the header, and the rest too if we're sniffing */
+  radio_tap_spi_xfer = radif->spi_xfer;
+  radio_tap_len = 0;
+  radif->spi_xfer = radio_tap_xfer;
+
   /* Read in the header */
   uint8_t hdr_len = read_in_ieee_header(rx, radif);
-  /* Work out how long the actual data is */
-  rx->length = mpdu_len - (hdr_len + 2);
 
-  /* Read in the MAC Service Data Unit */
-  uint8_t i;
-  for (i=0; i<(rx->length); i++) {
-    rx->data[i] = radif->spi_xfer(BLANK_SPI_CHARACTER);
+  /* Secured frames need the header as it was sent */
+  rx->mhr_len = 0;
+  if (rx->security_level && hdr_len && hdr_len <= RADIO_MAX_MHR) {
+    memcpy(rx->mhr, radio_tap_psdu, hdr_len);
+    rx->mhr_len = hdr_len;
+  }
+  if (!radif->sniff) {
+    radif->spi_xfer = radio_tap_spi_xfer;
+  }
+
+  if (hdr_len == 0 || hdr_len + 2 > mpdu_len) { /* We can't use this frame */
+    rx->length = 0;
+    valid = 0;
+  } else {
+    /* Work out how long the actual data is */
+    rx->length = mpdu_len - (hdr_len + 2);
+
+    /* Read in the MAC Service Data Unit */
+    uint8_t i;
+    for (i=0; i<(rx->length); i++) {
+      rx->data[i] = radif->spi_xfer(BLANK_SPI_CHARACTER);
+    }
   }
 
-  /* We don't bother reading in the Frame Check Sequence */
+  /* We don't bother reading in the Frame Check Sequence, unless we're sniffing */
+  if (radif->sniff) {
+    while (radio_tap_len < mpdu_len && radio_tap_len < sizeof(radio_tap_psdu)) {
+      radif->spi_xfer(BLANK_SPI_CHARACTER);
+    }
+    if (radio_tap_len > mpdu_len) { /* The header ran past the end */
+      radio_tap_len = mpdu_len;
+    }
+    radif->spi_xfer = radio_tap_spi_xfer;
+  }
 
   radif->spi_stop();
 
-  return 0xFF; /* TODO Return 0 on invalid frame */
+  if (radif->sniff) {
+    radif->sniff(rx, radio_tap_psdu, radio_tap_len, radif);
+  }
+
+  return valid;
 }
 void radio_frame_read_dummy(struct radif* radif) {
   radif->spi_start();
@@ -132,7 +237,7 @@ void radio_frame_write(struct tx_frame* tx, struct radif* radif) {
   radif->spi_xfer(RADIO_SPI_CMD_FW);
 
   /* Write out the length (MAC Service Data Unit + Header + FCS) */
-  uint8_t len = tx->length + ieee_header_len(tx) + 2;
+  uint8_t len = tx->length + ieee_header_len(tx, radif) + 2;
   radif->spi_xfer(len);
 
   /* If the length is too big, halt! */
@@ -196,8 +301,51 @@ void radio_sram_write(uint8_t addr, uint8_t len, uint8_t* data, struct radif* ra
 
 /* -------- Radio State -------- */
 
+/**
+ * The radio only leaves some states when we tell it to, or with a TRX_END
+ * interrupt. While in one of these we don't need to read TRX_STATUS.
+ */
+uint8_t radio_state_is_stable(uint8_t state) {
+  return (state == TRX_OFF || state == PLL_ON || state == TX_ARET_ON ||
+	  state == BUSY_TX_ARET || state == SLEEP) ? 1 : 0;
+}
 uint8_t radio_get_state(struct radif* radif) {
-  return radio_reg_read(TRX_STATUS, radif) & 0x1f;
+  if (radif->state_known) {
+    return radif->state;
+  }
+
+  uint8_t state = radio_reg_read(TRX_STATUS, radif) & 0x1f;
+
+  radif->state = state;
+  radif->state_known = radio_state_is_stable(state);
+
+  return state;
+}
+/**
+ * Writes a command to TRX_STATE. The upper bits of TRX_STATE are read
+ * only, so there's no need to read-modify-write.
+ */
+void radio_state_command(uint8_t command, struct radif* radif) {
+  radio_reg_write(TRX_STATE, command, radif);
+
+  if (command == CMD_TX_START) { /* This happens straight away */
+    radif->state = BUSY_TX_ARET;
+    radif->state_known = 1;
+  } else { /* Find out when we next look */
+    radif->state_known = 0;
+  }
+}
+/**
+ * Updates our idea of the radio state from the interrupts that have
+ * just occurred.
+ */
+void radio_state_irq(uint8_t intp_src, struct radif* radif) {
+  if (intp_src & RADIO_IRQ_TRX_END && radif->state_known && radif->state == BUSY_TX_ARET) {
+    /* The transmission has finished. ARET always returns to TX_ARET_ON */
+    radif->state = TX_ARET_ON;
+  } else if (intp_src & (RADIO_IRQ_TRX_END | RADIO_IRQ_RX_START)) {
+    radif->state_known = 0;
+  }
 }
 uint8_t radio_is_state_busy(struct radif* radif) {
   uint8_t state = radio_get_state(radif);
@@ -214,8 +362,11 @@ uint8_t radio_get_trac(struct radif* radif) {
 
 /* -------- Set Radio Properties -------- */
 
-void radio_set_modulation(struct radif* radif) {
-  radio_set_state(TRX_OFF, radif); /* The radio must be in TRX_OFF to change the modulation */
+uint32_t radio_set_modulation(struct radif* radif) {
+  uint32_t wait;
+
+  /* The radio must be in TRX_OFF to change the modulation */
+  if ((wait = radio_set_state(TRX_OFF, radif))) { return wait; }
 
   radio_reg_read_mod_write(TRX_CTRL_2, radif->modulation, 0x3F, radif);
 
@@ -224,10 +375,15 @@ void radio_set_modulation(struct radif* radif) {
   } else {
     radio_reg_read_mod_write(RF_CTRL_0, CHB_BPSK_TX_OFFSET, 0x3, radif);
   }
+
+  return RADIO_STEP_DONE;
 }
-uint8_t radio_set_freq(struct radif* radif) {
-  uint16_t freq = radif->freq;
-  uint8_t band, number;
+/**
+ * Tunes the radio to freq, given in MHz or 100s of kHz. Returns the time
+ * to wait for the PLL to lock.
+ */
+uint32_t radio_write_freq(uint16_t freq, struct radif* radif) {
+  uint8_t band, number, state;
 
   /* Translate the frequency (given in MHz or 100s of kHz) into a band and number
    * See Table 7-35 in the AT86RF212 datasheet */
@@ -242,22 +398,29 @@ uint8_t radio_set_freq(struct radif* radif) {
   } else if (833 <= freq && freq <= 935) { /* 833 MHz - 935 MHz: General 2 */
     band = 5; number = freq-833;
   } else { /* Unknown frequency */
-    return RADIO_INVALID_ARGUMENT;
+    radif->command_output = RADIO_INVALID_ARGUMENT;
+    return RADIO_STEP_DONE;
   }
 
   /* Write these values to the control register */
   radio_reg_read_mod_write(CC_CTRL_1, band, 0x7, radif);
   radio_reg_write(CC_CTRL_0, number, radif);
 
-  /* Add a delay to allow the PLL to lock if in active mode. */
-  uint8_t state = radio_get_state(radif);
-  if ((state == RX_ON) || (state == PLL_ON)) {
-    radif->delay_us(TIME_PLL_LOCK_TIME);
+  /* Allow time for the PLL to lock if in active mode. */
+  state = radio_get_state(radif);
+  if ((state == RX_ON) || (state == PLL_ON) ||
+      (state == RX_AACK_ON) || (state == TX_ARET_ON)) {
+    return TIME_PLL_LOCK_TIME;
   }
 
-  /* TODO: Wait for the PLL to lock instead */
+  return RADIO_STEP_DONE;
+}
+uint32_t radio_set_freq(struct radif* radif) {
+  if (radif->command_step++ > 0) { /* We've been waiting for the PLL */
+    return RADIO_STEP_DONE;
+  }
 
-  return RADIO_SUCCESS;
+  return radio_write_freq(radif->freq, radif);
 }
 void radio_set_pwr(struct radif* radif) {
   radio_reg_write(PHY_TX_PWR, radif->power, radif);
@@ -268,19 +431,55 @@ void radio_set_address(struct radif* radif) {
 
   /* Set the Short Address */
   radio_reg_write16(SHORT_ADDR_0, radif->short_address, radif);
+
+  /* Set the Extended Address, if we have one */
+  if (radif->ext_address) {
+    uint64_t ext_address = radif->ext_address;
+    uint8_t i;
+
+    for (i = 0; i < 8; i++) { /* IEEE_ADDR_0 is the least significant */
+      radio_reg_write(IEEE_ADDR_0 + i, ext_address & 0xFF, radif);
+      ext_address >>= 8;
+    }
+  }
+}
+void radio_set_promiscuous(struct radif* radif) {
+  radio_reg_read_mod_write(XAH_CTRL_1, radif->promiscuous ? RADIO_PROMISCUOUS : 0,
+			   RADIO_PROMISCUOUS, radif);
+}
+/**
+ * Applies the retry, backoff and CCA settings from the radif structure.
+ */
+void radio_set_csma(struct radif* radif) {
+  radio_reg_write(XAH_CTRL_0, (radif->frame_retries << 4) | (radif->csma_retries << 1), radif);
+  radio_reg_write(CSMA_BE, (radif->max_be << 4) | radif->min_be, radif);
+  radio_reg_read_mod_write(CCA_THRES, radif->cca_threshold, 0x0F, radif);
 }
 
 /* -------- Set State  -------- */
 
-uint8_t radio_set_state(uint8_t state, struct radif* radif) {
+/**
+ * Starts a transition to `state`. This never waits for the radio, instead
+ * it returns how long the caller should wait before checking again:
+ *
+ * 0: We're already in `state`
+ * TIME_REG_ACCESS or less: The transition will be done by our next register access
+ * Otherwise: The time to wait in µs, possibly OR'd with RADIO_WAIT_EVENT
+ */
+uint32_t radio_set_state(uint8_t state, struct radif* radif) {
   uint8_t curr_state = radio_get_state(radif);
 
   /* If we're already in the correct state it's not a problem */
-  if (curr_state == state) { return RADIO_SUCCESS; }
+  if (curr_state == state) { return 0; }
 
-  /* If we're in a transition state, wait for the state to become stable */
-  if ((curr_state == BUSY_TX_ARET) || (curr_state == BUSY_RX_AACK) || (curr_state == BUSY_RX) || (curr_state == BUSY_TX)) {
-    while (radio_get_state(radif) == curr_state);
+  /* If we're busy, a TRX_END will tell us when the state becomes stable */
+  if ((curr_state == BUSY_TX_ARET) || (curr_state == BUSY_RX_AACK) ||
+      (curr_state == BUSY_RX) || (curr_state == BUSY_TX)) {
+    return RADIO_WAIT_EVENT | TIME_BUSY_POLL;
+  }
+  /* Another transition is already under way */
+  if (curr_state == TRANS_IN_PROG) {
+    return TIME_TRANS_POLL;
   }
 
   /* At this point it is clear that the requested new_state is one of */
@@ -290,68 +489,85 @@ uint8_t radio_set_state(uint8_t state, struct radif* radif) {
     case TRX_OFF:
       /* Go to TRX_OFF from any state. */
       radif->slptr_clear();
-      radio_reg_read_mod_write(TRX_STATE, CMD_FORCE_TRX_OFF, 0x1f, radif);
-      radif->delay_us(TIME_ALL_STATES_TRX_OFF);
-      break;
+      radio_state_command(CMD_FORCE_TRX_OFF, radif);
+      return TIME_ALL_STATES_TRX_OFF;
 
     case TX_ARET_ON:
-      if (curr_state == RX_AACK_ON) {
-	/* First do intermediate state transition to PLL_ON, then to TX_ARET_ON. */
-	radio_reg_read_mod_write(TRX_STATE, CMD_PLL_ON, 0x1f, radif);
-	radif->delay_us(TIME_RX_ON_TO_PLL_ON);
-      }
-      break;
-
     case RX_AACK_ON:
-      if (curr_state == TX_ARET_ON) {
-	/* First do intermediate state transition to RX_ON, then to RX_AACK_ON. */
-	radio_reg_read_mod_write(TRX_STATE, CMD_PLL_ON, 0x1f, radif);
-	radif->delay_us(TIME_RX_ON_TO_PLL_ON);
+      if (curr_state == RX_ON || curr_state == RX_AACK_ON || curr_state == TX_ARET_ON) {
+	/* First do intermediate state transition to PLL_ON, then to the new state. */
+	/* The 1µs this takes has passed by the time our next write is clocked out. */
+	radio_state_command(CMD_PLL_ON, radif);
       }
       break;
   }
 
   /* Now we're okay to transition to any new state. */
-  radio_reg_read_mod_write(TRX_STATE, state, 0x1f, radif);
+  radio_state_command(state, radif);
 
   /* When the PLL is active most states can be reached in 1us. However, from */
   /* TRX_OFF the PLL needs time to activate. */
-  uint32_t delay = (curr_state == TRX_OFF) ? TIME_TRX_OFF_TO_PLL_ON : TIME_RX_ON_TO_PLL_ON;
-  radif->delay_us(delay);
+  return (curr_state == TRX_OFF) ? TIME_TRX_OFF_TO_PLL_ON : TIME_RX_ON_TO_PLL_ON;
+}
+/**
+ * For use inside a step function that switches on command_step. Starts a
+ * transition to `state` and arranges for the current step to be repeated
+ * until we get there. Returns 0 once we're in `state`.
+ */
+uint32_t radio_step_to_state(uint8_t state, struct radif* radif) {
+  uint32_t wait = radio_set_state(state, radif);
 
-  if (radio_get_state(radif) == state) {
-    return RADIO_SUCCESS;
+  if (wait) { /* Come back to this step */
+    radif->command_step--;
   }
 
-  return RADIO_TIMED_OUT;
+  return wait;
 }
 
 /* -------- Wake & Sleep -------- */
 
-void radio_sleep(struct radif* radif) {
+uint32_t radio_sleep(struct radif* radif) {
+  uint32_t wait;
+
   /* First we need to go to TRX OFF state */
-  radio_set_state(TRX_OFF, radif);
+  if ((wait = radio_set_state(TRX_OFF, radif))) { return wait; }
 
   /* Set the SLPTR pin */
   radif->slptr_set();
+
+  radif->state = SLEEP;
+  radif->state_known = 1;
+
+  return RADIO_STEP_DONE;
 }
-void radio_wake(struct radif* radif) {
-  /* Clear the SLPTR pin */
-  radif->slptr_clear();
+uint32_t radio_wake(struct radif* radif) {
+  uint32_t wait;
 
-  /* We need to allow some time for the PLL to lock */
-  radif->delay_us(TIME_SLEEP_TO_TRX_OFF);
+  switch (radif->command_step++) {
+    case 0:
+      /* Clear the SLPTR pin */
+      radif->slptr_clear();
+      radif->state_known = 0;
+
+      /* We need to allow some time for the PLL to lock */
+      return TIME_SLEEP_TO_TRX_OFF;
+
+    case 1:
+      /* Turn the transceiver back on */
+      if ((wait = radio_step_to_state(RX_AACK_ON, radif))) { return wait; }
 
-  /* Turn the transceiver back on */
-  radio_set_state(RX_AACK_ON, radif);
+      /* Start the interface */
+      radif->up = 0xFF;
+      break;
+  }
+
+  return RADIO_STEP_DONE;
 }
 
 /* -------- Misc -------- */
 
+/* The radio must be in RX_ON to do this */
 uint8_t radio_get_random(struct radif* radif) {
-  /* Set the radio in the standard operating mode to do this */
-  radio_set_state(RX_ON, radif);
-
   uint8_t i, rand = 0;
   for (i = 0; i < 8; i+=2) {
     rand |= ((radio_reg_read(PHY_RSSI, radif) << 1) & 0xC0) >> i;
@@ -359,81 +575,169 @@ uint8_t radio_get_random(struct radif* radif) {
 
   return rand;
 }
-uint8_t radio_measure_energy(struct radif* radif) { /* TODO: Make this more efficient */
-  /* Set the radio in the standard operating mode to do this */
-  radio_set_state(RX_ON, radif);
+/**
+ * Starts an energy detect measurement. The radio must be in RX_ON.
+ */
+uint32_t radio_energy_start(struct radif* radif) {
+  /* Enable the CCA_ED_DONE interrupt */
+  radif->irq_status &= ~RADIO_IRQ_CCA_ED_DONE;
+  radio_reg_read_mod_write(IRQ_MASK, RADIO_IRQ_CCA_ED_DONE, RADIO_IRQ_CCA_ED_DONE, radif);
 
   /* Write to PHY_ED_LEVEL to trigger off the measurement */
   radio_reg_write(PHY_ED_LEVEL, BLANK_SPI_CHARACTER, radif);
 
-  /* Enable the CCA_ED_DONE interrupt */
-  radio_reg_read_mod_write(IRQ_MASK, RADIO_IRQ_CCA_ED_DONE, RADIO_IRQ_CCA_ED_DONE, radif);
-
-  /* Wait for interrupt CCA_ED_DONE */
-  while ((radio_reg_read(IRQ_STATUS, radif) & RADIO_IRQ_CCA_ED_DONE) == 0);
+  /* The CCA_ED_DONE interrupt will bring us back here */
+  return RADIO_WAIT_EVENT | TIME_ED_MEASUREMENT;
+}
+/**
+ * Puts the result of the measurement in energy_level. Returns a wait
+ * if the measurement isn't done yet, in which case the step is repeated.
+ */
+uint32_t radio_energy_result(struct radif* radif) {
+  if ((radif->irq_status & RADIO_IRQ_CCA_ED_DONE) == 0) { /* Not done yet */
+    radif->command_step--;
+    return RADIO_WAIT_EVENT | TIME_ED_MEASUREMENT;
+  }
+  radif->irq_status &= ~RADIO_IRQ_CCA_ED_DONE;
 
   /* Disable the CCA_ED_DONE interrupt */
   radio_reg_read_mod_write(IRQ_MASK, 0, RADIO_IRQ_CCA_ED_DONE, radif);
 
-  /* Return the result */
-  return radio_reg_read(PHY_ED_LEVEL, radif);
+  /* Save the result */
+  radif->energy_level = radio_reg_read(PHY_ED_LEVEL, radif);
+
+  return RADIO_STEP_DONE;
 }
+uint32_t radio_measure_energy(struct radif* radif) {
+  uint32_t wait;
 
-/* -------- Reset -------- */
+  switch (radif->command_step++) {
+    case 0:
+      /* Set the radio in the standard operating mode to do this */
+      if ((wait = radio_step_to_state(RX_ON, radif))) { return wait; }
 
-uint8_t radio_reset(struct radif* radif) {
-  /* This is the reset procedure as per Table A-5 (p166) of the AT86RF212 datasheet */
+      return radio_energy_start(radif);
 
-  /* Set input pins to their default operating values */
-  radif->reset_clear();
-  radif->slptr_clear();
-  radif->spi_stop();
+    case 1:
+      if ((wait = radio_energy_result(radif))) { return wait; }
+
+      /* Return the result */
+      radif->command_output = radif->energy_level;
+      break;
+  }
 
-  /* Wait while transceiver wakes up */
-  radif->delay_us(TIME_P_ON_WAIT);
+  return RADIO_STEP_DONE;
+}
+/**
+ * Measures the energy on scan_freq into energy_level and then returns to
+ * freq.
+ */
+uint32_t radio_energy_scan(struct radif* radif) {
+  uint32_t wait;
+
+  switch (radif->command_step++) {
+    case 0:
+      /* Set the radio in the standard operating mode to do this */
+      if ((wait = radio_step_to_state(RX_ON, radif))) { return wait; }
+
+      /* Tune to the channel we're scanning */
+      if ((wait = radio_write_freq(radif->scan_freq, radif))) { return wait; }
+      if (radif->command_output != RADIO_SUCCESS) { /* Invalid frequency */
+	return RADIO_STEP_DONE;
+      }
+      return RADIO_STEP_NEXT;
 
-  /* Reset the device */
-  radif->reset_set();
-  radif->delay_us(TIME_RST_PULSE_WIDTH);
-  radif->reset_clear();
+    case 1:
+      return radio_energy_start(radif);
 
-  uint8_t i = 0;
-  /* Check that we have the part number that we're expecting */
-  while ((radio_reg_read(VERSION_NUM, radif) != AT86RF212_VER_NUM) || (radio_reg_read(PART_NUM, radif) != AT86RF212_PART_NUM)) {
-    if (i++ > 100) { /* This is never going to work, we've got the wrong part number */
-      return RADIO_UNSUPPORTED_DEVICE;
-    }
+    case 2:
+      if ((wait = radio_energy_result(radif))) { return wait; }
+
+      /* Back to our own channel */
+      if ((wait = radio_write_freq(radif->freq, radif))) { return wait; }
+      break;
   }
 
-  /* Set the CLKM output to 1MHz, 4mA driver strength */
-  radio_reg_read_mod_write(TRX_CTRL_0, 0x19, 0x3F, radif);
+  return RADIO_STEP_DONE;
+}
 
-  /* Force transceiver into TRX_OFF state */
-  radio_reg_read_mod_write(TRX_STATE, CMD_FORCE_TRX_OFF, 0x1F, radif);
-  radif->delay_us(TIME_ALL_STATES_TRX_OFF);
+/* -------- Reset -------- */
 
-  i = 0;
-  /* Make sure the transceiver is in the off state before proceeding */
-  while ((radio_reg_read(TRX_STATUS, radif) & 0x1f) != TRX_OFF) {
-    if (i++ > 100) { /* Nope, it's never going to change state */
-      return RADIO_WRONG_STATE;
-    }
-  }
+uint32_t radio_reset(struct radif* radif) {
+  /* This is the reset procedure as per Table A-5 (p166) of the AT86RF212 datasheet */
+  switch (radif->command_step++) {
+    case 0:
+      /* Set input pins to their default operating values */
+      radif->reset_clear();
+      radif->slptr_clear();
+      radif->spi_stop();
+
+      radif->command_retries = 0;
+
+      /* Wait while transceiver wakes up */
+      return TIME_P_ON_WAIT;
+
+    case 1:
+      /* Reset the device */
+      radif->reset_set();
+      return TIME_RST_PULSE_WIDTH;
+
+    case 2:
+      radif->reset_clear();
+
+      /* Every register is back to its default value */
+      radio_shadow_invalidate(radif);
+      return TIME_RESET_TO_TRX_OFF;
+
+    case 3:
+      /* Check that we have the part number that we're expecting */
+      if ((radio_reg_read(VERSION_NUM, radif) != AT86RF212_VER_NUM) ||
+	  (radio_reg_read(PART_NUM, radif) != AT86RF212_PART_NUM)) {
+	if (radif->command_retries++ > 100) { /* This is never going to work, we've got the wrong part number */
+	  radif->command_output = RADIO_UNSUPPORTED_DEVICE;
+	  return RADIO_STEP_DONE;
+	}
+	radif->command_step--;
+	return TIME_TRX_IRQ_DELAY;
+      }
 
-  radio_reg_read(IRQ_STATUS, radif); /* Clear any outstanding interrupts */
-  radio_reg_write(IRQ_MASK, 0, radif); /* Disable interrupts */
+      /* Set the CLKM output to 1MHz, 4mA driver strength */
+      radio_reg_read_mod_write(TRX_CTRL_0, 0x19, 0x3F, radif);
 
-  return RADIO_SUCCESS;
+      /* Force transceiver into TRX_OFF state */
+      radio_state_command(CMD_FORCE_TRX_OFF, radif);
+
+      radif->command_retries = 0;
+      return TIME_ALL_STATES_TRX_OFF;
+
+    case 4:
+      /* Make sure the transceiver is in the off state before proceeding */
+      if (radio_get_state(radif) != TRX_OFF) {
+	if (radif->command_retries++ > 100) { /* Nope, it's never going to change state */
+	  radif->command_output = RADIO_WRONG_STATE;
+	  return RADIO_STEP_DONE;
+	}
+	radif->command_step--;
+	return TIME_TRX_IRQ_DELAY;
+      }
+
+      radio_reg_read(IRQ_STATUS, radif); /* Clear any outstanding interrupts */
+      radio_reg_write(IRQ_MASK, 0, radif); /* Disable interrupts */
+      radif->irq_status = 0;
+      radif->irq_late = 0;
+      break;
+  }
+
+  return RADIO_STEP_DONE;
 }
 /* Setup various configuration parameters from the radif structure */
 void radio_config(struct radif* radif) {
-  /* Set the number of retries if no ACK is received */
-  radio_reg_write(XAH_CTRL_0, (RADIO_MAX_FRAME_RETRIES << 4) | (RADIO_MAX_CSMA_RETRIES << 1), radif);
+  /* Set the retries, backoff exponents and CCA threshold */
+  radio_set_csma(radif);
 
   //chb_reg_read_mod_write(CSMA_SEED_1, CHB_CSMA_SEED1 << CHB_CSMA_SEED1_POS, 0x7 << CHB_CSMA_SEED1_POS);
   //chb_ret_write(CSMA_SEED0, CHB_CSMA_SEED0);
   //chb_reg_read_mod_write(PHY_CC_CCA, CHB_CCA_MODE << CHB_CCA_MODE_POS,0x3 << CHB_CCA_MODE_POS);
-  //chb_reg_write(CCA_THRES, CHB_CCA_ED_THRES);
 
   //radio_reg_write(RF_CTRL_1, 0xF0, radif);
 
@@ -447,11 +751,117 @@ void radio_config(struct radif* radif) {
   if (radif->auto_crc_gen) {
     radio_reg_read_mod_write(TRX_CTRL_1, RADIO_AUTO_CRC_GEN, RADIO_AUTO_CRC_GEN, radif);
   }
+  /* Put the frame start on DIG2 so it can be timestamped */
+  if (radif->rx_capture_us) {
+    radio_reg_read_mod_write(TRX_CTRL_1, RADIO_IRQ_2_EXT_EN, RADIO_IRQ_2_EXT_EN, radif);
+  }
   /* Enable promiscuous mode */
   if (radif->promiscuous) {
-    radio_reg_read_mod_write(XAH_CTRL_1, RADIO_PROMISCUOUS, RADIO_PROMISCUOUS, radif);
+    radio_set_promiscuous(radif);
+  }
+  /* Protect a received frame in the buffer until we've read it out. Any
+   * frame that arrives in the meantime is dropped rather than being
+   * allowed to overwrite it. See section 9.7 in the AT86RF212 datasheet */
+  radio_reg_read_mod_write(TRX_CTRL_2, RADIO_RX_SAFE_MODE, RADIO_RX_SAFE_MODE, radif);
+}
+uint32_t radio_startup(struct radif* radif) {
+  uint32_t wait;
+
+  switch (radif->command_step++) {
+    case 0:
+      /* Apply the configuration values from the radif struct to the radio */
+      radio_config(radif);
+      return RADIO_STEP_NEXT;
+
+    case 1:
+      /* Take a random sequence number to start with */
+      if ((wait = radio_step_to_state(RX_ON, radif))) { return wait; }
+      radif->seq = radio_get_random(radif);
+
+      /* Start the interface */
+      radif->up = 0xFF;
+      break;
+  }
+
+  return RADIO_STEP_DONE;
+}
+uint32_t radio_random_number(struct radif* radif) {
+  uint32_t wait;
+
+  /* Set the radio in the standard operating mode to do this */
+  if ((wait = radio_set_state(RX_ON, radif))) { return wait; }
+
+  radif->command_output = radio_get_random(radif);
+
+  return RADIO_STEP_DONE;
+}
+
+/* -------- AES -------- */
+
+/**
+ * Loads a 16 octet key into the AES engine. It stays there until the
+ * radio sleeps or is reset.
+ */
+void radio_aes_set_key(const uint8_t* key, struct radif* radif) {
+  uint8_t i;
+
+  radif->spi_start();
+
+  radif->spi_xfer(RADIO_SPI_CMD_SW);
+  radif->spi_xfer(RADIO_AES_CTRL);
+  radif->spi_xfer(RADIO_AES_MODE_KEY);
+  for (i = 0; i < 16; i++) {
+    radif->spi_xfer(key[i]);
   }
 
-  /* Take a random sequence number to start with */
-  radif->seq = radio_get_random(radif);
+  radif->spi_stop();
+}
+/**
+ * Encrypts one block with the key already loaded. This takes the SPI bus,
+ * so the caller has to hold off the radio interrupt. Returns
+ * RADIO_SUCCESS, or RADIO_TIMED_OUT if the engine never finished.
+ */
+uint8_t radio_aes_encrypt(const uint8_t* in, uint8_t* out, struct radif* radif) {
+  uint32_t start;
+  uint8_t i, status;
+
+  /* Write the block and start it going in one access */
+  radif->spi_start();
+
+  radif->spi_xfer(RADIO_SPI_CMD_SW);
+  radif->spi_xfer(RADIO_AES_CTRL);
+  radif->spi_xfer(RADIO_AES_MODE_ECB);
+  for (i = 0; i < 16; i++) {
+    radif->spi_xfer(in[i]);
+  }
+  radif->spi_xfer(RADIO_AES_REQUEST | RADIO_AES_MODE_ECB); /* AES_CTRL_MIRROR */
+
+  radif->spi_stop();
+
+  /* Wait for it to finish */
+  start = radif->clock_us();
+  do {
+    radif->spi_start();
+    radif->spi_xfer(RADIO_SPI_CMD_SR);
+    radif->spi_xfer(RADIO_AES_STATUS);
+    status = radif->spi_xfer(BLANK_SPI_CHARACTER);
+    radif->spi_stop();
+
+    if (status & RADIO_AES_ER || radif->clock_us() - start > 4*TIME_AES_ECB) {
+      return RADIO_TIMED_OUT;
+    }
+  } while (!(status & RADIO_AES_DONE));
+
+  /* Read out the result */
+  radif->spi_start();
+
+  radif->spi_xfer(RADIO_SPI_CMD_SR);
+  radif->spi_xfer(RADIO_AES_STATE);
+  for (i = 0; i < 16; i++) {
+    out[i] = radif->spi_xfer(BLANK_SPI_CHARACTER);
+  }
+
+  radif->spi_stop();
+
+  return RADIO_SUCCESS;
 }
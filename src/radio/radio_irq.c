@@ -26,80 +26,300 @@
 
 #include "radio.h"
 #include "radio_functions.h"
+#include "ieee_frame.h"
+#include "radio_link.h"
+#include "radio_airtime.h"
+
+/* -------- Waiting -------- */
+
+/**
+ * Arranges for the state machine to be run again after `wait`, as
+ * returned by a step function.
+ */
+void radio_wait(uint32_t wait, struct radif* radif) {
+  if (wait & RADIO_WAIT_EVENT) {
+    radif->waiting = RADIF_WAIT_EVENT;
+  } else {
+    radif->waiting = RADIF_WAIT_TIMER;
+  }
+
+  radif->timer_start(wait & ~RADIO_WAIT_EVENT);
+}
 
 /* -------- Command -------- */
 
-void radio_command(struct radif* radif) {
-  if (radif->Command != RADIF_NO_COMMAND) { /* If there's a command waiting */
-    switch (radif->Command) {
-      case RADIF_RESET:
-	radif->CommandOutput = radio_reset(radif);
-	break;
-      case RADIF_STARTUP: radio_config(radif); /* Apply the configuration values from the radif struct to the radio */
-	radif->up = 0xFF; /* Start the interface */
-	break;
-      case RADIF_GET_RANDOM_NUMBER: radif->CommandOutput = radio_get_random(radif);
-	break;
-      case RADIF_SET_MODULATION: radio_set_modulation(radif);
-	break;
-      case RADIF_SET_FREQ: radif->CommandOutput = radio_set_freq(radif);
-	break;
-      case RADIF_SET_POWER: radio_set_pwr(radif);
-	break;
-      case RADIF_SET_ADDRESS: radio_set_address(radif);
-	break;
-      case RADIF_ENERGY: radif->CommandOutput = radio_measure_energy(radif);
-	break;
-      case RADIF_WAKE: radio_wake(radif); radif->up = 0xFF;
-	break;
-      case RADIF_SLEEP: radio_sleep(radif); radif->up = 0;
-	break;
-      default: break; /* Invalid Command */
+uint32_t radio_command_step(uint8_t command, struct radif* radif) {
+  switch (command) {
+    case RADIF_RESET: return radio_reset(radif);
+    case RADIF_STARTUP: return radio_startup(radif);
+    case RADIF_GET_RANDOM_NUMBER: return radio_random_number(radif);
+    case RADIF_SET_MODULATION: return radio_set_modulation(radif);
+    case RADIF_SET_FREQ: return radio_set_freq(radif);
+    case RADIF_SET_POWER: radio_set_pwr(radif);
+      break;
+    case RADIF_SET_ADDRESS: radio_set_address(radif);
+      break;
+    case RADIF_SET_PROMISCUOUS: radio_set_promiscuous(radif);
+      break;
+    case RADIF_SET_CSMA: radio_set_csma(radif);
+      break;
+    case RADIF_ENERGY: return radio_measure_energy(radif);
+    case RADIF_ENERGY_SCAN: return radio_energy_scan(radif);
+    case RADIF_WAKE: return radio_wake(radif);
+    case RADIF_SLEEP: radif->up = 0; /* Stop the interface */
+      return radio_sleep(radif);
+    default: break; /* Invalid Command */
+  }
+
+  return RADIO_STEP_DONE;
+}
+/**
+ * Applies the argument of a command as it starts.
+ */
+void radio_command_argument(struct radif_command* command, struct radif* radif) {
+  switch (command->command) {
+    case RADIF_SET_MODULATION: radif->modulation = command->argument;
+      break;
+    case RADIF_SET_FREQ: radif->freq = command->argument;
+      break;
+    case RADIF_SET_POWER: radif->power = command->argument;
+      break;
+    case RADIF_SET_ADDRESS: radif->pan_id = command->argument >> 16;
+      radif->short_address = command->argument & 0xFFFF;
+      break;
+    case RADIF_SET_PROMISCUOUS: radif->promiscuous = command->argument;
+      break;
+    case RADIF_SET_CSMA: radif->frame_retries = command->argument & 0xF;
+      radif->csma_retries = (command->argument >> 4) & 0x7;
+      radif->min_be = (command->argument >> 8) & 0xF;
+      radif->max_be = (command->argument >> 12) & 0xF;
+      radif->cca_threshold = (command->argument >> 16) & 0xF;
+      break;
+    case RADIF_ENERGY_SCAN: radif->scan_freq = command->argument;
+      break;
+    default: break; /* Nothing to set */
+  }
+}
+/**
+ * Runs queued commands for as long as they don't need to wait. Returns
+ * non-zero if a command is still in progress.
+ */
+uint8_t radio_command(struct radif* radif) {
+  while (radif->CommandConsumeIndex != radif->CommandProduceIndex) { /* If there's a command waiting */
+    uint8_t index = radif->CommandConsumeIndex;
+    struct radif_command command = radif->Commands[index];
+    uint32_t wait;
+
+    if (radif->command_step == 0) { /* Starting a new command */
+      /* Only start between frames, unless we're part way through a batch */
+      if (!radif->command_batch && radif->up && radio_is_state_busy(radif)) {
+	radio_wait(RADIO_WAIT_EVENT | TIME_BUSY_POLL, radif);
+	return 1;
+      }
+
+      radif->command_output = RADIO_SUCCESS;
+
+      if (command.flags & RADIF_COMMAND_ARGUMENT) {
+	radio_command_argument(&command, radif);
+      }
+    }
+
+    /* Run steps until one of them needs us to wait */
+    do {
+      wait = radio_command_step(command.command, radif);
+    } while (wait != RADIO_STEP_DONE && wait <= TIME_REG_ACCESS);
+
+    if (wait != RADIO_STEP_DONE) {
+      radio_wait(wait, radif);
+      return 1;
+    }
+
+    /* Increment our consume index */
+    radif->command_step = 0;
+    radif->command_batch = (command.flags & RADIF_COMMAND_CONTINUE) ? 1 : 0;
+    radif->CommandConsumeIndex = (index+1) % NUM_COMMANDS;
+
+    if (command.callback != 0) {
+      command.callback(command.command, radif->command_output, radif);
     }
   }
 
-  radif->Command = RADIF_NO_COMMAND; /* Increment our consume index */
+  return 0;
 }
 
 /* -------- Tx -------- */
 
+/**
+ * Returns the highest priority queue with a frame waiting, or NULL.
+ */
+struct tx_queue* radio_tx_next_queue(struct radif* radif) {
+  uint8_t priority;
+
+  for (priority = 0; priority < NUM_TX_PRIORITIES; priority++) {
+    struct tx_queue* queue = &radif->TxQueues[priority];
+
+    if (queue->ConsumeIndex != queue->ProduceIndex) {
+      return queue;
+    }
+  }
+
+  return NULL;
+}
+/**
+ * Returns non-zero if later replaces earlier. See RADIF_TX_SUPERSEDES.
+ */
+uint8_t radio_tx_supersedes(struct tx_frame* later, struct tx_frame* earlier) {
+  if (!(later->flags & RADIF_TX_SUPERSEDES) || later->data[0] != earlier->data[0] ||
+      later->dest_addr_mode != earlier->dest_addr_mode) {
+    return 0;
+  }
+  if (later->dest_addr_mode == FRAME_PAN_ID_64BIT_ADDR) {
+    return later->dest_ext_address == earlier->dest_ext_address;
+  }
+  return later->destination_address == earlier->destination_address;
+}
+/**
+ * Takes the frame at the head of a queue off it, and frees it.
+ */
+void radio_tx_consume(struct tx_queue* queue, struct radif* radif) {
+  radif->TxFramesUsed &= ~(1 << queue->Frames[queue->ConsumeIndex]);
+  queue->ConsumeIndex = (queue->ConsumeIndex+1) % TX_QUEUE_LENGTH;
+}
+/**
+ * Drops frames from the head of a queue for as long as there's a later
+ * frame in the queue that supersedes them. This saves the airtime when
+ * frames back up.
+ */
+void radio_tx_coalesce(struct tx_queue* queue, struct radif* radif) {
+  while (queue->ConsumeIndex != queue->ProduceIndex) {
+    uint8_t index = queue->ConsumeIndex;
+    struct tx_frame* tx = &radif->TxFrames[queue->Frames[index]];
+    tx_callback_func callback = tx->callback;
+    uint16_t destination_address = tx->destination_address;
+    uint8_t i;
+
+    if (!(tx->flags & RADIF_TX_SUPERSEDES)) {
+      return;
+    }
+
+    /* Look for a later one */
+    for (i = (index+1) % TX_QUEUE_LENGTH; i != queue->ProduceIndex;
+	 i = (i+1) % TX_QUEUE_LENGTH) {
+      if (radio_tx_supersedes(&radif->TxFrames[queue->Frames[i]], tx)) {
+	break;
+      }
+    }
+    if (i == queue->ProduceIndex) { /* There isn't one */
+      return;
+    }
+
+    radio_tx_consume(queue, radif);
+    radif->tx_coalesced++;
+
+    if (callback != 0) {
+      callback(destination_address, RADIO_BUSY_STATE, radif);
+    }
+  }
+}
+/**
+ * Records how long a frame spent in its queue.
+ */
+void radio_tx_queue_delay(struct tx_queue* queue, struct tx_frame* tx, struct radif* radif) {
+  uint32_t delay = radif->clock_us() - tx->queued_at;
+
+  queue->delay_last = delay;
+  queue->delay_average += ((int32_t)(delay - queue->delay_average)) / 8;
+  if (delay > queue->delay_max) {
+    queue->delay_max = delay;
+  }
+}
 void radio_tx(struct radif* radif) {
-  uint16_t index = radif->TxConsumeIndex;
+  struct tx_queue* queue;
+  uint8_t priority;
+
+  /* Don't send anything that's already out of date */
+  for (priority = 0; priority < NUM_TX_PRIORITIES; priority++) {
+    radio_tx_coalesce(&radif->TxQueues[priority], radif);
+  }
 
-  if (index != radif->TxProduceIndex) { /* If there's data to be output */
-    if (!radio_is_state_busy(radif)) { /* If we're not currently busy */
-      struct tx_frame* tx = &radif->TxFrames[index];
+  queue = radio_tx_next_queue(radif);
 
-      /* Stop receiving */
-      radio_set_state(TRX_OFF, radif);
-      /* Get ready to transmit */
-      radio_set_state(TX_ARET_ON, radif);
+  if (queue != NULL) { /* If there's data to be output */
+    struct tx_frame* tx = &radif->TxFrames[queue->Frames[queue->ConsumeIndex]];
 
-      /* Write the frame into a buffer */
-      radio_frame_write(tx, radif);
+    /* Keep within our share of the airtime. The timer brings us back */
+    if (!radio_airtime_allow(queue - radif->TxQueues, tx, radif)) {
+      return;
+    }
 
-      /* Actually start the transmission */
-      radio_reg_read_mod_write(TRX_STATE, CMD_TX_START, 0x1F, radif);
+    /* Get ready to transmit. This is quick unless the PLL is off */
+    uint32_t wait = radio_set_state(TX_ARET_ON, radif);
 
-      /* Increment our consume index - We're all done with this frame */
-      radif->TxConsumeIndex = (index+1) % NUM_TXFRAMES;
+    if (wait > TIME_REG_ACCESS) { /* Busy, or we're going to have to wait */
+      radio_wait(wait, radif);
+      return;
     }
+
+    /* Use the best rate and power for this destination */
+    radio_link_apply(tx->destination_address, radif);
+
+    /* Write the frame into a buffer */
+    radio_frame_write(tx, radif);
+
+    /* And work out how long it'll be on the air */
+    radio_airtime_tx_start(tx, radif);
+
+    /* Actually start the transmission */
+    radio_state_command(CMD_TX_START, radif);
+
+    /* Update the statistics */
+    radio_tx_queue_delay(queue, tx, radif);
+
+    /* Keep hold of the completion callback for radio_tx_end() */
+    radif->tx_callback = tx->callback;
+    radif->tx_destination_address = tx->destination_address;
+
+    /* Increment our consume index - We're all done with this frame */
+    radio_tx_consume(queue, radif);
   }
 }
 void radio_tx_end(struct radif* radif) {
   /* See how the transmission went */
   uint8_t trac_status = radio_get_trac(radif);
+  uint8_t status;
+
+  /* TRX_END came at the end of the frame, so step back over the PSDU */
+  radif->tx_time = radif->irq_time -
+    (radif->airtime.tx_estimate - radif->airtime.tx_header_us);
+  radif->tx_time_known = !radif->irq_time_late;
 
   radif->last_trac_status = trac_status;
 
   if (trac_status == TRAC_SUCCESS || trac_status == TRAC_SUCCESS_DATA_PENDING) { /* We've successfully consumed a frame */
     radif->tx_success_count++; /* Update the statistics */
+    status = RADIO_SUCCESS;
   } else if (trac_status == TRAC_CHANNEL_ACCESS_FAIL) {
     radif->tx_channel_fail++;
+    status = RADIO_CHANNEL_ACCESS_FAILURE;
   } else if (trac_status == TRAC_NO_ACK) {
     radif->tx_noack++;
+    status = RADIO_NO_ACK;
   } else {
     radif->tx_invalid++; /* This should never happen. Was radio_tx_end() called too early? */
+    status = RADIO_STATE_TRANSITION_FAILED;
+  }
+
+  /* Adapt the rate and power for next time */
+  radio_link_tx_done(status, radif);
+  /* And charge the airtime it used */
+  radio_airtime_tx_done(status, radif);
+
+  /* Let the sender know how it went */
+  if (radif->tx_callback != 0) {
+    tx_callback_func callback = radif->tx_callback;
+    radif->tx_callback = 0;
+
+    callback(radif->tx_destination_address, status, radif);
   }
 }
 
@@ -113,6 +333,13 @@ void radio_rx_end(struct radif* radif) {
   if (next != radif->RxConsumeIndex) { /* This isn't going to collide with the consume index */
     struct rx_frame* rx = &radif->RxFrames[index];
 
+    /* Find out when it started arriving, as close as we can */
+    if (radif->rx_capture_us) {
+      rx->rx_time = radif->rx_capture_us();
+    } else {
+      rx->rx_time = radif->clock_us();
+    }
+
     /* Get the ED measurement */
     rx->energy_detect = radio_reg_read(PHY_ED_LEVEL, radif);
 
@@ -120,12 +347,21 @@ void radio_rx_end(struct radif* radif) {
     rx->crc_status = (radio_reg_read(PHY_RSSI, radif) & (1<<7)) ? 1 : 0;
 
     /* Read in the frame */
-    radio_frame_read(rx, radif);
+    if (!radio_frame_read(rx, radif)) { /* A header we can't decode */
+      radif->rx_invalid++;
+    } else if (!rx->to_us) { /* Only the sniffer wants this one */
+      radif->rx_other++;
+    } else {
+      rx->radif = radif;
 
-    /* Move along the produce index */
-    radif->RxProduceIndex = next;
-    /* Increment the statistics */
-    radif->rx_success_count++;
+      /* Keep track of how strong this node is */
+      radio_link_rx(rx, radif);
+
+      /* Move along the produce index */
+      radif->RxProduceIndex = next;
+      /* Increment the statistics */
+      radif->rx_success_count++;
+    }
   } else { /* No space in our internal buffers */
     /* Increment the overflow statistics */
     radif->rx_overflow++;
@@ -133,7 +369,17 @@ void radio_rx_end(struct radif* radif) {
     radio_frame_read_dummy(radif);
   }
 
-  while (radio_get_state(radif) == BUSY_RX_AACK);
+  /* Reading the frame has released the buffer. A frame that started
+   * while it was protected has been dropped and won't get a TRX_END */
+  uint8_t late = radio_reg_read(IRQ_STATUS, radif);
+  if ((late & (RADIO_IRQ_RX_START | RADIO_IRQ_TRX_END)) == RADIO_IRQ_RX_START) {
+    radif->rx_protected++;
+    late &= ~RADIO_IRQ_RX_START;
+  }
+  radif->irq_late |= late;
+
+  /* Any acknowledgement is still going out, but we don't wait for it
+   * here. radio_set_state() will hold off until we're out of BUSY_RX_AACK */
 }
 
 void radio_trx_end(struct radif* radif) {
@@ -147,11 +393,59 @@ void radio_trx_end(struct radif* radif) {
   }
 }
 
+/* -------- State Machine -------- */
+
+/**
+ * Moves the radio on as far as it can go without waiting. Commands run
+ * first, then any outstanding frame transmissions, then we go back to
+ * receiving.
+ */
+void radio_run(struct radif* radif) {
+  uint32_t wait;
+
+  if (radif->waiting != RADIF_WAIT_NONE) { /* We'll be called again */
+    return;
+  }
+
+  /* Do any outstanding commands */
+  if (radio_command(radif)) {
+    return;
+  }
+
+  if (radif->up) {
+    /* Do any outstanding frame transmissions */
+    radio_tx(radif);
+
+    if (radif->waiting == RADIF_WAIT_NONE && !radio_is_state_busy(radif)) { /* If we're not currently busy */
+      /* Put ourselves into receiving mode */
+      radio_link_restore(radif);
+      wait = radio_set_state(RX_AACK_ON, radif);
+
+      if (wait > TIME_REG_ACCESS) {
+	radio_wait(wait, radif);
+      }
+    }
+  }
+}
+
 void radio_irq(struct radif* radif) {
   if (radif->up) {
+    /* Note the time before the SPI, for radio_tx_end */
+    radif->irq_time = radif->clock_us();
+
     /* Get the flags for the currently active interrupts */
     uint8_t intp_src = radio_reg_read(IRQ_STATUS, radif);
 
+    /* Along with any we cleared while reading a frame. We don't know
+     * when those happened */
+    radif->irq_time_late =
+      (radif->irq_late & RADIO_IRQ_TRX_END) && !(intp_src & RADIO_IRQ_TRX_END);
+    intp_src |= radif->irq_late;
+    radif->irq_late = 0;
+
+    /* Keep track of the state without having to read it */
+    radio_state_irq(intp_src, radif);
+
     /* Deal with each of the current interrupts in turn */
     if (intp_src & RADIO_IRQ_RX_START) {
       /* We could start to read in frames here, but then we'd have to stagger the SPI read */
@@ -169,15 +463,22 @@ void radio_irq(struct radif* radif) {
     if (intp_src & RADIO_IRQ_BAT_LOW) {
     }
 
-    /* Do any outstanding frame transmissions */
-    radio_tx(radif);
+    /* Keep hold of these for any step that's waiting on them */
+    radif->irq_status |= intp_src;
+
+    /* Anything waiting on an event can go again */
+    if (intp_src && radif->waiting == RADIF_WAIT_EVENT) {
+      radif->waiting = RADIF_WAIT_NONE;
+    }
   }
 
-  /* Do any outstanding commands */
-  radio_command(radif);
+  radio_run(radif);
+}
+/**
+ * Called when the time requested by radif->timer_start has passed.
+ */
+void radio_timer_irq(struct radif* radif) {
+  radif->waiting = RADIF_WAIT_NONE;
 
-  if (radif->up && !radio_is_state_busy(radif)) { /* If we're not currently busy */
-    /* Put ourselves into receiving mode */
-    while (radio_set_state(RX_AACK_ON, radif) != RADIO_SUCCESS);
-  }
+  radio_run(radif);
 }
@@ -0,0 +1,187 @@
+/* 
+ * Adapts the data rate and power to each destination
+ * Copyright (C) 2013  Richard Meadows
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "radio.h"
+#include "radio_functions.h"
+#include "radio_link.h"
+
+/**
+ * PHY_TX_PWR for each power step below full power. About +3dBm and 0dBm
+ * at 868MHz, see Table 7-15 in the AT86RF212 datasheet.
+ */
+const uint8_t radio_link_power[] = { 0xea, 0xac };
+#define RADIO_LINK_POWER_STEPS	(sizeof(radio_link_power)/sizeof(radio_link_power[0]))
+
+/**
+ * Returns the link for an address. If there isn't one and create is set,
+ * the least recently used link is taken over.
+ */
+struct radif_link* radio_link_find(uint16_t address, uint8_t create, struct radif* radif) {
+  struct radif_link* oldest = &radif->Links[0];
+  uint8_t i;
+
+  for (i = 0; i < NUM_LINKS; i++) {
+    struct radif_link* link = &radif->Links[i];
+
+    if (link->in_use && link->address == address) {
+      link->last_used = radif->link_clock++;
+      return link;
+    }
+    if (!link->in_use) {
+      oldest = link;
+    } else if (oldest->in_use &&
+	       (uint16_t)(radif->link_clock - link->last_used) >
+	       (uint16_t)(radif->link_clock - oldest->last_used)) {
+      oldest = link;
+    }
+  }
+
+  if (!create) {
+    return 0;
+  }
+
+  /* Start from the configured settings */
+  oldest->in_use = 1;
+  oldest->address = address;
+  oldest->rate = radif->modulation & 0x3;
+  oldest->power_step = 0;
+  oldest->ed_average = 0;
+  oldest->successes = 0;
+  oldest->failures = 0;
+  oldest->last_used = radif->link_clock++;
+
+  return oldest;
+}
+/**
+ * Returns non-zero if we can adapt the rate and power on this interface.
+ */
+uint8_t radio_link_enabled(struct radif* radif) {
+  return radif->link_adaptation && (radif->modulation & RADIF_OQPSK);
+}
+/**
+ * Writes a data rate and power to the radio, if they're not there already.
+ */
+void radio_link_write(uint8_t rate, uint8_t power, struct radif* radif) {
+  /* These are shadowed, so checking them is free */
+  if ((radio_reg_read(TRX_CTRL_2, radif) & 0x3) != rate) {
+    radio_reg_read_mod_write(TRX_CTRL_2, rate, 0x3, radif);
+  }
+  if (radio_reg_read(PHY_TX_PWR, radif) != power) {
+    radio_reg_write(PHY_TX_PWR, power, radif);
+  }
+}
+
+/**
+ * Called for each frame received, to keep track of each node's signal
+ * strength.
+ */
+void radio_link_rx(struct rx_frame* rx, struct radif* radif) {
+  struct radif_link* link;
+
+  if (!radio_link_enabled(radif) || rx->source_address == RADIF_NO_SHORT_ADDRESS) {
+    return;
+  }
+
+  link = radio_link_find(rx->source_address, 1, radif);
+
+  if (link->ed_average == 0) {
+    link->ed_average = rx->energy_detect;
+  } else { /* Moving average over about 4 frames */
+    link->ed_average = (uint8_t)(((uint16_t)link->ed_average * 3 + rx->energy_detect) / 4);
+  }
+}
+/**
+ * Sets up the radio for a frame to address. Called in TX_ARET_ON just
+ * before the frame is written.
+ */
+void radio_link_apply(uint16_t address, struct radif* radif) {
+  struct radif_link* link = 0;
+
+  if (radio_link_enabled(radif) && address != 0xFFFF) {
+    link = radio_link_find(address, 0, radif);
+  }
+
+  radif->tx_link = link;
+
+  if (link) {
+    radio_link_write(link->rate, link->power_step ?
+		     radio_link_power[link->power_step-1] : radif->power, radif);
+  } else { /* Broadcasts and unknown nodes get the configured settings */
+    radio_link_write(radif->modulation & 0x3, radif->power, radif);
+  }
+}
+/**
+ * Adapts the link to how the last frame went.
+ */
+void radio_link_tx_done(uint8_t status, struct radif* radif) {
+  struct radif_link* link = radif->tx_link;
+
+  radif->tx_link = 0;
+
+  if (link == 0 || !link->in_use) {
+    return;
+  }
+
+  if (status == RADIO_SUCCESS) {
+    link->failures = 0;
+
+    if (++link->successes >= RADIO_LINK_UP_SUCCESSES) {
+      link->successes = 0;
+
+      if (link->ed_average >= RADIO_LINK_POWER_ED &&
+	  link->power_step < RADIO_LINK_POWER_STEPS) { /* Very strong, save some power */
+	link->power_step++;
+	radif->link_changes++;
+      } else if (link->rate < RADIO_LINK_MAX_RATE &&
+		 link->ed_average >= RADIO_LINK_RATE_ED +
+		 (RADIO_LINK_RATE_ED_STEP * link->rate)) { /* Strong enough to go faster */
+	link->rate++;
+	radif->link_changes++;
+      }
+    }
+  } else if (status == RADIO_NO_ACK) {
+    link->successes = 0;
+
+    if (++link->failures >= RADIO_LINK_DOWN_FAILURES) {
+      link->failures = 0;
+
+      if (link->power_step > 0) { /* Power back up first */
+	link->power_step--;
+	radif->link_changes++;
+      } else if (link->rate > 0) { /* Then slow down */
+	link->rate--;
+	radif->link_changes++;
+      }
+    }
+  }
+  /* Channel access failures don't tell us anything about the link */
+}
+/**
+ * Puts the configured settings back before we go back to receiving.
+ */
+void radio_link_restore(struct radif* radif) {
+  if (radio_link_enabled(radif)) {
+    radio_link_write(radif->modulation & 0x3, radif->power, radif);
+  }
+}
@@ -28,51 +28,178 @@
 #include "radio.h"
 #include "radio_irq.h"
 #include "debug.h"
+#include "netif/lpc_mac_addr.h"
 
+/**
+ * The radio interface's hardware functions don't take any arguments, so
+ * each radio gets its own set that pass on its number.
+ */
+#define RF212_HW_FUNCTIONS(n)						\
+  void rf212_##n##_spi_enable(void) { rf212_spi_enable(n); }		\
+  void rf212_##n##_spi_disable(void) { rf212_spi_disable(n); }		\
+  void rf212_##n##_slptr_enable(void) { rf212_slptr_enable(n); }	\
+  void rf212_##n##_slptr_disable(void) { rf212_slptr_disable(n); }	\
+  void rf212_##n##_reset_enable(void) { rf212_reset_enable(n); }	\
+  void rf212_##n##_reset_disable(void) { rf212_reset_disable(n); }	\
+  void rf212_##n##_timer_start(uint32_t us) { rf212_timer_start(n, us); } \
+  uint32_t rf212_##n##_capture_us(void) { return rf212_capture_us(n); }	\
+  void rf212_##n##_trigger_interrupt(void) { rf212_trigger_interrupt(n); }
+
+/**
+ * Connects up the various hardware functions radio n needs to operate
+ */
+#define RF212_CONNECT(n)						\
+  do {									\
+    rf212_radif[n].spi_start = rf212_##n##_spi_enable;			\
+    rf212_radif[n].spi_stop = rf212_##n##_spi_disable;			\
+    rf212_radif[n].slptr_set = rf212_##n##_slptr_enable;		\
+    rf212_radif[n].slptr_clear = rf212_##n##_slptr_disable;		\
+    rf212_radif[n].reset_set = rf212_##n##_reset_enable;		\
+    rf212_radif[n].reset_clear = rf212_##n##_reset_disable;		\
+    rf212_radif[n].timer_start = rf212_##n##_timer_start;		\
+    rf212_radif[n].rx_capture_us = rf212_##n##_capture_us;		\
+    rf212_radif[n].interrupt_trigger = rf212_##n##_trigger_interrupt;	\
+    rf212_radif[n].freq = RF212_##n##_FREQ;				\
+    rf212_radif[n].modulation = RF212_##n##_MODULATION;			\
+    rf212_radif[n].power = RF212_##n##_POWER;				\
+  } while (0)
+
+RF212_HW_FUNCTIONS(0)
+#if RF212_NUM_RADIOS > 1
+RF212_HW_FUNCTIONS(1)
+#endif
+
+/**
+ * Reports any commands that fail during startup
+ */
+void rf212_command_done(uint8_t command, uint8_t output, struct radif* radif) {
+  if (output != RADIO_SUCCESS) {
+    debug_printf("Radio %d command %d failed: %02x\n",
+		 radif->index, command, output);
+  }
+}
+
+/**
+ * Resets the radio, sets it up and makes it operational, as one batch so
+ * that nothing else runs part way through
+ */
+const struct radif_command rf212_startup_commands[] = {
+  { RADIF_RESET,		0, 0, rf212_command_done },
+  { RADIF_SET_MODULATION,	0, 0, rf212_command_done },
+  { RADIF_SET_FREQ,		0, 0, rf212_command_done },
+  { RADIF_SET_POWER,		0, 0, rf212_command_done },
+  { RADIF_SET_ADDRESS,		0, 0, rf212_command_done },
+  { RADIF_STARTUP,		0, 0, rf212_command_done },
+};
+#define NUM_RF212_STARTUP_COMMANDS	\
+  (sizeof(rf212_startup_commands)/sizeof(rf212_startup_commands[0]))
+
+/**
+ * Makes an EUI-64 from our Ethernet MAC address (EUI-48) by putting
+ * FF-FE in the middle. Returns 0 if we don't have a MAC address.
+ */
+uint64_t rf212_ext_address(void) {
+  uint8_t mac[6];
+  uint64_t ext_address = 0;
+  uint8_t i;
+
+  if (get_macaddr(mac) < 0) {
+    return 0;
+  }
+
+  for (i = 0; i < 3; i++) { /* Most significant first */
+    ext_address = (ext_address << 8) | mac[i];
+  }
+  ext_address = (ext_address << 16) | 0xFFFE;
+  for (i = 3; i < 6; i++) {
+    ext_address = (ext_address << 8) | mac[i];
+  }
+
+  return ext_address;
+}
+
+/**
+ * Sets up the radios and waits for them to start. Each radio's CLKM is
+ * set up as part of its startup batch, and main() switches the core
+ * clock over to CLKM as soon as we return.
+ */
 void rf212_init(rx_callback_func callback) {
-  /* Setup the interface struct */
-  radif_init_struct(&rf212_radif);
-
-  /* Connect up the various hardware functions the interface needs to operate */
-  rf212_radif.spi_start = &rf212_spi_enable;
-  rf212_radif.spi_xfer = rf212_xfer;
-  rf212_radif.spi_stop = rf212_spi_disable;
-  rf212_radif.slptr_set = rf212_slptr_enable;
-  rf212_radif.slptr_clear = rf212_slptr_disable;
-  rf212_radif.reset_set = rf212_reset_enable;
-  rf212_radif.reset_clear = rf212_reset_disable;
-  rf212_radif.delay_us = rf212_delay_us;
-  rf212_radif.interrupt_trigger = &rf212_trigger_interrupt;
-  /* Set radio properties */
-  rf212_radif.auto_crc_gen = 0xFF;
-  rf212_radif.clkm_config = 0x19;
-  rf212_radif.freq = 8683;
-  rf212_radif.power = 0xe8;
-  rf212_radif.modulation = RADIF_OQPSK_400KCHIPS_200KBITS_S;
-  rf212_radif.pan_id = 0x1234;
-  rf212_radif.short_address = 0x0001; /* The base station has address 1 */
-  /* Set the receive callback */
-  rf212_radif.rx_callback = callback;
-
-  /* Initialise our hardware interface */
-  rf212_io_init();
-
-  /* Initialise the radio */
-  radif_command(RADIF_RESET, &rf212_radif);
-
-  /* Setup various parameters */
-  radif_command(RADIF_SET_MODULATION, &rf212_radif);
-  radif_command(RADIF_SET_FREQ, &rf212_radif);
-  radif_command(RADIF_SET_POWER, &rf212_radif);
-  radif_command(RADIF_SET_ADDRESS, &rf212_radif);
-
-  /* Make the radio interface operational */
-  radif_command(RADIF_STARTUP, &rf212_radif);
+  uint64_t ext_address = rf212_ext_address();
+  uint32_t start;
+  uint8_t n;
+
+  /* The radios share the SPI bus and the state machine timer */
+  rf212_spi_init();
+  rf212_timer_init();
+
+  /* Setup the interface structs */
+  for (n = 0; n < RF212_NUM_RADIOS; n++) {
+    radif_init_struct(&rf212_radif[n]);
+  }
+
+  /* Connect up each radio's own hardware functions and channel */
+  RF212_CONNECT(0);
+#if RF212_NUM_RADIOS > 1
+  RF212_CONNECT(1);
+#endif
+
+  for (n = 0; n < RF212_NUM_RADIOS; n++) {
+    struct radif* radif = &rf212_radif[n];
+
+    radif->index = n;
+
+    /* The hardware functions all the radios share */
+    radif->spi_xfer = rf212_xfer;
+    radif->clock_us = rf212_clock_us;
+    radif->enter_critical = rf212_enter_critical;
+    radif->exit_critical = rf212_exit_critical;
+    /* Set radio properties */
+    radif->auto_crc_gen = 0xFF;
+    radif->clkm_config = 0x19;
+    radif->pan_id = 0x1234;
+    radif->short_address = 0x0001; /* The base station has address 1 on every channel */
+    radif->ext_address = ext_address; /* So nodes without a short address can reach us */
+    /* Acks are superseded by the node's next retry, so they're the first to go */
+    radif->tx_full_policy = RADIF_TX_DROP_OLDEST_ACK;
+    radif->tx_block_timeout = 5000;
+    /* Close nodes can take faster rates and less power */
+    radif->link_adaptation = 0xFF;
+    /* All the radios feed the same receive callback */
+    radif->rx_callback = callback;
+
+    /* Initialise our hardware interface */
+    rf212_io_init(n);
+
+    /* Initialise the radio. This all happens in the background */
+    radif_command_batch(rf212_startup_commands, NUM_RF212_STARTUP_COMMANDS, radif);
+  }
+
+  /* The batches run from the radio interrupts, so just wait for them */
+  start = rf212_clock_us();
+  for (n = 0; n < RF212_NUM_RADIOS; n++) {
+    while (!rf212_radif[n].up) {
+      if (rf212_clock_us() - start > RF212_STARTUP_TIMEOUT) {
+	debug_printf("Radio %d didn't start up\n", n);
+	break;
+      }
+    }
+  }
 }
 void rf212_service() {
-  radif_service(&rf212_radif);
+  uint8_t n;
+
+  for (n = 0; n < RF212_NUM_RADIOS; n++) {
+    radif_service(&rf212_radif[n]);
+  }
 }
+
+/**
+ * Software-triggered radio handler. All the radios are serviced at the
+ * same priority, so they never interrupt each other's SPI transfers.
+ */
 void TIMER2_IRQHandler(void) {
+  uint8_t triggered, n;
+
   LPC_TIM2->IR |= 0x3F; /* Clear all the timer interrupts */
 
   NVIC_DisableIRQ(TIMER2_IRQn);
@@ -80,16 +207,46 @@ void TIMER2_IRQHandler(void) {
   LPC_TIM2->TCR = 0x2; /* Put the counter back into reset */
   LPC_SC->PCONP &= ~(1<<22); /* Power down Timer 2 */
 
-  /* Service the interrupt */
-  radio_irq(&rf212_radif);
+  /* Service the interrupt for each radio that asked */
+  triggered = rf212_triggered();
+
+  for (n = 0; n < RF212_NUM_RADIOS; n++) {
+    if (triggered & (1<<n)) {
+      radio_irq(&rf212_radif[n]);
+    }
+  }
 }
 
 /**
- * Radio IRQ
+ * Radio state machine timer
  */
-void EINT1_IRQHandler(void) {
-  /* Clear the interrupt  */
-  LPC_SC->EXTINT |= (1<<1);
+void TIMER0_IRQHandler(void) {
+  uint8_t expired = rf212_timer_expired();
+  uint8_t n;
+
+  /* Service the interrupt for each radio whose timer has expired */
+  for (n = 0; n < RF212_NUM_RADIOS; n++) {
+    if (expired & (1<<n)) {
+      radio_timer_irq(&rf212_radif[n]);
+    }
+  }
+}
+
+/**
+ * Radio IRQs
+ */
+void rf212_eint_irq(uint8_t eint) {
+  /* Clear the interrupt and find which radio raised it */
+  uint8_t n = rf212_eint_radio(eint);
+
   /* And service it */
-  radio_irq(&rf212_radif);
+  if (n < RF212_NUM_RADIOS) {
+    radio_irq(&rf212_radif[n]);
+  }
+}
+void EINT1_IRQHandler(void) {
+  rf212_eint_irq(1);
+}
+void EINT2_IRQHandler(void) {
+  rf212_eint_irq(2);
 }
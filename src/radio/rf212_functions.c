@@ -29,26 +29,50 @@
 
 /* -------- Pins -------- */
 
+/**
+ * The pins for each radio
+ */
+struct rf212_pins {
+  LPC_GPIO_TypeDef* ssel_port;
+  uint8_t ssel_pin;
+  LPC_GPIO_TypeDef* reset_port;
+  uint8_t reset_pin;
+  LPC_GPIO_TypeDef* slptr_port;
+  uint8_t slptr_pin;
+  uint8_t eint; /* The external interrupt, EINTn on P2[10+n] */
+  uint8_t cap; /* The timer 0 capture input, CAP0.n on P1[26+n] */
+};
+const struct rf212_pins rf212_pins[RF212_NUM_RADIOS] = {
+  { RF212_0_SSEL_PORT, RF212_0_SSEL_PIN,
+    RF212_0_RESET_PORT, RF212_0_RESET_PIN,
+    RF212_0_SLPTR_PORT, RF212_0_SLPTR_PIN, RF212_0_EINT, RF212_0_CAP },
+#if RF212_NUM_RADIOS > 1
+  { RF212_1_SSEL_PORT, RF212_1_SSEL_PIN,
+    RF212_1_RESET_PORT, RF212_1_RESET_PIN,
+    RF212_1_SLPTR_PORT, RF212_1_SLPTR_PIN, RF212_1_EINT, RF212_1_CAP },
+#endif
+};
+
 /* Reset: Active Low */
-void rf212_reset_enable() {
-  RF212_RESET_PORT->FIOCLR = (1 << RF212_RESET_PIN);
+void rf212_reset_enable(uint8_t n) {
+  rf212_pins[n].reset_port->FIOCLR = (1 << rf212_pins[n].reset_pin);
 }
-void rf212_reset_disable() {
-  RF212_RESET_PORT->FIOSET = (1 << RF212_RESET_PIN);
+void rf212_reset_disable(uint8_t n) {
+  rf212_pins[n].reset_port->FIOSET = (1 << rf212_pins[n].reset_pin);
 }
 /* Sleep Trigger: Active High */
-void rf212_slptr_enable() {
-  RF212_SLPTR_PORT->FIOSET = (1 << RF212_SLPTR_PIN);
+void rf212_slptr_enable(uint8_t n) {
+  rf212_pins[n].slptr_port->FIOSET = (1 << rf212_pins[n].slptr_pin);
 }
-void rf212_slptr_disable() {
-  RF212_SLPTR_PORT->FIOCLR = (1 << RF212_SLPTR_PIN);
+void rf212_slptr_disable(uint8_t n) {
+  rf212_pins[n].slptr_port->FIOCLR = (1 << rf212_pins[n].slptr_pin);
 }
 /* Slave Select: Active Low */
-void rf212_spi_enable() {
-  RF212_SSEL_PORT->FIOCLR = (1 << RF212_SSEL_PIN);
+void rf212_spi_enable(uint8_t n) {
+  rf212_pins[n].ssel_port->FIOCLR = (1 << rf212_pins[n].ssel_pin);
 }
-void rf212_spi_disable() {
-  RF212_SSEL_PORT->FIOSET = (1 << RF212_SSEL_PIN);
+void rf212_spi_disable(uint8_t n) {
+  rf212_pins[n].ssel_port->FIOSET = (1 << rf212_pins[n].ssel_pin);
 }
 
 /* -------- SPI -------- */
@@ -111,53 +135,163 @@ void rf212_spi_init() { /* Sets up the SPI port for the radio */
   /* Set SSPINMS registers to enable interrupts */
   /* enable all error related interrupts */
   RF212_SPI_BLOCK->IMSC = SSPIMSC_RORIM | SSPIMSC_RTIM;
-
-  rf212_spi_disable();
 }
 
 /* -------- Initialisation -------- */
 
-void rf212_io_init() {
+/**
+ * Sets up the pins and interrupt for radio n. The SPI bus and timer are
+ * shared, so rf212_spi_init and rf212_timer_init are called separately.
+ */
+void rf212_io_init(uint8_t n) {
+  const struct rf212_pins* pins = &rf212_pins[n];
+  uint8_t eint = pins->eint;
+
   /* Configure IOs as outputs */
-  RF212_RESET_PORT->FIODIR |= (1 << RF212_RESET_PIN);	/* Reset */
-  RF212_SLPTR_PORT->FIODIR |= (1 << RF212_SLPTR_PIN);	/* Sleep Trigger */
-  RF212_SSEL_PORT->FIODIR |= (1 << RF212_SSEL_PIN);	/* Slave Select */
+  pins->reset_port->FIODIR |= (1 << pins->reset_pin);	/* Reset */
+  pins->slptr_port->FIODIR |= (1 << pins->slptr_pin);	/* Sleep Trigger */
+  pins->ssel_port->FIODIR |= (1 << pins->ssel_pin);	/* Slave Select */
+
+  rf212_spi_disable(n);
+
+  /* The interrupt pin is P2[10+n] / EINTn  */
+  LPC_PINCON->PINSEL4 &= ~(3 << (20 + 2*eint));
+  LPC_PINCON->PINSEL4 |= (1 << (20 + 2*eint)); /* Mode EINTn */
+
+  LPC_SC->EXTMODE |= (1<<eint); /* Level Sensitive */
+  LPC_SC->EXTPOLAR |= (1<<eint); /* Rising Edge */
+  LPC_SC->EXTINT |= (1<<eint); /* Clear the interrupt */
+
+  NVIC_SetPriority(EINT0_IRQn + eint, 5);
+  NVIC_EnableIRQ(EINT0_IRQn + eint);
+
+  /* The frame start on DIG2 goes to P1[26+n] / CAP0.n */
+  LPC_PINCON->PINSEL3 |= (3 << (20 + 2*pins->cap)); /* Mode CAP0.n */
 
-  /* Configure SPI for AT86RF212 access */
-  rf212_spi_init();
+  LPC_TIM0->CCR |= (1 << (3*pins->cap)); /* Capture on the rising edge, no interrupt */
+}
+/**
+ * Clears the given external interrupt and returns the radio attached to
+ * it, or RF212_NUM_RADIOS if there isn't one.
+ */
+uint8_t rf212_eint_radio(uint8_t eint) {
+  uint8_t n;
 
-  /* The interrupt pin is P2[11] / EINT1  */
-  LPC_PINCON->PINSEL4 |= (1 << 22); /* Mode EINT1 */
+  LPC_SC->EXTINT |= (1<<eint); /* Clear the interrupt */
 
-  LPC_SC->EXTMODE |= (1<<1); /* Level Sensitive */
-  LPC_SC->EXTPOLAR |= (1<<1); /* Rising Edge */
-  LPC_SC->EXTINT |= (1<<1); /* Clear the interrupt */
+  for (n = 0; n < RF212_NUM_RADIOS; n++) {
+    if (rf212_pins[n].eint == eint) {
+      return n;
+    }
+  }
 
-  NVIC_SetPriority(EINT1_IRQn, 5);
-  NVIC_EnableIRQ(EINT1_IRQn);
+  return RF212_NUM_RADIOS;
 }
 
 /* -------- Timer -------- */
 
-void rf212_delay_us(uint32_t us) {
+/* Radios whose match had already passed when it was set */
+uint8_t rf212_timer_late;
+
+/**
+ * Timer 0 free-runs at 1MHz. Each radio state machine uses its own match
+ * register (MR0 for radio 0, MR1 for radio 1) to be woken up again after
+ * a delay.
+ */
+void rf212_timer_init() {
   LPC_SC->PCONP |= (1<<1); /* Power up Timer 0, CCLK/4 */
 
   LPC_TIM0->TCR = 0x2; /* Put the counter into reset */
-  LPC_TIM0->PR = 25; /* 1µs on a 100MHz clock */
-  LPC_TIM0->MR0 = us;
-  LPC_TIM0->MCR |= (1<<0)|(1<<2); /* Interrupt and stop on MR0 */
-  LPC_TIM0->IR |= 0x3F; /* Clear all the timer interrupts */
+  /* 1µs ticks. CCLK is 100MHz from the IRC now and from CLKM once main()
+   * has switched over, so this holds across the switch */
+  LPC_TIM0->PR = (SystemCoreClock / 4) / 1000000 - 1;
+  LPC_TIM0->MCR = 0; /* No match interrupts until we need them */
+  LPC_TIM0->CCR = 0; /* Each radio sets up its own capture */
+  LPC_TIM0->IR = 0x3F; /* Clear all the timer interrupts */
+
+  NVIC_SetPriority(TIMER0_IRQn, 5);
+  NVIC_EnableIRQ(TIMER0_IRQn);
+
   LPC_TIM0->TCR = 0x1; /* Start the counter */
+}
+void rf212_timer_start(uint8_t n, uint32_t us) {
+  volatile uint32_t* mr = &LPC_TIM0->MR0 + n;
+
+  LPC_TIM0->MCR &= ~(1<<(3*n)); /* Stop any match already in progress */
+  LPC_TIM0->IR = (1<<n);
+  rf212_timer_late &= ~(1<<n);
+
+  *mr = LPC_TIM0->TC + us;
+  LPC_TIM0->MCR |= (1<<(3*n)); /* Interrupt on MRn */
+
+  /* If the counter has already gone past, fire it now */
+  if ((int32_t)(LPC_TIM0->TC - *mr) > 0 && (LPC_TIM0->IR & (1<<n)) == 0) {
+    rf212_timer_late |= (1<<n);
+    NVIC_SetPendingIRQ(TIMER0_IRQn);
+  }
+}
+/**
+ * Called from the timer interrupt. Returns a bitmask of the radios whose
+ * timer has expired, and stops those timers. They're one-shot.
+ */
+uint8_t rf212_timer_expired() {
+  uint8_t expired = rf212_timer_late;
+  uint8_t n;
+
+  for (n = 0; n < RF212_NUM_RADIOS; n++) {
+    if ((LPC_TIM0->MCR & (1<<(3*n))) && (LPC_TIM0->IR & (1<<n))) {
+      expired |= (1<<n);
+    }
+  }
+  for (n = 0; n < RF212_NUM_RADIOS; n++) {
+    if (expired & (1<<n)) {
+      LPC_TIM0->MCR &= ~(1<<(3*n));
+      LPC_TIM0->IR = (1<<n);
+    }
+  }
+
+  rf212_timer_late = 0;
+
+  return expired;
+}
+
+uint32_t rf212_clock_us() {
+  return LPC_TIM0->TC;
+}
+/**
+ * Returns the value of the µs clock when radio n last started receiving
+ * a frame, as latched by the timer capture.
+ */
+uint32_t rf212_capture_us(uint8_t n) {
+  return *(&LPC_TIM0->CR0 + rf212_pins[n].cap);
+}
+
+/* -------- Critical Sections -------- */
+
+uint32_t rf212_saved_basepri;
 
-  while ((LPC_TIM0->IR & 0x1) == 0);
+/**
+ * Holds off all the interrupts that service the radio (priority 5 and
+ * below) while allowing higher priority ones to continue.
+ */
+void rf212_enter_critical() {
+  uint32_t basepri = __get_BASEPRI();
 
-  LPC_TIM0->TCR = 0x2; /* Put the counter back into reset */
-  LPC_SC->PCONP &= ~(1<<1); /* Power down Timer 0 */
+  __set_BASEPRI(5 << (8 - __NVIC_PRIO_BITS));
+  rf212_saved_basepri = basepri;
+}
+void rf212_exit_critical() {
+  __set_BASEPRI(rf212_saved_basepri);
 }
 
 /* -------- High Priority Interrupt -------- */
 
-void rf212_trigger_interrupt(void) {
+/* Set for each radio that has asked for the interrupt */
+volatile uint8_t rf212_trigger_pending[RF212_NUM_RADIOS];
+
+void rf212_trigger_interrupt(uint8_t n) {
+  rf212_trigger_pending[n] = 1;
+
   LPC_SC->PCONP |= (1<<22); /* Power up Timer 2, CCLK/4 */
 
   LPC_TIM2->TCR = 0x2; /* Put the counter into reset */
@@ -171,3 +305,20 @@ void rf212_trigger_interrupt(void) {
 
   LPC_TIM2->TCR = 0x1; /* Start the counter */
 }
+/**
+ * Called from the triggered interrupt. Returns a bitmask of the radios
+ * that asked for it.
+ */
+uint8_t rf212_triggered() {
+  uint8_t triggered = 0;
+  uint8_t n;
+
+  for (n = 0; n < RF212_NUM_RADIOS; n++) {
+    if (rf212_trigger_pending[n]) {
+      rf212_trigger_pending[n] = 0;
+      triggered |= (1<<n);
+    }
+  }
+
+  return triggered;
+}
@@ -26,15 +26,55 @@
 #include <time.h>
 #include "radio/rf212.h"
 #include "radio.h"
+#include "init_service.h"
 #include "sntp/time.h"
 #include "memory/write.h"
 #include "frame_processor.h"
+#include "channel_survey.h"
+#include "csma_tuning.h"
+#include "tdma.h"
+#include "time_beacon.h"
+#include "dissemination.h"
+#include "node_table.h"
+#include "sniffer.h"
+#include "frame_security.h"
+#include "reassembly.h"
+#include "association.h"
 #include "console.h"
 #include "debug.h"
 #include "leds.h"
 
 #define RADIO_DEBUGF		console_printf
 
+/**
+ * Converts a time on radif->clock_us to seconds and microseconds on the
+ * same clock as get_timer_time. It must be in the last hour or so.
+ */
+void radio_clock_time(uint32_t at, struct radif* radif, uint32_t* secs, uint32_t* us) {
+  uint32_t now_us, age;
+
+  /* Read both clocks together */
+  radif->enter_critical();
+  get_timer_time(secs, &now_us);
+  age = radif->clock_us() - at;
+  radif->exit_critical();
+
+  /* And step back to when the frame arrived */
+  *secs -= age / 1000000;
+  age %= 1000000;
+  if (now_us < age) {
+    (*secs)--;
+    now_us += 1000000;
+  }
+  *us = now_us - age;
+}
+/**
+ * Gives the time a received frame started arriving. See radio_clock_time.
+ */
+void radio_rx_time(struct rx_frame* rx, uint32_t* secs, uint32_t* us) {
+  radio_clock_time(rx->rx_time, rx->radif, secs, us);
+}
+
 /**
  * A debug message has been received
  */
@@ -42,12 +82,13 @@ static void radio_debug_frame(struct rx_frame* rx) {
   uint8_t buffer[4];
   buffer[0] = 'D'; buffer[1] = 'D';
   buffer[2] = 'D'; buffer[3] = 'D'; /* Send a quick acknowledgement */
-  radif_send(buffer, 4, rx->source_address, 1, &rf212_radif);
+  radif_reply(rx, buffer, 4, RADIF_TX_ACK_REQUEST, 0);
 
   RADIO_DEBUGF("Remote Debug: %s", (char*)rx->data+1);
 }
 /**
- * A request for the current time has been received
+ * A request for the current time has been received. Only nodes that are
+ * starting up should need these, the rest listen for time beacons
  */
 static void radio_timereq_frame(struct rx_frame* rx) {
   uint8_t buffer[9];
@@ -70,7 +111,7 @@ static void radio_timereq_frame(struct rx_frame* rx) {
     buffer[7] = time_now & 0xFF; time_now >>= 8;
     buffer[8] = time_now & 0xFF;
 
-    radif_send(buffer, 9, rx->source_address, 1, &rf212_radif);
+    radif_reply(rx, buffer, 9, RADIF_TX_ACK_REQUEST | RADIF_TX_TIME_CRITICAL, 0);
   } else {
     RADIO_DEBUGF("Ignoring request for time: Our Time is Invalid\n");
   }
@@ -80,13 +121,47 @@ static void radio_timereq_frame(struct rx_frame* rx) {
 }
 
 void rf212_rx_callback(struct rx_frame* rx) {
+  /* Check the MIC before we believe anything the frame says */
+  if (frame_security_frame(rx)) {
+    return;
+  }
+  /* Keep track of who's using their slots */
+  tdma_frame_received(rx);
+  /* And what each node is sending us */
+  if (node_table_frame(rx)) {
+    /* We've had this frame already, the node didn't hear our MAC ack */
+    rx->radif->rx_duplicate++;
+    return;
+  }
+  /* Renew the node's lease */
+  association_frame_received(rx);
 
   switch (rx->data[0]) {
     case 'D':	radio_debug_frame(rx);
       break;
     case 'T':	radio_timereq_frame(rx);
       break;
-    case 'U':	block_uploaded(rx);
+    case 'J':	association_request(rx);
+      break;
+    case 'N':	dissemination_nak(rx);
+      break;
+    case 'U':
+    case 'W':
+    case 'Z':
+    case 'F':
+      if (rx->source_address == RADIF_NO_SHORT_ADDRESS) {
+	/* Uploads are tracked by short address */
+	RADIO_DEBUGF("Ignoring upload from %08lx%08lx: No short address\n",
+		     (uint32_t)(rx->source_ext_address >> 32), (uint32_t)rx->source_ext_address);
+      } else if (rx->data[0] == 'U') {
+	block_uploaded(rx);
+      } else if (rx->data[0] == 'W') {
+	window_block_uploaded(rx);
+      } else if (rx->data[0] == 'Z') {
+	delta_block_uploaded(rx);
+      } else {
+	reassembly_frame(rx);
+      }
       break;
     default:	RADIO_DEBUGF("Unknown radio frame type '%c' received from %02X\n",
 			     rx->data[0], rx->source_address);
@@ -98,9 +173,31 @@ void rf212_rx_callback(struct rx_frame* rx) {
  * Used to start all radio operations
  */
 void radio_init(void) {
+  frame_processor_init();
+  reassembly_init();
+  association_init();
+  channel_survey_init();
+  csma_tuning_init();
+  tdma_init();
+  time_beacon_init();
+  dissemination_init();
+  node_table_init();
+  frame_security_init();
   rf212_init(rf212_rx_callback);
+  sniffer_init();
 }
 /* Processes radio operations */
 void radio_service(void) {
   rf212_service();
+  frame_processor_service();
+  reassembly_service();
+  association_service();
+  channel_survey_service();
+  csma_tuning_service();
+  tdma_service();
+  time_beacon_service();
+  dissemination_service();
+  node_table_service();
+  frame_security_service();
+  sniffer_service();
 }
@@ -0,0 +1,248 @@
+/* 
+ * Reassembles long records sent in several frames
+ * Copyright (C) 2013  Richard Meadows
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <string.h>
+#include "reassembly.h"
+#include "radio.h"
+#include "node_table.h"
+#include "frame_processor.h"
+#include "memory/memory.h"
+#include "memory/write.h"
+#include "console.h"
+
+enum {
+  REASSEMBLY_FREE = 0,
+  REASSEMBLY_ACTIVE,
+  REASSEMBLY_DONE	/* Stored, kept so we can acknowledge it again */
+};
+
+struct reassembly {
+  uint8_t state;
+  uint16_t source_address;
+  struct radif* radif;	/* The interface we last heard this node on */
+
+  uint8_t transfer;
+  uint8_t kind;
+  uint8_t fragment_size;
+  uint16_t length;
+  uint8_t fragments;
+  uint32_t received;	/* Bit n is set if we have fragment n */
+  uint32_t last_active;	/* The tick at which we last heard a fragment */
+
+  /* Room for the record, then the data after it */
+  uint32_t block[(MEMORY_RECORD_SIZE+MEMORY_LONG_RECORD_MAX)/4];
+};
+
+struct reassembly reassemblies[REASSEMBLY_BUFFERS];
+uint32_t reassembly_ticks;
+
+uint8_t reassembly_ack_packet[7];
+
+/* ---- Statistics ---- */
+uint32_t reassembly_stored; /* Transfers stored as long records */
+uint32_t reassembly_timeouts; /* Transfers abandoned part way through */
+uint32_t reassembly_no_buffer; /* Fragments dropped because every buffer was busy */
+uint32_t reassembly_refused; /* Transfers we couldn't store */
+
+/**
+ * Sends a 'G' frame with the fragments we have, and a back-off if nodes
+ * should slow down. Set refused if we've just failed to store it.
+ */
+void send_reassembly_ack(struct reassembly* r, uint8_t refused) {
+  uint8_t backoff = upload_backoff(refused);
+
+  reassembly_ack_packet[0] = 'G';
+  reassembly_ack_packet[1] = r->transfer;
+  reassembly_ack_packet[2] = r->received & 0xFF;
+  reassembly_ack_packet[3] = (r->received >> 8) & 0xFF;
+  reassembly_ack_packet[4] = (r->received >> 16) & 0xFF;
+  reassembly_ack_packet[5] = (r->received >> 24) & 0xFF;
+  reassembly_ack_packet[6] = backoff;
+
+  radif_send(reassembly_ack_packet, backoff ? 7 : 6, r->source_address,
+	     RADIF_TX_ACK_REQUEST | RADIF_TX_UPLOAD_ACK | RADIF_TX_SUPERSEDES, 0, r->radif);
+}
+/**
+ * Returns the buffer for a node's transfer, starting it if it's new. A
+ * node's last transfer is given up when it starts another. Returns 0 if
+ * there's no room.
+ */
+struct reassembly* get_reassembly(uint16_t source_address, uint8_t transfer) {
+  struct reassembly* spare = 0;
+  uint8_t i;
+
+  for (i = 0; i < REASSEMBLY_BUFFERS; i++) {
+    struct reassembly* r = &reassemblies[i];
+
+    if (r->state != REASSEMBLY_FREE && r->source_address == source_address) {
+      if (r->transfer == transfer) {
+	return r;
+      }
+      spare = r; /* The node has moved on */
+      break;
+    }
+    if (r->state == REASSEMBLY_FREE) {
+      spare = r;
+    } else if (r->state == REASSEMBLY_DONE && (spare == 0 || spare->state == REASSEMBLY_DONE)) {
+      spare = r; /* Only needed if the node lost our 'G' */
+    }
+  }
+
+  if (spare) {
+    memset(spare, 0, sizeof(struct reassembly));
+    spare->state = REASSEMBLY_ACTIVE;
+    spare->source_address = source_address;
+    spare->transfer = transfer;
+  }
+
+  return spare;
+}
+/**
+ * Stores a completed transfer. Returns 1 if it was stored.
+ */
+uint8_t reassembly_complete(struct reassembly* r) {
+  uint32_t flags = (r->kind << 16) | r->source_address;
+
+  if (write_long_record_to_mem(flags, r->block, r->length, 0)) {
+    r->state = REASSEMBLY_DONE;
+    reassembly_stored++;
+    node_table_record_stored(r->source_address);
+    return 1;
+  }
+
+  /* Nowhere to put it. The node will have to send it all again */
+  r->state = REASSEMBLY_FREE;
+  r->received = 0;
+  reassembly_refused++;
+  return 0;
+}
+
+/**
+ * Used to process a fragment.
+ */
+void reassembly_frame(struct rx_frame* rx) {
+  struct reassembly* r;
+  uint8_t transfer, fragment, fragment_size, kind, fragments, data_len;
+  uint16_t length, offset;
+
+  if (rx->length < REASSEMBLY_HEADER) {
+    console_puts("Radio Fragment too short!\n");
+    return;
+  }
+
+  transfer = rx->data[1];
+  fragment = rx->data[2];
+  fragment_size = rx->data[3];
+  length = rx->data[4] | (rx->data[5] << 8);
+  kind = rx->data[6];
+  data_len = rx->length - REASSEMBLY_HEADER;
+
+  /* Check it describes a transfer we can hold */
+  if (fragment_size == 0 || length == 0 || length > MEMORY_LONG_RECORD_MAX) {
+    console_puts("Radio Fragment bad length!\n");
+    return;
+  }
+  fragments = (length + fragment_size - 1) / fragment_size;
+  offset = fragment * fragment_size;
+  if (fragments > REASSEMBLY_MAX_FRAGMENTS || fragment >= fragments ||
+      data_len != ((fragment == fragments - 1) ? length - offset : fragment_size)) {
+    console_puts("Radio Fragment bad length!\n");
+    return;
+  }
+
+  r = get_reassembly(rx->source_address, transfer);
+  if (r == 0) {
+    reassembly_no_buffer++;
+    return;
+  }
+  r->radif = rx->radif;
+  r->last_active = reassembly_ticks;
+
+  if (r->state == REASSEMBLY_DONE) { /* Our 'G' must have been lost */
+    node_table_duplicate(rx->source_address);
+    send_reassembly_ack(r, 0);
+    return;
+  }
+
+  if (r->received == 0) { /* The first fragment we've had */
+    r->fragment_size = fragment_size;
+    r->length = length;
+    r->kind = kind;
+    r->fragments = fragments;
+  } else if (r->fragment_size != fragment_size || r->length != length || r->kind != kind) {
+    /* This doesn't match what we've got. Start again */
+    r->received = 0;
+    r->fragment_size = fragment_size;
+    r->length = length;
+    r->kind = kind;
+    r->fragments = fragments;
+  }
+
+  if (r->received & (1UL << fragment)) {
+    node_table_duplicate(rx->source_address);
+  } else {
+    memcpy((uint8_t*)r->block + MEMORY_RECORD_SIZE + offset,
+	   rx->data + REASSEMBLY_HEADER, data_len);
+    r->received |= 1UL << fragment;
+  }
+
+  if (r->received == (0xFFFFFFFFUL >> (32 - r->fragments)) &&
+      !reassembly_complete(r)) {
+    send_reassembly_ack(r, 1); /* An empty bitmap, and a back-off */
+    return;
+  }
+
+  /* Tell the node how it's doing at the end of each pass */
+  if (r->state == REASSEMBLY_DONE || fragment == fragments - 1) {
+    send_reassembly_ack(r, 0);
+  }
+}
+/**
+ * Frees the buffers of transfers that have gone quiet. Should be called
+ * from the main processing loop.
+ */
+void reassembly_service(void) {
+  uint8_t i;
+
+  reassembly_ticks++;
+
+  for (i = 0; i < REASSEMBLY_BUFFERS; i++) {
+    struct reassembly* r = &reassemblies[i];
+
+    if (r->state != REASSEMBLY_FREE &&
+	reassembly_ticks - r->last_active > REASSEMBLY_TIMEOUT_TICKS) {
+      if (r->state == REASSEMBLY_ACTIVE) {
+	reassembly_timeouts++;
+      }
+      r->state = REASSEMBLY_FREE;
+    }
+  }
+}
+/**
+ * Initialises the reassembly buffers.
+ */
+void reassembly_init(void) {
+  memset(reassemblies, 0, sizeof(reassemblies));
+  reassembly_ticks = 0;
+}
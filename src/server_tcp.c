@@ -106,8 +106,10 @@ struct server_tcp_state {
 
   uint16_t records_index;			/* Our current index in the records */
   uint16_t records_count;			/* The total number of records that are going to be output */
+  uint16_t slots_index;			/* Our current index in the JSON slots */
+  uint16_t slots_count;			/* The number of JSON slots in the Content-Length */
 
-  char output_buffer[400];
+  char output_buffer[JSON_MAX_ELEMENT_CHARS+2];
   uint16_t current_pos;			/* Our current position in the output buffer */
   uint16_t current_len;			/* The length of the data in the output buffer */
 
@@ -258,7 +260,7 @@ static void server_tcp_out(struct tcp_pcb *pcb, struct server_tcp_state *ss) {
       /* Select a new data block to output */
       switch(ss->output_phase) {
 	case OP_HTTP_HEADER: /* Send a header that specifies how many records we are going to send */
-	  ss->current_len = http_header(ss->output_buffer, ss->auth, ss->records_count);
+	  ss->current_len = http_header(ss->output_buffer, ss->auth, ss->slots_count);
 	  ss->output_phase++;
 	  break;
 	case OP_JSON_HEADER: /* Start the JSON object */
@@ -266,11 +268,27 @@ static void server_tcp_out(struct tcp_pcb *pcb, struct server_tcp_state *ss) {
 	  ss->output_phase++;
 	  break;
 	case OP_JSON_DATA:
-	  if (ss->records_index++ < ss->records_count) { /* If there are more records to be output */
-	    /* Read from memory, and encode as a JSON element */
-	    ss->current_len = json_element(ss->output_buffer,
-					   get_sample(ss->mem_output_index++), /* Read in the data from memory */
-					   (ss->records_index < ss->records_count)); /* If this isn't the last, we need a comma */
+	  if (ss->records_index < ss->records_count) { /* If there are more records to be output */
+	    /* Read in the data from memory */
+	    uint32_t* record = get_sample(ss->mem_output_index);
+	    uint16_t slots = json_element_slots(record);
+
+	    if (ss->slots_index + slots <= ss->slots_count) { /* If it fits */
+	      /* Encode as a JSON element */
+	      ss->current_len = json_element(ss->output_buffer, record,
+					     (ss->slots_index > 0)); /* If this isn't the first, we need a comma */
+	      ss->mem_output_index++;
+	      ss->records_index++;
+	      ss->slots_index += slots;
+	      break;
+	    }
+	    /* Leave it for the next upload */
+	    ss->records_index = ss->records_count;
+	  }
+	  if (ss->slots_index < ss->slots_count) { /* Fill any slots that are left */
+	    ss->current_len = json_filler(ss->output_buffer, ss->slots_count - ss->slots_index,
+					  (ss->slots_index > 0));
+	    ss->slots_index = ss->slots_count;
 	  } else { ss->output_phase++; }
 	  break;
 	case OP_JSON_FOOTER: /* End the JSON object */
@@ -407,6 +425,8 @@ err_t server_tcp_init(char* host, ip_addr_t* remote_ip, uint16_t remote_port, ch
     server_tcp.remote_port = remote_port;
     server_tcp.mem_output_index = read_index;
     server_tcp.records_count = records_count;
+    /* Leave room for a long record at the end, so there's always progress */
+    server_tcp.slots_count = records_count + JSON_MAX_SLOTS - 1;
     server_tcp.tcp_close_callback = callback;
 
     /* Create a new Packet Control Block */
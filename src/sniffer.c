@@ -0,0 +1,216 @@
+/* 
+ * Streams received frames to a collector as ZEP
+ * Copyright (C) 2013  Richard Meadows
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <string.h>
+#include "sniffer.h"
+#include "radio.h"
+#include "radio/rf212.h"
+#include "init_service.h"
+#include "debug.h"
+
+#include "lwip/udp.h"
+#include "lwip/ip_addr.h"
+#include "lwip/pbuf.h"
+
+#if SNIFFER_ENABLED
+
+/* Seconds from the NTP epoch (1900) to the Unix one (1970) */
+#define SNIFFER_NTP_OFFSET	2208988800UL
+
+struct sniffer_frame {
+  uint8_t psdu[0x7F];
+  uint8_t length;
+  uint8_t radio;
+  uint8_t channel;
+  uint8_t energy_detect;
+  uint8_t crc_status;
+  uint32_t rx_time; /* On the radio's clock_us */
+};
+
+struct sniffer_frame sniffer_ring[SNIFFER_RING_SIZE];
+volatile uint8_t sniffer_produce, sniffer_consume;
+
+struct udp_pcb* sniffer_pcb;
+ip_addr_t sniffer_collector;
+uint32_t sniffer_sequence;
+uint32_t sniffer_wait; /* Ticks the oldest frame in the ring has waited */
+
+/* ---- Statistics ---- */
+uint32_t sniffer_sent; /* Frames sent to the collector */
+uint32_t sniffer_drop_ring; /* Frames dropped because the ring was full */
+uint32_t sniffer_drop_net; /* Frames dropped because we couldn't send them */
+
+/**
+ * Returns the IEEE 802.15.4 channel page 0 number for a frequency in
+ * 100s of kHz, or 0xFF if it isn't one.
+ */
+uint8_t sniffer_channel(uint16_t freq) {
+  if (freq == 8683) { /* 868.3MHz */
+    return 0;
+  }
+  if (9060 <= freq && freq <= 9240 && (freq % 20) == 0) { /* 906 - 924MHz */
+    return (freq - 9040) / 20;
+  }
+
+  return 0xFF;
+}
+
+/**
+ * Called from the radio interrupt with every frame a radio reads. Keep
+ * this short.
+ */
+void sniffer_frame(struct rx_frame* rx, uint8_t* psdu, uint8_t len, struct radif* radif) {
+  uint8_t index = sniffer_produce;
+  uint8_t next = (index+1) % SNIFFER_RING_SIZE;
+  struct sniffer_frame* frame;
+
+  if (next == sniffer_consume) { /* No space */
+    sniffer_drop_ring++;
+    return;
+  }
+
+  frame = &sniffer_ring[index];
+  memcpy(frame->psdu, psdu, len);
+  frame->length = len;
+  frame->radio = radif->index;
+  frame->channel = sniffer_channel(radif->freq);
+  frame->energy_detect = rx->energy_detect;
+  frame->crc_status = rx->crc_status;
+  frame->rx_time = rx->rx_time;
+
+  sniffer_produce = next;
+}
+
+/**
+ * Writes a ZEP data packet for a frame into buf. Returns its length.
+ */
+uint16_t sniffer_write_zep(struct sniffer_frame* frame, uint8_t* buf) {
+  uint32_t secs, us, fraction;
+
+  /* When the frame arrived, as an NTP timestamp */
+  radio_clock_time(frame->rx_time, &rf212_radif[frame->radio], &secs, &us);
+  secs += SNIFFER_NTP_OFFSET;
+  fraction = (uint32_t)(((uint64_t)us << 32) / 1000000);
+
+  buf[0] = 'E'; buf[1] = 'X';
+  buf[2] = 2; /* Version */
+  buf[3] = 1; /* Data */
+  buf[4] = frame->channel;
+  buf[5] = 0; buf[6] = frame->radio; /* Device ID */
+  buf[7] = 1; /* CRC mode, the PSDU ends with the FCS */
+  buf[8] = frame->energy_detect;
+  buf[9] = secs >> 24; buf[10] = secs >> 16; buf[11] = secs >> 8; buf[12] = secs;
+  buf[13] = fraction >> 24; buf[14] = fraction >> 16; buf[15] = fraction >> 8; buf[16] = fraction;
+  buf[17] = sniffer_sequence >> 24; buf[18] = sniffer_sequence >> 16;
+  buf[19] = sniffer_sequence >> 8; buf[20] = sniffer_sequence;
+  memset(buf+21, 0, 10); /* Reserved */
+  buf[31] = frame->length;
+  memcpy(buf+SNIFFER_ZEP_HEADER, frame->psdu, frame->length);
+
+  sniffer_sequence++;
+
+  return SNIFFER_ZEP_HEADER + frame->length;
+}
+/**
+ * Sends the oldest count frames in the ring as one datagram.
+ */
+void sniffer_send(uint8_t count) {
+  uint16_t length = 0, offset = 0;
+  struct pbuf* p;
+  uint8_t i;
+
+  for (i = 0; i < count; i++) {
+    length += SNIFFER_ZEP_HEADER + sniffer_ring[(sniffer_consume+i) % SNIFFER_RING_SIZE].length;
+  }
+
+  /* In one piece, so we can write straight into it */
+  p = pbuf_alloc(PBUF_TRANSPORT, length, PBUF_RAM);
+
+  if (p != NULL) {
+    for (i = 0; i < count; i++) {
+      offset += sniffer_write_zep(&sniffer_ring[(sniffer_consume+i) % SNIFFER_RING_SIZE],
+				  (uint8_t*)p->payload + offset);
+    }
+
+    if (udp_sendto(sniffer_pcb, p, &sniffer_collector, SNIFFER_PORT) == ERR_OK) {
+      sniffer_sent += count;
+    } else {
+      sniffer_drop_net += count;
+    }
+
+    pbuf_free(p);
+  } else { /* Out of memory. Don't let the ring back up behind this */
+    sniffer_drop_net += count;
+  }
+
+  sniffer_consume = (sniffer_consume + count) % SNIFFER_RING_SIZE;
+}
+
+/**
+ * Called every tick to send what the radios have heard.
+ */
+void sniffer_service(void) {
+  uint8_t queued = (sniffer_produce + SNIFFER_RING_SIZE - sniffer_consume) % SNIFFER_RING_SIZE;
+
+  if (sniffer_pcb == NULL || queued == 0) {
+    sniffer_wait = 0;
+    return;
+  }
+
+  /* Wait for a full batch, but not for too long */
+  if (queued < SNIFFER_BATCH && sniffer_wait++ < SNIFFER_FLUSH_TICKS) {
+    return;
+  }
+
+  sniffer_wait = 0;
+  sniffer_send((queued < SNIFFER_BATCH) ? queued : SNIFFER_BATCH);
+}
+/**
+ * Starts sniffing on every radio.
+ */
+void sniffer_init(void) {
+  uint8_t n;
+
+  sniffer_produce = sniffer_consume = 0;
+
+  if (!ipaddr_aton(SNIFFER_COLLECTOR, &sniffer_collector) ||
+      (sniffer_pcb = udp_new()) == NULL) {
+    debug_printf("Sniffer: Couldn't start\n");
+    return;
+  }
+
+  for (n = 0; n < RF212_NUM_RADIOS; n++) {
+    struct radif* radif = &rf212_radif[n];
+
+    radif->sniff = sniffer_frame;
+    radif_command_arg(RADIF_SET_PROMISCUOUS, 0xFF, 0, radif);
+  }
+}
+
+#else /* The ring and the socket don't need the RAM */
+
+void sniffer_service(void) { }
+void sniffer_init(void) { }
+
+#endif /* SNIFFER_ENABLED */
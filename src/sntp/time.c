@@ -80,6 +80,19 @@ uint64_t get_current_time(void) {
 
 	return current_time;
 }
+/* Reads the seconds and microseconds straight from the timer */
+void get_timer_time(uint32_t* secs, uint32_t* us) {
+	uint32_t tc, pc;
+
+	/* Read again if the seconds ticked over while we were reading */
+	do {
+		tc = LPC_TIM3->TC;
+		pc = LPC_TIM3->PC;
+	} while (tc != LPC_TIM3->TC);
+
+	*secs = tc;
+	*us = pc / 25; /* The prescale counter runs at 25MHz */
+}
 /* Returns a boolean that indicates if the current time is valid */
 uint8_t is_time_valid(void) {
 	return time_valid;
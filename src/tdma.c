@@ -0,0 +1,247 @@
+/* 
+ * Schedules upload slots for each node
+ * Copyright (C) 2013  Richard Meadows
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <string.h>
+#include "tdma.h"
+#include "radio.h"
+#include "radio/rf212.h"
+#include "sntp/time.h"
+#include "debug.h"
+
+struct tdma_slot {
+  uint16_t address; /* 0 if the slot is free */
+  uint8_t used; /* Set if the node used its slot this superframe */
+  uint8_t idle; /* Superframes since the node last used its slot */
+};
+
+struct tdma_schedule {
+  struct tdma_slot slots[TDMA_SLOTS];
+  uint8_t beacon[TDMA_BEACON_HEADER + (2*TDMA_SLOTS)];
+  uint32_t queued_us; /* clock_us when the last beacon was stamped */
+  volatile uint32_t tx_delay; /* Average from stamping a beacon to it going out, in µs */
+
+  /* ---- Statistics ---- */
+  uint32_t in_slot; /* Frames from a node inside its own slot */
+  uint32_t out_of_slot; /* Frames from a node with a slot, outside it */
+  uint32_t unscheduled; /* Frames from nodes without a slot */
+};
+
+struct tdma_schedule tdma_schedules[RF212_NUM_RADIOS];
+uint32_t tdma_superframe;
+
+/**
+ * Returns the slot a node has been given, or TDMA_SLOTS if it hasn't
+ * got one.
+ */
+uint8_t tdma_find_slot(struct tdma_schedule* schedule, uint16_t address) {
+  uint8_t i;
+
+  for (i = 0; i < TDMA_SLOTS; i++) {
+    if (schedule->slots[i].address == address) {
+      return i;
+    }
+  }
+
+  return TDMA_SLOTS;
+}
+/**
+ * Returns the slot that contains the given time into the superframe, or
+ * TDMA_SLOTS if it's outside all the slots.
+ */
+uint8_t tdma_slot_at(uint32_t us) {
+  uint32_t ms = us / 1000;
+
+  if (ms < TDMA_FIRST_SLOT_MS) {
+    return TDMA_SLOTS;
+  }
+  ms = (ms - TDMA_FIRST_SLOT_MS) / TDMA_SLOT_MS;
+
+  return (ms < TDMA_SLOTS) ? ms : TDMA_SLOTS;
+}
+
+/**
+ * Returns how far into the superframe it was at time t on the radio's
+ * clock_us, which must be in the past.
+ */
+uint32_t tdma_us_at(uint32_t t, struct radif* radif) {
+  uint32_t secs, us, age;
+
+  /* Read both clocks together */
+  radif->enter_critical();
+  get_timer_time(&secs, &us);
+  age = radif->clock_us() - t;
+  radif->exit_critical();
+
+  return (us + 1000000 - (age % 1000000)) % 1000000;
+}
+
+/**
+ * Called for every frame received. Keeps track of which nodes are using
+ * their slots, and gives new nodes a slot.
+ */
+void tdma_frame_received(struct rx_frame* rx) {
+  struct tdma_schedule* schedule = &tdma_schedules[rx->radif->index];
+  uint8_t slot;
+
+  if (!TDMA_ENABLED || rx->source_address == 0 || rx->source_address >= RADIF_NO_SHORT_ADDRESS) {
+    return;
+  }
+
+  slot = tdma_find_slot(schedule, rx->source_address);
+
+  if (slot == TDMA_SLOTS) { /* New node */
+    schedule->unscheduled++;
+
+    /* Give it the first free slot, it'll hear about it in the next beacon */
+    if ((slot = tdma_find_slot(schedule, 0)) < TDMA_SLOTS) {
+      schedule->slots[slot].address = rx->source_address;
+      schedule->slots[slot].used = 1;
+      schedule->slots[slot].idle = 0;
+    }
+  } else if (tdma_slot_at(tdma_us_at(rx->rx_time, rx->radif)) == slot) {
+    /* By when it started arriving, not when we got round to it */
+    schedule->in_slot++;
+    schedule->slots[slot].used = 1;
+  } else {
+    schedule->out_of_slot++;
+    schedule->slots[slot].used = 1; /* It's still there */
+  }
+}
+
+/**
+ * Frees the slots of nodes we haven't heard from.
+ */
+void tdma_expire_slots(struct tdma_schedule* schedule) {
+  uint8_t i;
+
+  for (i = 0; i < TDMA_SLOTS; i++) {
+    struct tdma_slot* slot = &schedule->slots[i];
+
+    if (slot->address) {
+      if (slot->used) {
+	slot->idle = 0;
+      } else if (++slot->idle >= TDMA_SLOT_EXPIRY) {
+	slot->address = 0;
+      }
+      slot->used = 0;
+    }
+  }
+}
+/**
+ * Called from the radio interrupt once a beacon has gone, or failed to.
+ */
+void tdma_beacon_sent(uint16_t destination_address, uint8_t status, struct radif* radif) {
+  struct tdma_schedule* schedule = &tdma_schedules[radif->index];
+  uint32_t delay = radif->tx_time - schedule->queued_us;
+
+  (void)destination_address;
+
+  if (status == RADIO_SUCCESS && radif->tx_time_known && delay < 1000000) {
+    /* Moving average over about 4 beacons */
+    schedule->tx_delay = (schedule->tx_delay * 3 + delay) / 4;
+  }
+}
+/**
+ * Broadcasts the schedule for this superframe.
+ */
+void tdma_send_beacon(struct tdma_schedule* schedule, struct radif* radif) {
+  uint8_t* beacon = schedule->beacon;
+  uint8_t i, slots = 0;
+  uint32_t secs, us;
+
+  /* Read both clocks together */
+  radif->enter_critical();
+  get_timer_time(&secs, &us);
+  schedule->queued_us = radif->clock_us();
+  radif->exit_critical();
+
+  /* Stamp it with when we expect it to go out */
+  us += schedule->tx_delay;
+  if (us >= 1000000) {
+    secs++;
+    us -= 1000000;
+  }
+
+  beacon[0] = 'B';
+  beacon[1] = secs & 0xFF;
+  beacon[2] = (secs >> 8) & 0xFF;
+  beacon[3] = (secs >> 16) & 0xFF;
+  beacon[4] = (secs >> 24) & 0xFF;
+  beacon[5] = us & 0xFF;
+  beacon[6] = (us >> 8) & 0xFF;
+  beacon[7] = (us >> 16) & 0xFF;
+  beacon[8] = (us >> 24) & 0xFF;
+  beacon[9] = TDMA_SLOT_MS;
+  beacon[10] = TDMA_FIRST_SLOT_MS;
+
+  /* Only send as far as the last slot that's in use */
+  for (i = 0; i < TDMA_SLOTS; i++) {
+    uint8_t* entry = beacon + TDMA_BEACON_HEADER + (2*i);
+
+    entry[0] = schedule->slots[i].address & 0xFF;
+    entry[1] = (schedule->slots[i].address >> 8) & 0xFF;
+
+    if (schedule->slots[i].address) {
+      slots = i + 1;
+    }
+  }
+  beacon[11] = slots;
+
+  radif_send(beacon, TDMA_BEACON_HEADER + (2*slots), 0xFFFF,
+	     RADIF_TX_TIME_CRITICAL | RADIF_TX_SUPERSEDES, tdma_beacon_sent, radif);
+}
+
+/**
+ * Called every tick. Starts a new superframe each time the gateway
+ * clock ticks over.
+ */
+void tdma_service(void) {
+  uint32_t secs, us;
+  uint8_t n;
+
+  if (!TDMA_ENABLED || !is_time_valid()) {
+    return;
+  }
+
+  get_timer_time(&secs, &us);
+
+  if (secs == tdma_superframe) {
+    return;
+  }
+  tdma_superframe = secs;
+
+  for (n = 0; n < RF212_NUM_RADIOS; n++) {
+    if (rf212_radif[n].up) {
+      tdma_expire_slots(&tdma_schedules[n]);
+      tdma_send_beacon(&tdma_schedules[n], &rf212_radif[n]);
+    }
+  }
+}
+/**
+ * Initialises the schedules.
+ */
+void tdma_init(void) {
+  memset(tdma_schedules, 0, sizeof(tdma_schedules));
+  tdma_superframe = 0;
+}
@@ -0,0 +1,128 @@
+/* 
+ * Broadcasts the gateway time for nodes to listen to
+ * Copyright (C) 2013  Richard Meadows
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <string.h>
+#include "time_beacon.h"
+#include "radio.h"
+#include "radio/rf212.h"
+#include "sntp/time.h"
+
+struct time_beacon {
+  uint8_t seq;
+  uint32_t queued_us; /* clock_us when the last beacon was stamped */
+  volatile int32_t correction; /* For the last beacon, set when it's gone */
+  uint8_t packet[TIME_BEACON_LENGTH];
+};
+
+struct time_beacon time_beacons[RF212_NUM_RADIOS];
+uint32_t time_beacon_ticks;
+
+/**
+ * Called from the radio interrupt once a beacon has gone, or failed to.
+ */
+void time_beacon_sent(uint16_t destination_address, uint8_t status, struct radif* radif) {
+  struct time_beacon* beacon = &time_beacons[radif->index];
+
+  (void)destination_address;
+
+  if (status == RADIO_SUCCESS && radif->tx_time_known) {
+    beacon->correction = (int32_t)(radif->tx_time - beacon->queued_us);
+  }
+}
+/**
+ * Stamps a beacon with the time and broadcasts it.
+ */
+void time_beacon_send(struct time_beacon* beacon, struct radif* radif) {
+  uint8_t* packet = beacon->packet;
+  uint64_t time;
+  uint32_t secs, us;
+  int32_t correction;
+
+  /* Read both clocks together, and take the last beacon's correction */
+  radif->enter_critical();
+  get_timer_time(&secs, &us);
+  beacon->queued_us = radif->clock_us();
+  correction = beacon->correction;
+  beacon->correction = TIME_BEACON_NO_CORRECTION;
+  radif->exit_critical();
+
+  /* The top half of the time only changes every 136 years */
+  time = (get_current_time() & 0xFFFFFFFF00000000ULL) | secs;
+
+  beacon->seq++;
+
+  packet[0] = 'M';
+  packet[1] = beacon->seq;
+  packet[2] = time & 0xFF; time >>= 8;
+  packet[3] = time & 0xFF; time >>= 8;
+  packet[4] = time & 0xFF; time >>= 8;
+  packet[5] = time & 0xFF; time >>= 8;
+  packet[6] = time & 0xFF; time >>= 8;
+  packet[7] = time & 0xFF; time >>= 8;
+  packet[8] = time & 0xFF; time >>= 8;
+  packet[9] = time & 0xFF;
+  packet[10] = us & 0xFF;
+  packet[11] = (us >> 8) & 0xFF;
+  packet[12] = (us >> 16) & 0xFF;
+  packet[13] = (us >> 24) & 0xFF;
+  packet[14] = correction & 0xFF;
+  packet[15] = (correction >> 8) & 0xFF;
+  packet[16] = (correction >> 16) & 0xFF;
+  packet[17] = (correction >> 24) & 0xFF;
+
+  /* Broadcast, so there's no ack to wait for after the frame */
+  radif_send(packet, TIME_BEACON_LENGTH, 0xFFFF,
+	     RADIF_TX_TIME_CRITICAL | RADIF_TX_SUPERSEDES, time_beacon_sent, radif);
+}
+
+/**
+ * Called every tick to send the beacons when they're due.
+ */
+void time_beacon_service(void) {
+  uint8_t n;
+
+  time_beacon_ticks++;
+
+  if ((time_beacon_ticks % TIME_BEACON_TICKS) != 0 || !is_time_valid()) {
+    return;
+  }
+
+  for (n = 0; n < RF212_NUM_RADIOS; n++) {
+    if (rf212_radif[n].up) {
+      time_beacon_send(&time_beacons[n], &rf212_radif[n]);
+    }
+  }
+}
+/**
+ * Initialises the time beacons.
+ */
+void time_beacon_init(void) {
+  uint8_t n;
+
+  memset(time_beacons, 0, sizeof(time_beacons));
+  for (n = 0; n < RF212_NUM_RADIOS; n++) {
+    time_beacons[n].correction = TIME_BEACON_NO_CORRECTION;
+  }
+  time_beacon_ticks = 0;
+}